@@ -0,0 +1,161 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "geocode/gazetteer.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+#include <charconv>
+#include <exception>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    std::string_view trim(std::string_view s) {
+        const char whitespace[] = " \t\r";
+        auto first = s.find_first_not_of(whitespace);
+        if (first == s.npos) {return {};}
+        auto last = s.find_last_not_of(whitespace);
+        return s.substr(first, last - first + 1);
+    }
+
+    std::optional<double> parse_number(std::string_view s) {
+        s = trim(s);
+        double value = 0;
+        auto [end, err] = std::from_chars(s.data(), s.data() + s.size(),
+            value);
+        if (err != std::errc() || end != s.data() + s.size() || s.empty()) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // Reads "address,latitude,longitude". The address may be quoted, and
+    // may contain commas even if it is not.
+    std::optional<GazetteerEntry> parse_csv(std::string_view line) {
+        auto lng_sep = line.rfind(',');
+        if (lng_sep == line.npos || lng_sep == 0) {return std::nullopt;}
+        auto lat_sep = line.rfind(',', lng_sep - 1);
+        if (lat_sep == line.npos) {return std::nullopt;}
+        auto latitude = parse_number(line.substr(lat_sep + 1,
+            lng_sep - lat_sep - 1));
+        auto longitude = parse_number(line.substr(lng_sep + 1));
+        if (!latitude || !longitude) {return std::nullopt;}
+        auto field = trim(line.substr(0, lat_sep));
+        std::string address;
+        if (field.size() >= 2 && field.front() == '"'
+            && field.back() == '"')
+        {
+            field = field.substr(1, field.size() - 2);
+            for (std::size_t i = 0; i < field.size(); ++i) {
+                address.push_back(field[i]);
+                if (field[i] == '"' && i + 1 < field.size()
+                    && field[i + 1] == '"')
+                {
+                    ++i;
+                }
+            }
+        } else {
+            address.assign(field);
+        }
+        return GazetteerEntry {std::move(address),
+            Coordinates {*latitude, *longitude}};
+    }
+
+    // Reads {"address": ..., "latitude": ..., "longitude": ...}.
+    GazetteerEntry parse_ndjson(std::string_view line) {
+        auto j = json::parse(line.begin(), line.end());
+        return GazetteerEntry {j.at("address").get<std::string>(),
+            Coordinates {j.at("latitude").get<double>(),
+            j.at("longitude").get<double>()}};
+    }
+
+    std::vector<GazetteerEntry> read_entries(
+        const boost::filesystem::path& path, bool csv)
+    {
+        boost::filesystem::ifstream in(path);
+        if (!in) {throw std::runtime_error("Failed to open " + path.string());}
+        std::vector<GazetteerEntry> entries;
+        std::string line;
+        for (unsigned int number = 1; std::getline(in, line); ++number) {
+            if (trim(line).empty()) {continue;}
+            try {
+                if (!csv) {
+                    entries.push_back(parse_ndjson(line));
+                } else if (auto entry = parse_csv(line)) {
+                    entries.push_back(std::move(*entry));
+                } else if (number != 1) {
+                    // The first line may be a header.
+                    throw std::runtime_error("Expected address, latitude "
+                        "and longitude");
+                }
+            } catch (const std::exception& e) {
+                throw std::runtime_error("Line " + std::to_string(number)
+                    + ": " + e.what());
+            }
+        }
+        return entries;
+    }
+
+    void print_help_header() {
+        auto help = "Gazetteer index builder\n\n"
+            "Builds the index used by the Local backend of the geocoding "
+            "service from\na CSV or NDJSON file of addresses and "
+            "coordinates.\n\n"
+            "Usage: geocode_gazetteer [OPTIONS] --input=<FILE> "
+            "--output=<INDEX>\n";
+        std::cout << help << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        boost::program_options::options_description options("Options");
+        options.add_options()
+            ("format,f", boost::program_options::value<std::string>(),
+                "Input format: \"csv\" (address,latitude,longitude) or "
+                "\"ndjson\" (one object with address, latitude and longitude "
+                "per line) [default: from the input file extension]")
+            ("help,h", "Display help message")
+            ("input,i", boost::program_options::value<std::string>(),
+                "Path to the addresses")
+            ("output,o", boost::program_options::value<std::string>(),
+                "Path to the index to write");
+        boost::program_options::variables_map vm;
+        boost::program_options::store(
+            boost::program_options::parse_command_line(argc, argv, options),
+            vm);
+        boost::program_options::notify(vm);
+        if (vm.count("help")) {
+            print_help_header();
+            std::cout << options << std::endl;
+            return 0;
+        }
+        if (!vm.count("input") || !vm.count("output")) {
+            std::cerr << "Missing \"input\" or \"output\" parameter"
+                << std::endl;
+            return 1;
+        }
+        boost::filesystem::path input = vm["input"].as<std::string>();
+        std::string format = input.extension() == ".csv" ? "csv" : "ndjson";
+        if (vm.count("format")) {format = vm["format"].as<std::string>();}
+        if (format != "csv" && format != "ndjson") {
+            std::cerr << "Invalid \"format\" parameter" << std::endl;
+            return 1;
+        }
+        auto entries = read_entries(input, format == "csv");
+        write_gazetteer(entries, vm["output"].as<std::string>());
+        Gazetteer gazetteer(vm["output"].as<std::string>());
+        std::cout << "Indexed " << gazetteer.size() << " address(es) from "
+            << entries.size() << " line(s)" << std::endl;
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Exiting with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,122 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "admission.hpp"
+#include "metrics.hpp"
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <utility>
+
+AdmissionConfiguration default_admission_config() {
+    return AdmissionConfiguration {10000, 1024, 4096,
+        std::chrono::seconds(1), std::chrono::seconds(1)};
+}
+
+Admission::Admission(const AdmissionConfiguration& config, Priv):
+    config(config),
+    connections(0),
+    shed_connections(0),
+    lookups(0),
+    queued(0),
+    waited(0),
+    shed_queue_full(0),
+    shed_queue_timeout(0)
+{}
+
+std::shared_ptr<Admission> Admission::make(
+    const AdmissionConfiguration& config)
+{
+    return std::make_shared<Admission>(config, Priv {});
+}
+
+bool Admission::admit_connection() {
+    if (connections.fetch_add(1) < config.max_connections) {return true;}
+    connections.fetch_sub(1);
+    ++shed_connections;
+    return false;
+}
+
+void Admission::release_connection() {
+    connections.fetch_sub(1);
+}
+
+void Admission::admit_lookup(boost::asio::any_io_executor executor,
+    std::chrono::steady_clock::time_point deadline, Handler handler)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (lookups < config.max_lookups) {
+        ++lookups;
+        lock.unlock();
+        handler(true);
+        return;
+    }
+    if (queued >= config.max_queued) {
+        ++shed_queue_full;
+        lock.unlock();
+        handler(false);
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto waiter = std::make_shared<Waiter>(Waiter {executor,
+        std::move(handler), boost::asio::steady_timer(executor), now, false});
+    queue.push_back(waiter);
+    ++queued;
+    ++waited;
+    lock.unlock();
+    waiter->timer.expires_at(std::min(deadline, now + config.queue_timeout));
+    waiter->timer.async_wait([this_ = shared_from_this(), waiter] (
+        boost::system::error_code ec)
+    {
+        if (!ec) {this_->expire(waiter);}
+    });
+}
+
+// The slot of the lookup goes to the first waiter, if any.
+void Admission::release_lookup() {
+    std::shared_ptr<Waiter> waiter;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!queue.empty() && !waiter) {
+            if (!queue.front()->done) {waiter = queue.front();}
+            queue.pop_front();
+        }
+        if (!waiter) {
+            --lookups;
+            return;
+        }
+        waiter->done = true;
+        --queued;
+    }
+    // The timer belongs to the executor of the waiter.
+    boost::asio::post(waiter->executor, [waiter] {
+        waiter->timer.cancel();
+        record_queue_wait(std::chrono::steady_clock::now()
+            - waiter->enqueued);
+        waiter->handler(true);
+    });
+}
+
+const AdmissionConfiguration& Admission::configuration() const {
+    return config;
+}
+
+AdmissionStatistics Admission::statistics() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return AdmissionStatistics {connections.load(), lookups, queued, waited,
+        shed_connections.load(), shed_queue_full, shed_queue_timeout};
+}
+
+// Called through the executor of the waiter. Waiters time out mostly in
+// queue order, so that those done at the front of the queue are dropped
+// and the others when a released slot reaches them.
+void Admission::expire(const std::shared_ptr<Waiter>& waiter) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (waiter->done) {return;}
+        waiter->done = true;
+        --queued;
+        ++shed_queue_timeout;
+        while (!queue.empty() && queue.front()->done) {queue.pop_front();}
+    }
+    record_queue_wait(std::chrono::steady_clock::now() - waiter->enqueued);
+    waiter->handler(false);
+}
@@ -0,0 +1,100 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <atomic>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+struct AdmissionConfiguration {
+    // Connections served at once. Further connections are answered with
+    // status 503.
+    std::size_t max_connections;
+    // Lookups to the backend services running at once. Further lookups
+    // wait in a queue.
+    std::size_t max_lookups;
+    // Lookups waiting at once. Further lookups are answered with status 503.
+    std::size_t max_queued;
+    // Lookups waiting longer are answered with status 503.
+    std::chrono::steady_clock::duration queue_timeout;
+    // Sent in the Retry-After header of responses with status 503.
+    std::chrono::seconds retry_after;
+};
+
+AdmissionConfiguration default_admission_config();
+
+struct AdmissionStatistics {
+    std::size_t connections;
+    std::size_t lookups;
+    std::size_t queued;
+    // Lookups that had to wait for a slot.
+    unsigned long long waited;
+    // Work refused because of each limit.
+    unsigned long long shed_connections;
+    unsigned long long shed_queue_full;
+    unsigned long long shed_queue_timeout;
+};
+
+// Bounds the connections served and the lookups sent to the backend services
+// by all event loops, so that the service refuses work it cannot finish in
+// time, e.g. while a backend is slow, instead of piling it up. Lookups past
+// max_lookups wait for a slot in first-in first-out order. Safe to share
+// between threads.
+class Admission: public std::enable_shared_from_this<Admission> {
+private:
+    struct Priv {};
+
+public:
+    // Called with whether the lookup may run.
+    using Handler = std::function<void(bool)>;
+
+    explicit Admission(const AdmissionConfiguration& config, Priv);
+
+    static std::shared_ptr<Admission> make(
+        const AdmissionConfiguration& config);
+
+    // Whether a new connection may be served. Connections served must be
+    // released once closed.
+    bool admit_connection();
+    void release_connection();
+    // Calls handler at once if a slot is free or the queue is full, and
+    // otherwise through executor once a slot frees up or the lookup has
+    // waited until the queue timeout or the deadline, whichever comes first.
+    // Lookups that run must be released once done.
+    void admit_lookup(boost::asio::any_io_executor executor,
+        std::chrono::steady_clock::time_point deadline, Handler handler);
+    void release_lookup();
+    const AdmissionConfiguration& configuration() const;
+    AdmissionStatistics statistics() const;
+
+private:
+    struct Waiter {
+        boost::asio::any_io_executor executor;
+        Handler handler;
+        boost::asio::steady_timer timer;
+        std::chrono::steady_clock::time_point enqueued;
+        // Whether the waiter was granted a slot or timed out.
+        bool done;
+    };
+
+    void expire(const std::shared_ptr<Waiter>& waiter);
+
+private:
+    AdmissionConfiguration config;
+    std::atomic<std::size_t> connections;
+    std::atomic<unsigned long long> shed_connections;
+    mutable std::mutex mutex;
+    std::size_t lookups;
+    // Waiters that are done are skipped and not counted in queued.
+    std::deque<std::shared_ptr<Waiter>> queue;
+    std::size_t queued;
+    unsigned long long waited;
+    unsigned long long shed_queue_full;
+    unsigned long long shed_queue_timeout;
+};
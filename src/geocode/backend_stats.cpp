@@ -0,0 +1,185 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "backend_stats.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    const std::size_t LATENCY_WINDOW = 256;
+    // Fewer samples do not give a meaningful percentile or failure rate.
+    const std::size_t MIN_LATENCY_SAMPLES = 20;
+    const unsigned long long MIN_RATE_SAMPLES = 20;
+    // Weight of the latest lookup in the moving averages.
+    const double LATENCY_WEIGHT = 0.2;
+    const double RATE_WEIGHT = 0.1;
+    // Lower bound of the success rate used to weight latencies, so that the
+    // cost of a mostly failing backend stays finite.
+    const double MIN_SUCCESS_RATE = 0.05;
+
+    void update_average(double& average, double value, double weight) {
+        average += weight * (value - average);
+    }
+}
+
+BreakerConfiguration default_breaker_config() {
+    return BreakerConfiguration {5, 0.5, std::chrono::seconds(30)};
+}
+
+std::string to_string(BreakerState state) {
+    switch (state) {
+    case BreakerState::Closed: return "closed";
+    case BreakerState::Open: return "open";
+    case BreakerState::HalfOpen: return "half-open";
+    }
+    throw std::logic_error("Unreachable");
+}
+
+BackendStats::BackendStats(bool synchronized):
+    synchronized(synchronized)
+{}
+
+bool BackendStats::allow(const std::string& host,
+    const BreakerConfiguration& config)
+{
+    if (config.failure_threshold == 0) {return true;}
+    auto guard = lock();
+    auto it = backends.find(host);
+    if (it == backends.end()) {return true;}
+    auto& backend = it->second;
+    if (backend.state == BreakerState::Closed) {return true;}
+    // A probe that never completed, such as one cancelled because another
+    // backend answered first, does not block the next one for longer than
+    // the open duration.
+    auto now = std::chrono::steady_clock::now();
+    if (now - backend.since < config.open_duration) {return false;}
+    backend.since = now;
+    if (backend.state == BreakerState::Open) {
+        transition(guard, host, backend, BreakerState::HalfOpen);
+    }
+    return true;
+}
+
+double BackendStats::cost(const std::string& host) {
+    auto guard = lock();
+    auto it = backends.find(host);
+    if (it == backends.end()) {return 0;}
+    auto& backend = it->second;
+    if (backend.found + backend.not_found == 0) {
+        return backend.failed == 0 ? 0
+            : std::numeric_limits<double>::infinity();
+    }
+    return backend.latency / std::max(1.0 - backend.failure_rate,
+        MIN_SUCCESS_RATE);
+}
+
+std::vector<BackendHealth> BackendStats::health() {
+    std::vector<BackendHealth> health;
+    auto guard = lock();
+    for (auto& [host, backend]: backends) {
+        health.push_back(BackendHealth {host, backend.state,
+            std::chrono::duration_cast<Duration>(
+            std::chrono::duration<double>(backend.latency)),
+            backend.failure_rate, backend.not_found_rate, backend.found,
+            backend.not_found, backend.failed, backend.trips,
+            backend.latency_buckets, backend.latency_sum});
+    }
+    return health;
+}
+
+std::optional<BackendStats::Duration> BackendStats::latency_percentile(
+    const std::string& host, double percentile)
+{
+    std::vector<Duration> latencies;
+    {
+        auto guard = lock();
+        auto it = backends.find(host);
+        if (it == backends.end()
+            || it->second.latencies.size() < MIN_LATENCY_SAMPLES)
+        {
+            return std::nullopt;
+        }
+        latencies = it->second.latencies;
+    }
+    auto rank = static_cast<std::size_t>(std::ceil(percentile / 100.0
+        * static_cast<double>(latencies.size())));
+    rank = std::clamp<std::size_t>(rank, 1, latencies.size()) - 1;
+    std::nth_element(latencies.begin(), latencies.begin() + rank,
+        latencies.end());
+    return latencies[rank];
+}
+
+void BackendStats::record(const std::string& host, LookupOutcome outcome,
+    std::optional<Duration> latency, const BreakerConfiguration& config)
+{
+    auto guard = lock();
+    auto& backend = backends[host];
+    auto failed = outcome == LookupOutcome::Failed;
+    update_average(backend.failure_rate, failed ? 1 : 0, RATE_WEIGHT);
+    if (failed) {
+        ++backend.failed;
+        ++backend.consecutive_failures;
+        if (config.failure_threshold == 0) {return;}
+        auto samples = backend.found + backend.not_found + backend.failed;
+        if (backend.state == BreakerState::HalfOpen
+            || (backend.state == BreakerState::Closed
+            && (backend.consecutive_failures >= config.failure_threshold
+            || (samples >= MIN_RATE_SAMPLES
+            && backend.failure_rate >= config.failure_rate))))
+        {
+            transition(guard, host, backend, BreakerState::Open);
+        }
+        return;
+    }
+    auto not_found = outcome == LookupOutcome::NotFound;
+    ++(not_found ? backend.not_found : backend.found);
+    update_average(backend.not_found_rate, not_found ? 1 : 0, RATE_WEIGHT);
+    backend.consecutive_failures = 0;
+    if (latency) {
+        auto seconds = std::chrono::duration<double>(*latency).count();
+        if (backend.latency_sum == Duration::zero()) {
+            backend.latency = seconds;
+        } else {
+            update_average(backend.latency, seconds, LATENCY_WEIGHT);
+        }
+        auto ms = std::chrono::duration<double, std::milli>(*latency)
+            .count();
+        auto bucket = std::find_if(LATENCY_BUCKETS_MS.begin(),
+            LATENCY_BUCKETS_MS.end(), [ms] (unsigned int bound) {
+                return ms <= bound;
+            }) - LATENCY_BUCKETS_MS.begin();
+        ++backend.latency_buckets[static_cast<std::size_t>(bucket)];
+        backend.latency_sum += *latency;
+        if (backend.latencies.size() < LATENCY_WINDOW) {
+            backend.latencies.push_back(*latency);
+        } else {
+            backend.latencies[backend.next] = *latency;
+        }
+        backend.next = (backend.next + 1) % LATENCY_WINDOW;
+    }
+    if (backend.state != BreakerState::Closed) {
+        // The failures before the breaker opened no longer count.
+        backend.failure_rate = 0;
+        transition(guard, host, backend, BreakerState::Closed);
+    }
+}
+
+std::unique_lock<std::mutex> BackendStats::lock() {
+    if (!synchronized) {return {};}
+    return std::unique_lock<std::mutex>(mutex);
+}
+
+void BackendStats::transition(std::unique_lock<std::mutex>& guard,
+    const std::string& host, Backend& backend, BreakerState state)
+{
+    if (state == BreakerState::Open) {
+        ++backend.trips;
+        backend.since = std::chrono::steady_clock::now();
+    }
+    backend.state = state;
+    if (guard.owns_lock()) {guard.unlock();}
+    std::cout << "Circuit breaker of backend " << host << " "
+        << to_string(state) << std::endl;
+}
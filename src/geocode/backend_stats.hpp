@@ -0,0 +1,130 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct BreakerConfiguration {
+    // Consecutive failures after which a backend is no longer queried.
+    // Zero disables the circuit breaker.
+    unsigned int failure_threshold;
+    // Recent failure rate after which a backend is no longer queried.
+    double failure_rate;
+    // Time before a backend that is no longer queried is probed again with a
+    // single lookup.
+    std::chrono::steady_clock::duration open_duration;
+};
+
+BreakerConfiguration default_breaker_config();
+
+enum class BreakerState {
+    // The backend is queried.
+    Closed,
+    // The backend failed and is not queried.
+    Open,
+    // Lookups to the backend are let through one at a time, until one
+    // succeeds and closes the breaker or fails and opens it again.
+    HalfOpen
+};
+
+std::string to_string(BreakerState state);
+
+enum class LookupOutcome {
+    Found,
+    NotFound,
+    Failed
+};
+
+// Upper bounds of the latency histogram buckets, in milliseconds. A last
+// bucket counts the slower lookups.
+constexpr std::array<unsigned int, 13> LATENCY_BUCKETS_MS = {1, 2, 5, 10, 25,
+    50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+// Snapshot of the statistics of a backend host.
+struct BackendHealth {
+    std::string host;
+    BreakerState state;
+    // Moving averages, weighting recent lookups more. The latency only
+    // covers lookups that got an answer.
+    std::chrono::steady_clock::duration latency;
+    double failure_rate;
+    double not_found_rate;
+    unsigned long long found;
+    unsigned long long not_found;
+    unsigned long long failed;
+    // Number of times the breaker opened.
+    unsigned long long trips;
+    std::array<unsigned long long, LATENCY_BUCKETS_MS.size() + 1>
+        latency_buckets;
+    std::chrono::steady_clock::duration latency_sum;
+};
+
+// Statistics about recent lookups to each backend host, and a circuit
+// breaker per host keeping failing backends from being queried. Breaker
+// state changes are logged. Synchronized statistics may be used from
+// several threads.
+class BackendStats {
+public:
+    using Duration = std::chrono::steady_clock::duration;
+
+    explicit BackendStats(bool synchronized);
+    BackendStats(const BackendStats&) = delete;
+    BackendStats& operator=(const BackendStats&) = delete;
+
+    // Whether a lookup to the host may start. Starting a lookup to a host
+    // whose breaker is half open counts as its probe.
+    bool allow(const std::string& host, const BreakerConfiguration& config);
+    // Expected time for the host to find a location, accounting for its
+    // failures. Hosts without recorded lookups have a cost of zero, so that
+    // they are tried.
+    double cost(const std::string& host);
+    std::vector<BackendHealth> health();
+    // Latency under which the given percentage of recent lookups completed,
+    // if enough lookups were recorded.
+    std::optional<Duration> latency_percentile(const std::string& host,
+        double percentile);
+    // The latency is left out for lookups not comparable to the others,
+    // such as batch requests.
+    void record(const std::string& host, LookupOutcome outcome,
+        std::optional<Duration> latency, const BreakerConfiguration& config);
+
+private:
+    struct Backend {
+        // Ring of the most recent latencies.
+        std::vector<Duration> latencies;
+        std::size_t next = 0;
+        // Moving averages. The latency is in seconds.
+        double latency = 0;
+        double failure_rate = 0;
+        double not_found_rate = 0;
+        unsigned long long found = 0;
+        unsigned long long not_found = 0;
+        unsigned long long failed = 0;
+        std::array<unsigned long long, LATENCY_BUCKETS_MS.size() + 1>
+            latency_buckets {};
+        Duration latency_sum = Duration::zero();
+        BreakerState state = BreakerState::Closed;
+        unsigned int consecutive_failures = 0;
+        unsigned long long trips = 0;
+        // When the breaker opened, or when the last probe started.
+        std::chrono::steady_clock::time_point since;
+    };
+
+    std::unique_lock<std::mutex> lock();
+    // Changes the state of the breaker of backend, then releases guard and
+    // logs the change. The backend must not be used after.
+    void transition(std::unique_lock<std::mutex>& guard,
+        const std::string& host, Backend& backend, BreakerState state);
+
+private:
+    bool synchronized;
+    std::mutex mutex;
+    std::map<std::string, Backend> backends;
+};
@@ -0,0 +1,353 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "batch.hpp"
+#include "client.hpp"
+#include "location.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+BatchConfiguration default_batch_config() {
+    return BatchConfiguration {1000, 8};
+}
+
+namespace {
+    template <typename Traits, typename = void>
+    struct SupportsBatch: std::false_type {};
+
+    template <typename Traits>
+    struct SupportsBatch<Traits, std::void_t<decltype(Traits::max_batch)>>:
+        std::true_type
+    {};
+
+    // Protocol looking up a fixed set of locations in one request.
+    template <typename Backend>
+    class BatchProtocol {
+    public:
+        using Traits = ProtocolTraits<Backend>;
+
+        explicit BatchProtocol(
+            std::shared_ptr<const Protocol<Backend>> protocol,
+            std::vector<std::string> locations
+        ):
+            protocol(std::move(protocol)),
+            locations(std::move(locations))
+        {}
+
+        const std::string& host() const {return protocol->host();}
+        const std::string& port() const {return protocol->port();}
+        const std::string& authority() const {return protocol->authority();}
+
+        std::vector<ProtocolResult> parse(const Response& resp) const {
+            check_response_status(resp);
+            return Traits::parse_batch(resp, locations.size());
+        }
+
+        void throttle(std::chrono::steady_clock::duration duration) const {
+            protocol->throttle(duration);
+        }
+
+        // The location passed by the client is ignored.
+        void request(std::string_view, std::string&, Request& req) const {
+            Traits::batch_request(protocol->settings(), locations, req);
+            req.set(boost::beast::http::field::host, authority());
+        }
+
+    private:
+        std::shared_ptr<const Protocol<Backend>> protocol;
+        std::vector<std::string> locations;
+    };
+
+    template <typename P>
+    struct BackendOf;
+
+    template <typename Backend>
+    struct BackendOf<std::shared_ptr<const Protocol<Backend>>> {
+        using type = Backend;
+    };
+
+    class BatchFinder: public std::enable_shared_from_this<BatchFinder> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit BatchFinder(std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& finder_config,
+            const BatchConfiguration& config,
+            std::vector<std::string> locations,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor,
+            BatchItemHandler item_handler, BatchDoneHandler done, Priv
+        ):
+            context(std::move(context)),
+            protocols(std::move(protocols)),
+            finder_config(finder_config),
+            config(config),
+            locations(std::move(locations)),
+            deadline(deadline),
+            executor(executor),
+            item_handler(std::move(item_handler)),
+            done(std::move(done)),
+            deadline_timer(executor),
+            not_found(this->locations.size(), false),
+            running(0),
+            remaining(this->locations.size()),
+            expired(false)
+        {}
+
+        static std::shared_ptr<BatchFinder> make(
+            std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& finder_config,
+            const BatchConfiguration& config,
+            std::vector<std::string> locations,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor,
+            BatchItemHandler item_handler, BatchDoneHandler done)
+        {
+            return std::make_shared<BatchFinder>(std::move(context),
+                std::move(protocols), finder_config, config,
+                std::move(locations), deadline, std::move(executor),
+                std::move(item_handler), std::move(done), Priv {});
+        }
+
+        void run() {
+            if (locations.empty()) {
+                boost::asio::post(executor, std::move(done));
+                return;
+            }
+            order_protocols(*context->stats, finder_config, protocols);
+            std::size_t batch_size = 0;
+            if (!protocols.empty()) {
+                batch_size = std::visit([] (const auto& proto) {
+                    using Backend = typename BackendOf<
+                        std::decay_t<decltype(proto)>>::type;
+                    using Traits = ProtocolTraits<Backend>;
+                    if constexpr (SupportsBatch<Traits>::value) {
+                        return Traits::max_batch;
+                    } else {
+                        return std::size_t(0);
+                    }
+                }, protocols.front());
+            }
+            if (batch_size > 0 && !context->stats->allow(
+                protocol_authority(protocols.front()), finder_config.breaker))
+            {
+                batch_size = 0;
+            }
+            if (batch_size > 0) {
+                fallback.assign(protocols.begin() + 1, protocols.end());
+                for (std::size_t i = 0; i < locations.size();
+                    i += batch_size)
+                {
+                    Unit unit {{}, true};
+                    auto end = std::min(i + batch_size, locations.size());
+                    for (auto j = i; j < end; ++j) {
+                        unit.indices.push_back(j);
+                    }
+                    queue.push_back(std::move(unit));
+                }
+            } else {
+                fallback = protocols;
+                for (std::size_t i = 0; i < locations.size(); ++i) {
+                    queue.push_back(Unit {{i}, false});
+                }
+            }
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                auto this_ = shared_from_this();
+                deadline_timer.expires_at(deadline);
+                deadline_timer.async_wait([this_] (
+                    boost::system::error_code ec)
+                {
+                    if (ec || this_->remaining == 0) {return;}
+                    this_->expire();
+                });
+            }
+            start_lookups();
+        }
+
+    private:
+        // Locations looked up by one request.
+        struct Unit {
+            std::vector<std::size_t> indices;
+            bool batched;
+        };
+
+        void emit(std::size_t index, ProtocolResult result) {
+            item_handler(index, std::move(result));
+            if (--remaining > 0) {return;}
+            deadline_timer.cancel();
+            done();
+        }
+
+        // Past the deadline, queued locations fail and batch requests are
+        // cancelled. Single lookups stop at the deadline on their own.
+        void expire() {
+            expired = true;
+            auto queued = std::move(queue);
+            queue.clear();
+            for (auto& unit: queued) {
+                for (auto index: unit.indices) {
+                    emit(index, Error {ErrorKind::BackendFailure,
+                        "Deadline exceeded"});
+                }
+            }
+            for (auto& batch: batches) {
+                if (auto lookup = batch.lock()) {lookup->cancel();}
+            }
+        }
+
+        // Queues a location the batch request did not find for lookup with
+        // the remaining protocols.
+        void fall_back(std::size_t index) {
+            if (expired) {
+                emit(index, Error {ErrorKind::BackendFailure,
+                    "Deadline exceeded"});
+            } else if (fallback.empty()) {
+                auto kind = not_found[index] ? ErrorKind::LocationNotFound
+                    : ErrorKind::BackendFailure;
+                emit(index, Error {kind, ""});
+            } else {
+                queue.push_back(Unit {{index}, false});
+            }
+        }
+
+        void on_batch(const std::vector<std::size_t>& indices,
+            std::variant<std::vector<ProtocolResult>, Error> result)
+        {
+            --running;
+            auto results = std::get_if<std::vector<ProtocolResult>>(&result);
+            if (!expired) {
+                // Batch latencies are not comparable to single lookups.
+                context->stats->record(protocol_authority(protocols.front()),
+                    results ? LookupOutcome::Found : LookupOutcome::Failed,
+                    std::nullopt, finder_config.breaker);
+            }
+            for (std::size_t i = 0; i < indices.size(); ++i) {
+                auto index = indices[i];
+                if (!results) {
+                    fall_back(index);
+                    continue;
+                }
+                auto& item = (*results)[i];
+                auto e = std::get_if<Error>(&item);
+                if (!e) {
+                    emit(index, std::move(item));
+                    continue;
+                }
+                not_found[index] = e->kind == ErrorKind::LocationNotFound;
+                fall_back(index);
+            }
+            start_lookups();
+        }
+
+        void on_coordinates(std::size_t index, ProtocolResult result) {
+            --running;
+            auto e = std::get_if<Error>(&result);
+            if (e && e->kind == ErrorKind::BackendFailure
+                && not_found[index])
+            {
+                result = Error {ErrorKind::LocationNotFound, ""};
+            }
+            emit(index, std::move(result));
+            start_lookups();
+        }
+
+        void start_batch(std::vector<std::size_t> indices) {
+            auto this_ = shared_from_this();
+            std::vector<std::string> batch;
+            batch.reserve(indices.size());
+            for (auto index: indices) {batch.push_back(locations[index]);}
+            auto cont = boost::asio::bind_executor(executor,
+                [this_, indices = std::move(indices)] (auto result) {
+                    this_->on_batch(indices, std::move(result));
+                });
+            auto lookup = std::visit([&] (const auto& proto)
+                -> std::shared_ptr<Lookup>
+            {
+                using Backend = typename BackendOf<
+                    std::decay_t<decltype(proto)>>::type;
+                if constexpr (SupportsBatch<ProtocolTraits<Backend>>::value) {
+                    return async_find_lat_long(context,
+                        std::make_shared<const BatchProtocol<Backend>>(proto,
+                        std::move(batch)), std::string(), std::move(cont));
+                } else {
+                    throw std::logic_error("Unreachable");
+                }
+            }, protocols.front());
+            batches.push_back(lookup);
+        }
+
+        void start_lookups() {
+            while (running < config.concurrency && !queue.empty()) {
+                auto unit = std::move(queue.front());
+                queue.pop_front();
+                ++running;
+                if (unit.batched) {
+                    // Throttled batches fall back to single lookups.
+                    if (!acquire_protocol(protocols.front())) {
+                        count_rate_limit_skip();
+                        --running;
+                        for (auto index: unit.indices) {fall_back(index);}
+                        continue;
+                    }
+                    start_batch(std::move(unit.indices));
+                    continue;
+                }
+                auto index = unit.indices.front();
+                async_find(context, fallback, finder_config,
+                    encode_location(locations[index]), deadline, executor,
+                    std::bind(&BatchFinder::on_coordinates,
+                    shared_from_this(), index, std::placeholders::_1));
+            }
+        }
+
+    private:
+        std::shared_ptr<ClientContext> context;
+        std::vector<AnyProtocol> protocols;
+        // Protocols used for locations not found by a batch request, or for
+        // all locations if the first protocol has no batch request.
+        std::vector<AnyProtocol> fallback;
+        FinderConfiguration finder_config;
+        BatchConfiguration config;
+        std::vector<std::string> locations;
+        std::chrono::steady_clock::time_point deadline;
+        boost::asio::any_io_executor executor;
+        BatchItemHandler item_handler;
+        BatchDoneHandler done;
+        boost::asio::steady_timer deadline_timer;
+        std::deque<Unit> queue;
+        std::vector<std::weak_ptr<Lookup>> batches;
+        // Whether a batch request reported each location as unknown.
+        std::vector<bool> not_found;
+        // Number of requests in flight.
+        std::size_t running;
+        // Number of locations without a result.
+        std::size_t remaining;
+        bool expired;
+    };
+}
+
+void async_find_batch(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols,
+    const FinderConfiguration& finder_config,
+    const BatchConfiguration& config, std::vector<std::string> locations,
+    std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, BatchItemHandler item_handler,
+    BatchDoneHandler done)
+{
+    auto finder = BatchFinder::make(std::move(context), std::move(protocols),
+        finder_config, config, std::move(locations), deadline,
+        std::move(executor), std::move(item_handler), std::move(done));
+    finder->run();
+}
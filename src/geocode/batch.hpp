@@ -0,0 +1,42 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "client_context.hpp"
+#include "finder.hpp"
+#include "protocol.hpp"
+#include <boost/asio/any_io_executor.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BatchConfiguration {
+    // Maximum number of locations in one batch request.
+    std::size_t max_locations;
+    // Maximum number of backend lookups in flight for one batch request.
+    std::size_t concurrency;
+};
+
+BatchConfiguration default_batch_config();
+
+// Called with the index of a location and its result.
+using BatchItemHandler = std::function<void(std::size_t, ProtocolResult)>;
+using BatchDoneHandler = std::function<void()>;
+
+// Looks up each location as async_find does, running at most
+// config.concurrency backend lookups at once. The locations are not
+// URL-encoded. Each result is passed to item_handler as soon as it is known,
+// and done is called once all locations have a result. If the first protocol
+// can look up several locations in one request, locations are sent to it in
+// batches and those it does not find are looked up one at a time with the
+// remaining protocols. Handlers are invoked through executor.
+void async_find_batch(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols,
+    const FinderConfiguration& finder_config,
+    const BatchConfiguration& config, std::vector<std::string> locations,
+    std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, BatchItemHandler item_handler,
+    BatchDoneHandler done);
@@ -0,0 +1,436 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "bulk.hpp"
+#include "disk_cache.hpp"
+#include "finder.hpp"
+#include "location.hpp"
+#include "result_json.hpp"
+#include "tls_context.hpp"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    const char CSV_HEADER[] = "index,location,latitude,longitude,error\n";
+
+    // Records read ahead of the first one not written yet, per lookup in
+    // flight, when writing in input order. Bounds the results held back
+    // behind a slow lookup.
+    const std::size_t REORDER_WINDOW_PER_LOOKUP = 64;
+
+    std::string_view trim_line(std::string_view line) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+            line.remove_suffix(1);
+        }
+        return line;
+    }
+
+    // Reads a field of a line of comma-separated values. Quoted fields may
+    // contain commas and doubled quotes.
+    std::optional<std::string> csv_field(std::string_view line,
+        std::size_t column)
+    {
+        std::size_t current = 0;
+        std::string field;
+        bool quoted = false;
+        for (std::size_t i = 0; i <= line.size(); ++i) {
+            if (i == line.size() || (!quoted && line[i] == ',')) {
+                if (current == column) {return field;}
+                ++current;
+                field.clear();
+                continue;
+            }
+            if (line[i] != '"') {
+                field.push_back(line[i]);
+            } else if (quoted && i + 1 < line.size() && line[i + 1] == '"') {
+                field.push_back('"');
+                ++i;
+            } else {
+                quoted = !quoted;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void append_csv_field(std::string& out, std::string_view field) {
+        if (field.find_first_of(",\"\r\n") == field.npos) {
+            out.append(field);
+            return;
+        }
+        out.push_back('"');
+        for (char c: field) {
+            if (c == '"') {out.push_back('"');}
+            out.push_back(c);
+        }
+        out.push_back('"');
+    }
+
+    template <typename T>
+    void append_number(std::string& out, T value) {
+        char buf[32];
+        auto end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        out.append(buf, static_cast<std::size_t>(end - buf));
+    }
+
+    void append_csv_row(std::string& out, std::size_t index,
+        std::string_view location, const ProtocolResult& result)
+    {
+        append_number(out, index);
+        out.push_back(',');
+        append_csv_field(out, location);
+        out.push_back(',');
+        if (auto coords = std::get_if<Coordinates>(&result)) {
+            append_number(out, coords->latitude);
+            out.push_back(',');
+            append_number(out, coords->longitude);
+            out.append(",\n");
+            return;
+        }
+        out.append(",,");
+        out.append(to_string(std::get<Error>(result).kind));
+        out.push_back('\n');
+    }
+
+    // Indices of the records with a result in the output. A last line
+    // without a newline was cut short by an interruption and is removed.
+    std::vector<bool> read_checkpoint(const boost::filesystem::path& path,
+        BulkFormat format)
+    {
+        std::vector<bool> done;
+        boost::filesystem::ifstream is(path, std::ios::binary);
+        if (!is) {return done;}
+        std::uintmax_t complete = 0;
+        std::string line;
+        bool first = true;
+        while (std::getline(is, line)) {
+            if (is.eof()) {break;}
+            complete += line.size() + 1;
+            auto header = std::exchange(first, false)
+                && format == BulkFormat::Csv;
+            if (header || trim_line(line).empty()) {continue;}
+            std::size_t index = 0;
+            if (format == BulkFormat::Csv) {
+                auto [end, err] = std::from_chars(line.data(),
+                    line.data() + line.size(), index);
+                if (err != std::errc()) {
+                    throw std::runtime_error("Invalid output line: " + line);
+                }
+            } else {
+                index = json::parse(line).at("index").get<std::size_t>();
+            }
+            if (index >= done.size()) {done.resize(index + 1, false);}
+            done[index] = true;
+        }
+        is.close();
+        if (complete != boost::filesystem::file_size(path)) {
+            boost::filesystem::resize_file(path, complete);
+        }
+        return done;
+    }
+
+    // Time until the rate limit of one of the services skipped by a lookup
+    // lets a request through.
+    std::chrono::steady_clock::duration rate_limit_delay(
+        const std::vector<AnyProtocol>& protocols)
+    {
+        std::optional<std::chrono::steady_clock::duration> delay;
+        for (auto& protocol: protocols) {
+            auto d = protocol_delay(protocol);
+            if (d > d.zero() && (!delay || d < *delay)) {delay = d;}
+        }
+        return delay.value_or(std::chrono::steady_clock::duration::zero());
+    }
+
+    class BulkJob {
+    public:
+        explicit BulkJob(const ServiceConfiguration& config,
+            const BulkOptions& options
+        ):
+            config(config),
+            options(options),
+            client_context(std::make_shared<ClientContext>(ioc,
+                config.client, std::make_shared<TlsContexts>(config.client.tls),
+                false)),
+            summary {0, 0, 0, 0, 0, 0},
+            in_flight(0),
+            next_to_write(0),
+            unflushed(0),
+            written(0),
+            eof(false),
+            header_pending(options.header && options.format == BulkFormat::Csv)
+        {
+            if (!config.disk_cache.path.empty()) {
+                disk_cache = std::make_unique<DiskCache>(config.disk_cache);
+            }
+            input.open(options.input, std::ios::binary);
+            if (!input) {
+                throw std::runtime_error("Failed to open "
+                    + options.input.string());
+            }
+            if (options.resume) {
+                done = read_checkpoint(options.output, options.format);
+            }
+            bool fresh = !options.resume
+                || !boost::filesystem::exists(options.output)
+                || boost::filesystem::file_size(options.output) == 0;
+            output.open(options.output, std::ios::binary
+                | (fresh ? std::ios::trunc : std::ios::app));
+            if (!output) {
+                throw std::runtime_error("Failed to open "
+                    + options.output.string());
+            }
+            if (fresh && options.format == BulkFormat::Csv) {
+                output << CSV_HEADER;
+            }
+        }
+
+        BulkSummary run() {
+            boost::asio::post(ioc, [this] {fill();});
+            ioc.run();
+            output.flush();
+            if (!output) {throw std::runtime_error("Failed to write output");}
+            return summary;
+        }
+
+    private:
+        // Finds the result of a record among earlier ones, in the disk cache
+        // or with the backend services.
+        void dispatch(std::size_t index, std::string location) {
+            auto encoded = encode_location(location);
+            auto key = normalize_location(encoded);
+            auto [it, inserted] = lookups.try_emplace(key);
+            auto& entry = it->second;
+            if (!inserted) {
+                ++summary.duplicates;
+                if (entry.result) {
+                    write(index, location, *entry.result);
+                } else {
+                    entry.waiting.emplace_back(index, std::move(location));
+                }
+                return;
+            }
+            if (disk_cache) {
+                if (auto coords = disk_cache->find(key)) {
+                    entry.result = *coords;
+                    write(index, location, *entry.result);
+                    return;
+                }
+            }
+            entry.waiting.emplace_back(index, std::move(location));
+            ++in_flight;
+            ++summary.lookups;
+            look_up(std::move(key), std::move(encoded));
+        }
+
+        // The handler keeps the encoded location to retry the lookup.
+        void look_up(std::string key, std::string encoded) {
+            auto location = encoded;
+            async_find(client_context, config.protocols, config.finder,
+                std::move(location),
+                std::chrono::steady_clock::time_point::max(),
+                ioc.get_executor(), [this, key = std::move(key),
+                encoded = std::move(encoded)] (ProtocolResult result) mutable
+                {
+                    on_result(std::move(key), std::move(encoded),
+                        std::move(result));
+                });
+        }
+
+        // Looks up a location again once the rate limits that made the
+        // services skip it let a request through. The lookup stays in
+        // flight meanwhile, so that no more records are read.
+        void retry(std::string key, std::string encoded) {
+            ++summary.throttled;
+            auto timer = std::make_shared<boost::asio::steady_timer>(ioc,
+                rate_limit_delay(config.protocols));
+            timer->async_wait([this, timer, key = std::move(key),
+                encoded = std::move(encoded)] (boost::system::error_code)
+                mutable
+                {
+                    look_up(std::move(key), std::move(encoded));
+                });
+        }
+
+        // Reads records until enough lookups are in flight. Stops the
+        // event loop once all records have a result, since idle backend
+        // connections keep it busy.
+        void fill() {
+            while (!eof && in_flight < options.concurrency
+                && (options.order == BulkOrder::Completion
+                || held_back() < options.concurrency
+                * REORDER_WINDOW_PER_LOOKUP))
+            {
+                auto location = read_record();
+                if (!location) {
+                    eof = true;
+                    break;
+                }
+                auto index = summary.records++;
+                if (index < done.size() && done[index]) {
+                    ++summary.resumed;
+                    write_ready();
+                    continue;
+                }
+                dispatch(index, std::move(*location));
+            }
+            write_ready();
+            if (eof && in_flight == 0) {ioc.stop();}
+        }
+
+        // Records read whose results are not written yet, in input order.
+        std::size_t held_back() const {
+            return summary.records > next_to_write
+                ? summary.records - next_to_write : 0;
+        }
+
+        // A lookup skipped by rate limits is retried rather than written,
+        // since the output is the checkpoint of the run.
+        void on_result(std::string key, std::string encoded,
+            ProtocolResult result)
+        {
+            if (auto e = std::get_if<Error>(&result);
+                e && e->cause == RATE_LIMITED)
+            {
+                retry(std::move(key), std::move(encoded));
+                return;
+            }
+            --in_flight;
+            auto& entry = lookups[key];
+            if (disk_cache) {
+                if (auto coords = std::get_if<Coordinates>(&result)) {
+                    disk_cache->insert(key, *coords);
+                }
+            }
+            entry.result = std::move(result);
+            auto waiting = std::move(entry.waiting);
+            entry.waiting.clear();
+            for (auto& [index, location]: waiting) {
+                write(index, location, *entry.result);
+            }
+            fill();
+        }
+
+        // Returns nothing at the end of the input.
+        std::optional<std::string> read_record() {
+            std::string line;
+            while (std::getline(input, line)) {
+                auto content = trim_line(line);
+                if (content.empty()) {continue;}
+                if (options.format == BulkFormat::Ndjson) {
+                    auto j = json::parse(content.begin(), content.end());
+                    if (j.is_string()) {return j.get<std::string>();}
+                    if (j.count("location")) {
+                        return j.at("location").get<std::string>();
+                    }
+                    return j.at("address").get<std::string>();
+                }
+                if (std::exchange(header_pending, false)) {continue;}
+                auto field = csv_field(content, options.column);
+                if (!field) {
+                    throw std::runtime_error("Missing address column: "
+                        + line);
+                }
+                return field;
+            }
+            return std::nullopt;
+        }
+
+        void write(std::size_t index, std::string_view location,
+            const ProtocolResult& result)
+        {
+            if (std::holds_alternative<Error>(result)) {++summary.failed;}
+            std::string line;
+            if (options.format == BulkFormat::Csv) {
+                append_csv_row(line, index, location, result);
+            } else {
+                append_batch_line(line, index, result);
+            }
+            if (options.order == BulkOrder::Completion) {
+                write_line(line);
+                return;
+            }
+            held.emplace(index, std::move(line));
+        }
+
+        void write_line(const std::string& line) {
+            output << line;
+            ++written;
+            if (++unflushed < options.checkpoint_interval) {return;}
+            unflushed = 0;
+            output.flush();
+            if (!output) {throw std::runtime_error("Failed to write output");}
+            std::cout << written << " records written" << std::endl;
+        }
+
+        // Writes the results held back until those of earlier records.
+        void write_ready() {
+            while (true) {
+                while (next_to_write < done.size() && done[next_to_write]) {
+                    ++next_to_write;
+                }
+                auto it = held.begin();
+                if (it == held.end() || it->first != next_to_write) {break;}
+                write_line(it->second);
+                held.erase(it);
+                ++next_to_write;
+            }
+        }
+
+    private:
+        // Result of an address, or the records waiting for it.
+        struct Entry {
+            std::optional<ProtocolResult> result;
+            std::vector<std::pair<std::size_t, std::string>> waiting;
+        };
+
+    private:
+        const ServiceConfiguration& config;
+        const BulkOptions& options;
+        boost::asio::io_context ioc;
+        std::shared_ptr<ClientContext> client_context;
+        std::unique_ptr<DiskCache> disk_cache;
+        boost::filesystem::ifstream input;
+        boost::filesystem::ofstream output;
+        BulkSummary summary;
+        // Records already in the output when resuming.
+        std::vector<bool> done;
+        // Keyed by normalized location.
+        std::unordered_map<std::string, Entry> lookups;
+        std::size_t in_flight;
+        // Lines waiting for the results of earlier records, in input order.
+        std::map<std::size_t, std::string> held;
+        std::size_t next_to_write;
+        std::size_t unflushed;
+        std::size_t written;
+        bool eof;
+        bool header_pending;
+    };
+}
+
+BulkSummary run_bulk(const ServiceConfiguration& config,
+    const BulkOptions& options)
+{
+    if (options.concurrency == 0 || options.checkpoint_interval == 0) {
+        throw std::invalid_argument("Invalid batch options. concurrency and "
+            "checkpoint_interval must be positive.");
+    }
+    BulkJob job(config, options);
+    return job.run();
+}
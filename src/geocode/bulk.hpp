@@ -0,0 +1,71 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "service.hpp"
+#include <boost/filesystem/path.hpp>
+#include <cstddef>
+
+enum class BulkFormat {
+    // One address per line, in a column of comma-separated values.
+    Csv,
+    // One JSON string, or object with a location or address member, per
+    // line.
+    Ndjson
+};
+
+enum class BulkOrder {
+    // Results are written in the order of the input.
+    Input,
+    // Results are written as they complete.
+    Completion
+};
+
+struct BulkOptions {
+    boost::filesystem::path input;
+    boost::filesystem::path output;
+    BulkFormat format;
+    // Column of the address in CSV input, from 0.
+    std::size_t column;
+    // Whether CSV input starts with a header line.
+    bool header;
+    BulkOrder order;
+    // Lookups in flight at once over all backend services.
+    std::size_t concurrency;
+    // Results written between flushes of the output.
+    std::size_t checkpoint_interval;
+    // Whether to keep the results already in the output and only look up
+    // the other records.
+    bool resume;
+};
+
+struct BulkSummary {
+    // Records read from the input, including those resumed.
+    std::size_t records;
+    // Records with a result in the output from a previous run.
+    std::size_t resumed;
+    // Records written with an error result.
+    std::size_t failed;
+    // Lookups sent to the backend services.
+    std::size_t lookups;
+    // Records whose address appeared earlier in the input.
+    std::size_t duplicates;
+    // Lookups retried because the backend services were skipped for their
+    // rate limits.
+    std::size_t throttled;
+};
+
+// Geocodes the addresses of a file with the backend services of config,
+// writing a result per record to the output in the format of the input:
+// batch response lines tagged with the record index for NDJSON, and
+// index,location,latitude,longitude,error rows for CSV. Input is read as
+// lookups complete, so that files of any size are streamed. Each distinct
+// address is looked up once, from the disk cache when one is configured.
+// The output is flushed every checkpoint_interval results, and serves as
+// the checkpoint of an interrupted run: resuming reads the indices it
+// holds, drops a truncated last line and appends the missing results.
+// Lookups skipped by the rate limits of the backend services wait for the
+// limits and are retried, rather than written as errors. Runs on the
+// calling thread.
+BulkSummary run_bulk(const ServiceConfiguration& config,
+    const BulkOptions& options);
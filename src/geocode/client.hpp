@@ -2,153 +2,471 @@
 
 #pragma once
 
+#include "client_context.hpp"
+#include "connection_pool.hpp"
+#include "dns_cache.hpp"
+#include "handler_memory.hpp"
+#include "location.hpp"
+#include "lookup.hpp"
+#include "metrics.hpp"
 #include "protocol.hpp"
+#include "protocol_local.hpp"
+#include "timeouts.hpp"
+#include "tls_context.hpp"
+#include <algorithm>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/connect.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast.hpp>
 #include <boost/system/error_code.hpp>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
 #include <utility>
 
+#ifdef GEOCODE_COROUTINES
+#include "coro_client.hpp"
+#endif
+
+// Runs a lookup against one backend. Intermediate handlers and the
+// continuation run through the continuation's associated executor, which
+// defaults to the io_context's. Each stage of the lookup, and the lookup as
+// a whole, is bounded by the timeouts of the context's configuration.
 template <typename Protocol, typename F>
-class Client: public std::enable_shared_from_this<Client<Protocol, F>> {
+class Client: public Lookup,
+    public std::enable_shared_from_this<Client<Protocol, F>>
+{
 private:
     struct Priv {};
+    using Result = ClientResult<Protocol>;
 
 public:
-    explicit Client(boost::asio::io_context& ioc, Protocol protocol,
-        std::string location, F cont, Priv
+    explicit Client(std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const Protocol> protocol, std::string location,
+        F cont, Priv
     ):
+        context(std::move(context)),
         protocol(std::move(protocol)),
         location(std::move(location)),
         continuation(std::move(cont)),
-        resolver(ioc),
-        ssl_context(boost::asio::ssl::context::tlsv12_client),
-        stream(ioc, ssl_context)
+        executor(boost::asio::get_associated_executor(continuation,
+            this->context->ioc.get_executor())),
+        timer(executor),
+        authority(this->protocol->authority()),
+        stage(ClientStage::Acquire),
+        generation(0),
+        timing_stage(false),
+        holds_slot(false),
+        reconnected(false),
+        cancelled(false),
+        finished(false),
+        buffers(this->context->buffers->acquire([] {
+            return std::make_unique<ClientBuffers>();
+        }))
     {}
-    
-    static std::shared_ptr<Client> make(boost::asio::io_context& ioc,
-        Protocol protocol, std::string location, F cont)
+
+    ~Client() {
+        if (holds_slot) {context->pool->discard(authority);}
+    }
+
+    static std::shared_ptr<Client> make(std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const Protocol> protocol, std::string location,
+        F cont)
     {
-        return std::make_shared<Client>(ioc, std::move(protocol),
-            std::move(location), std::move(cont), Priv {});
+        return std::make_shared<Client>(std::move(context),
+            std::move(protocol), std::move(location), std::move(cont),
+            Priv {});
     }
 
-    void run() {resolve();}
+    void cancel() override {
+        cancelled = true;
+        if (connection) {
+            boost::system::error_code ec;
+            connection->stream.lowest_layer().close(ec);
+        }
+    }
+
+    void run() {
+        auto this_ = this->shared_from_this();
+        deadline = std::chrono::steady_clock::now()
+            + context->config.timeouts.total;
+        enter(ClientStage::Acquire);
+        context->pool->acquire(authority, executor, std::bind(
+            &Client::on_acquired, this_, std::placeholders::_1));
+    }
 
 private:
+    void complete(Result result) {
+        if (finished) {return;}
+        finished = true;
+        end_stage();
+        timer.cancel();
+        continuation(std::move(result));
+    }
+
+    void connect() {
+        connection = std::make_unique<Connection>(context->ioc,
+            context->tls->context(protocol->host()));
+        try {
+            context->tls->prepare(connection->stream, protocol->host());
+        } catch (const std::exception& e) {
+            finish_with_error(ErrorKind::BackendFailure, e.what());
+            return;
+        }
+        resolve();
+    }
+
+    void drop_connection() {
+        if (connection) {
+            boost::system::error_code ec;
+            connection->stream.lowest_layer().close(ec);
+            connection.reset();
+        }
+        if (holds_slot) {
+            holds_slot = false;
+            context->pool->discard(authority);
+        }
+    }
+
+    // Records the duration of the current stage, once.
+    void end_stage() {
+        if (!timing_stage) {return;}
+        timing_stage = false;
+        record_client_stage(stage, std::chrono::steady_clock::now()
+            - stage_start);
+    }
+
+    // Arms the timer for a stage. The shutdown stage is not bounded by the
+    // overall deadline since the result is already known by then.
+    void enter(ClientStage next) {
+        end_stage();
+        stage = next;
+        stage_start = std::chrono::steady_clock::now();
+        timing_stage = true;
+        auto expiry = stage_start + context->config.timeouts.stage(stage);
+        if (stage != ClientStage::Shutdown) {
+            expiry = std::min(expiry, deadline);
+        }
+        auto this_ = this->shared_from_this();
+        timer.expires_at(expiry);
+        timer.async_wait(wrap([this_, g = ++generation] (
+            boost::system::error_code ec)
+        {
+            if (ec || g != this_->generation) {return;}
+            this_->on_timeout();
+        }));
+    }
+
     void finish_with_error(boost::system::error_code ec) {
         finish_with_error(ErrorKind::BackendFailure, ec.message());
     }
 
     void finish_with_error(ErrorKind kind, std::string cause) {
+        drop_connection();
         Error e{kind, std::move(cause)};
-        continuation(ProtocolResult{std::move(e)});
+        complete(Result{std::move(e)});
+    }
+
+    void finish_with_response() {
+        end_stage();
+        auto parse_start = std::chrono::steady_clock::now();
+        Result result;
+        try {
+            result = protocol->parse(buffers->response);
+        } catch (const LocationNotFoundError& e) {
+            result = Error {ErrorKind::LocationNotFound, e.what()};
+        } catch (const ThrottledError& e) {
+            protocol->throttle(e.retry_after());
+            result = Error {ErrorKind::BackendFailure, e.what()};
+        } catch (const std::exception& e) {
+            result = Error {ErrorKind::BackendFailure, e.what()};
+        }
+        record_response_parse(std::chrono::steady_clock::now() - parse_start);
+        complete(std::move(result));
+    }
+
+    // A pooled connection may have been closed by the server while idle.
+    // Requests are idempotent, so they are retried once on a new connection.
+    void on_exchange_error(boost::system::error_code ec) {
+        if (connection->uses == 0 || reconnected || cancelled) {
+            finish_with_error(ec);
+            return;
+        }
+        reconnected = true;
+        boost::system::error_code close_ec;
+        connection->stream.lowest_layer().close(close_ec);
+        buffers->buffer.consume(buffers->buffer.size());
+        buffers->response = Response {};
+        connect();
+    }
+
+    void on_acquired(std::unique_ptr<Connection> conn) {
+        holds_slot = true;
+        if (cancelled) {
+            if (conn) {
+                holds_slot = false;
+                context->pool->release(authority, std::move(conn));
+            }
+            finish_with_error(boost::asio::error::operation_aborted);
+            return;
+        }
+        if (!conn) {
+            connect();
+            return;
+        }
+        connection = std::move(conn);
+        send_request();
     }
-    
+
     void on_connect(boost::system::error_code ec) {
         auto this_ = this->shared_from_this();
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
         if (ec) {
             finish_with_error(ec);
             return;
         }
-        stream.async_handshake(boost::asio::ssl::stream_base::client,
-            std::bind(&Client::on_handshake, this_, std::placeholders::_1));
+        enter(ClientStage::Handshake);
+        connection->stream.async_handshake(
+            boost::asio::ssl::stream_base::client, wrap(std::bind(
+            &Client::on_handshake, this_, std::placeholders::_1)));
     }
 
     void on_handshake(boost::system::error_code ec) {
-        auto this_ = this->shared_from_this();
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
         if (ec) {
             finish_with_error(ec);
             return;
         }
-        request = protocol.request(location);
-        boost::beast::http::async_write(stream, request, std::bind(
-            &Client::on_request_sent, this_, std::placeholders::_1,
-            std::placeholders::_2));
+        context->tls->on_handshake(connection->stream);
+        send_request();
     }
 
     void on_request_sent(boost::system::error_code ec, std::size_t) {
         auto this_ = this->shared_from_this();
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
         if (ec) {
-            finish_with_error(ec);
+            on_exchange_error(ec);
             return;
         }
-        boost::beast::http::async_read(stream, buffer, response, std::bind(
-            &Client::on_response, this_, std::placeholders::_1,
-            std::placeholders::_2));
+        enter(ClientStage::Read);
+        boost::beast::http::async_read(connection->stream, buffers->buffer,
+            buffers->response, wrap(std::bind(&Client::on_response, this_,
+            std::placeholders::_1, std::placeholders::_2)));
     }
 
     void on_resolve(boost::system::error_code ec,
-        boost::asio::ip::tcp::resolver::results_type results)
+        DnsCache::Endpoints endpoints)
     {
         auto this_ = this->shared_from_this();
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
         if (ec) {
             finish_with_error(ec);
             return;
         }
-        boost::asio::async_connect(stream.next_layer(), results.begin(),
-            results.end(), std::bind(&Client::on_connect, this_,
-            std::placeholders::_1));
+        enter(ClientStage::Connect);
+        boost::asio::async_connect(connection->stream.next_layer(), endpoints,
+            wrap(std::bind(&Client::on_connect, this_,
+            std::placeholders::_1)));
     }
 
     void on_response(boost::system::error_code ec, std::size_t) {
         auto this_ = this->shared_from_this();
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
         if (ec) {
-            finish_with_error(ec);
+            on_exchange_error(ec);
             return;
         }
-        stream.async_shutdown(std::bind(&Client::on_shutdown, this_,
-            std::placeholders::_1));
+        ++connection->uses;
+        if (buffers->response.keep_alive() && buffers->buffer.size() == 0) {
+            holds_slot = false;
+            context->pool->release(authority, std::move(connection));
+            finish_with_response();
+            return;
+        }
+        // The result does not depend on the shutdown, so it is delivered
+        // first.
+        finish_with_response();
+        enter(ClientStage::Shutdown);
+        connection->stream.async_shutdown(wrap(std::bind(&Client::on_shutdown,
+            this_, std::placeholders::_1)));
     }
 
     void on_shutdown(boost::system::error_code) {
-        Coordinates coords{};
-        try {
-            coords = protocol.parse(response);
-        } catch (const std::exception& e) {
-            finish_with_error(ErrorKind::BackendFailure, e.what());
-            return;
-        }
-        continuation(ProtocolResult {coords});
+        end_stage();
+        timer.cancel();
+        drop_connection();
+    }
+
+    // Cancels the pending operation, whose own completion is then ignored,
+    // and reports the stage that timed out.
+    void on_timeout() {
+        auto cause = to_string(stage) + " timed out";
+        cancel();
+        if (stage == ClientStage::Shutdown) {return;}
+        complete(Error {ErrorKind::BackendFailure, std::move(cause)});
     }
 
     void resolve() {
         auto this_ = this->shared_from_this();
-        resolver.async_resolve(protocol.host(), "https",
-            std::bind(&Client::on_resolve, this_, std::placeholders::_1,
-            std::placeholders::_2));
+        enter(ClientStage::Resolve);
+        context->dns->async_resolve(protocol->host(), protocol->port(),
+            executor, std::bind(&Client::on_resolve, this_,
+            std::placeholders::_1, std::placeholders::_2));
+    }
+
+    void send_request() {
+        auto this_ = this->shared_from_this();
+        protocol->request(location, buffers->target, buffers->request);
+        buffers->request.keep_alive(true);
+        enter(ClientStage::Write);
+        boost::beast::http::async_write(connection->stream,
+            buffers->request, wrap(std::bind(&Client::on_request_sent, this_,
+            std::placeholders::_1, std::placeholders::_2)));
+    }
+
+    // Binds a handler to the client's executor and arena.
+    template <typename Handler>
+    auto wrap(Handler handler) {
+        return boost::asio::bind_executor(executor,
+            bind_arena(buffers->memory, std::move(handler)));
     }
 
 private:
-    Protocol protocol;
+    std::shared_ptr<ClientContext> context;
+    std::shared_ptr<const Protocol> protocol;
     std::string location;
     F continuation;
-    boost::asio::ip::tcp::resolver resolver;
-    boost::asio::ssl::context ssl_context;
-    boost::asio::ssl::stream<boost::asio::ip::tcp::socket> stream;
-    Request request;
-    boost::beast::flat_buffer buffer;
-    Response response;
+    boost::asio::any_io_executor executor;
+    boost::asio::steady_timer timer;
+    // Owned by the protocol. Identifies the service in the connection pool.
+    const std::string& authority;
+    std::unique_ptr<Connection> connection;
+    std::chrono::steady_clock::time_point deadline;
+    ClientStage stage;
+    std::chrono::steady_clock::time_point stage_start;
+    // Identifies the latest stage timer, so that the expiry of an earlier
+    // one racing with a new stage is ignored.
+    unsigned int generation;
+    // Whether the current stage is yet to be recorded in the metrics.
+    bool timing_stage;
+    bool holds_slot;
+    bool reconnected;
+    bool cancelled;
+    bool finished;
+    // Pooled, so that buffer capacity is kept between lookups.
+    std::shared_ptr<ClientBuffers> buffers;
 };
 
 template <typename Protocol, typename F>
-std::shared_ptr<Client<Protocol, F>> make_client(boost::asio::io_context& ioc,
-    Protocol protocol, std::string location, F cont)
+std::shared_ptr<Client<Protocol, F>> make_client(
+    std::shared_ptr<ClientContext> context,
+    std::shared_ptr<const Protocol> protocol, std::string location, F cont)
 {
-    return Client<Protocol, F>::make(ioc, std::move(protocol),
+    return Client<Protocol, F>::make(std::move(context), std::move(protocol),
         std::move(location), std::move(cont));
 }
 
 template <typename Protocol, typename F>
-void async_find_lat_long(boost::asio::io_context& ioc, Protocol protocol,
-    std::string location, F cont)
+std::shared_ptr<Lookup> async_find_lat_long(
+    std::shared_ptr<ClientContext> context,
+    std::shared_ptr<const Protocol> protocol, std::string location, F cont)
 {
-    auto client = make_client(ioc, std::move(protocol), std::move(location),
-        std::move(cont));
+#ifdef GEOCODE_COROUTINES
+    auto client = CoroClient<Protocol, F>::make(std::move(context),
+        std::move(protocol), std::move(location), std::move(cont));
+#else
+    auto client = make_client(std::move(context), std::move(protocol),
+        std::move(location), std::move(cont));
+#endif
     client->run();
+    return client;
+}
+
+// Looks up a location in a local gazetteer. The result is known at once; it
+// is still passed to the continuation through its executor, after this
+// function returns.
+template <typename F>
+class LocalLookup: public Lookup,
+    public std::enable_shared_from_this<LocalLookup<F>>
+{
+private:
+    struct Priv {};
+
+public:
+    explicit LocalLookup(std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const ProtocolLocal> protocol, std::string location,
+        F cont, Priv
+    ):
+        context(std::move(context)),
+        protocol(std::move(protocol)),
+        location(std::move(location)),
+        continuation(std::move(cont)),
+        cancelled(false)
+    {}
+
+    static std::shared_ptr<LocalLookup> make(
+        std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const ProtocolLocal> protocol, std::string location,
+        F cont)
+    {
+        return std::make_shared<LocalLookup>(std::move(context),
+            std::move(protocol), std::move(location), std::move(cont),
+            Priv {});
+    }
+
+    void cancel() override {cancelled = true;}
+
+    void run() {
+        auto executor = boost::asio::get_associated_executor(continuation,
+            context->ioc.get_executor());
+        boost::asio::post(executor, std::bind(&LocalLookup::complete,
+            this->shared_from_this()));
+    }
+
+private:
+    void complete() {
+        if (cancelled) {
+            continuation(ProtocolResult(Error {ErrorKind::BackendFailure,
+                boost::asio::error::make_error_code(
+                boost::asio::error::operation_aborted).message()}));
+            return;
+        }
+        const auto& settings = protocol->settings();
+        ProtocolResult result = Error {ErrorKind::LocationNotFound,
+            "No match"};
+        try {
+            auto coords = settings.gazetteer->find(
+                normalize_location(location), settings.match);
+            if (coords) {result = *coords;}
+        } catch (const std::exception& e) {
+            result = Error {ErrorKind::BackendFailure, e.what()};
+        }
+        continuation(std::move(result));
+    }
+
+private:
+    std::shared_ptr<ClientContext> context;
+    std::shared_ptr<const ProtocolLocal> protocol;
+    std::string location;
+    F continuation;
+    bool cancelled;
+};
+
+template <typename F>
+std::shared_ptr<Lookup> async_find_lat_long(
+    std::shared_ptr<ClientContext> context,
+    std::shared_ptr<const ProtocolLocal> protocol, std::string location,
+    F cont)
+{
+    auto lookup = LocalLookup<F>::make(std::move(context),
+        std::move(protocol), std::move(location), std::move(cont));
+    lookup->run();
+    return lookup;
 }
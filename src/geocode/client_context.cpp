@@ -0,0 +1,39 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "client_context.hpp"
+#include <utility>
+
+namespace {
+    // Clients in flight beyond this number release their buffers when done.
+    const std::size_t MAX_IDLE_CLIENT_BUFFERS = 256;
+}
+
+ClientConfiguration default_client_config() {
+    return ClientConfiguration {default_pool_config(), default_dns_config(),
+        default_timeout_config(), default_tls_config()};
+}
+
+void ClientBuffers::recycle() {
+    target.clear();
+    request.clear();
+    request.body().clear();
+    buffer.consume(buffer.size());
+    response.clear();
+    response.body().clear();
+}
+
+ClientContext::ClientContext(boost::asio::io_context& ioc,
+    const ClientConfiguration& config, std::shared_ptr<TlsContexts> tls,
+    bool synchronized
+):
+    ioc(ioc),
+    config(config),
+    tls(std::move(tls)),
+    dns(DnsCache::make(ioc, config.dns, synchronized)),
+    pool(ConnectionPool::make(ioc, config.pool, synchronized)),
+    // Always synchronized since metrics scrapes read it from any thread.
+    // The lock is uncontended otherwise and cheap next to a lookup.
+    stats(std::make_shared<BackendStats>(true)),
+    buffers(ObjectPool<ClientBuffers>::make(MAX_IDLE_CLIENT_BUFFERS,
+        synchronized))
+{}
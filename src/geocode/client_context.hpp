@@ -0,0 +1,53 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "backend_stats.hpp"
+#include "connection_pool.hpp"
+#include "dns_cache.hpp"
+#include "handler_memory.hpp"
+#include "object_pool.hpp"
+#include "protocol.hpp"
+#include "timeouts.hpp"
+#include "tls_context.hpp"
+#include <boost/asio/io_context.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <memory>
+#include <string>
+
+struct ClientConfiguration {
+    PoolConfiguration pool;
+    DnsConfiguration dns;
+    TimeoutConfiguration timeouts;
+    TlsConfiguration tls;
+};
+
+ClientConfiguration default_client_config();
+
+// Storage of a client, kept between lookups.
+struct ClientBuffers {
+    void recycle();
+
+    // Storage for the request target.
+    std::string target;
+    Request request;
+    boost::beast::flat_buffer buffer;
+    Response response;
+    HandlerMemory memory;
+};
+
+// State shared by the clients running on one io_context. It must be
+// synchronized if the io_context is run by several threads.
+struct ClientContext {
+    explicit ClientContext(boost::asio::io_context& ioc,
+        const ClientConfiguration& config, std::shared_ptr<TlsContexts> tls,
+        bool synchronized);
+
+    boost::asio::io_context& ioc;
+    ClientConfiguration config;
+    std::shared_ptr<TlsContexts> tls;
+    std::shared_ptr<DnsCache> dns;
+    std::shared_ptr<ConnectionPool> pool;
+    std::shared_ptr<BackendStats> stats;
+    std::shared_ptr<ObjectPool<ClientBuffers>> buffers;
+};
@@ -0,0 +1,34 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "config_store.hpp"
+#include <atomic>
+#include <utility>
+
+ConfigStore::ConfigStore(boost::filesystem::path path,
+    ServiceConfiguration config
+):
+    path(std::move(path)),
+    snapshot(std::make_shared<const ServiceConfiguration>(std::move(config)))
+{}
+
+ConfigStore::Snapshot ConfigStore::current() const {
+    return std::atomic_load(&snapshot);
+}
+
+void ConfigStore::reload() {
+    auto next = load_service_config(path);
+    auto previous = current();
+    next.endpoint = previous->endpoint;
+    next.admission = previous->admission;
+    next.client = previous->client;
+    next.cache = previous->cache;
+    next.disk_cache = previous->disk_cache;
+    // The index is built on start, but the radius may change.
+    next.reverse.gazetteer = previous->reverse.gazetteer;
+    next.reverse.disk_cache = previous->reverse.disk_cache;
+    next.threads = previous->threads;
+    next.threading = previous->threading;
+    std::atomic_store(&snapshot,
+        Snapshot(std::make_shared<const ServiceConfiguration>(
+        std::move(next))));
+}
@@ -0,0 +1,32 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "service.hpp"
+#include <boost/filesystem/path.hpp>
+#include <memory>
+
+// Holds the current service configuration as an immutable snapshot. A
+// snapshot stays unchanged for as long as it is held, so requests started
+// before a reload finish with the configuration they started with. May be
+// used from several threads.
+class ConfigStore {
+public:
+    using Snapshot = std::shared_ptr<const ServiceConfiguration>;
+
+    explicit ConfigStore(boost::filesystem::path path,
+        ServiceConfiguration config);
+    ConfigStore(const ConfigStore&) = delete;
+    ConfigStore& operator=(const ConfigStore&) = delete;
+
+    Snapshot current() const;
+    // Reads the configuration file again and makes it current. The
+    // endpoint, threading, cache, disk cache and backend connection settings
+    // only take effect on restart and keep their current values. Throws if
+    // the file is invalid, leaving the current configuration in place.
+    void reload();
+
+private:
+    boost::filesystem::path path;
+    Snapshot snapshot;
+};
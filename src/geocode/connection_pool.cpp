@@ -0,0 +1,138 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "connection_pool.hpp"
+#include <algorithm>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+#include <utility>
+
+PoolConfiguration default_pool_config() {
+    return PoolConfiguration {8, 64, std::chrono::seconds(30)};
+}
+
+Connection::Connection(boost::asio::io_context& ioc,
+    boost::asio::ssl::context& ssl_context
+):
+    stream(ioc, ssl_context),
+    last_used(std::chrono::steady_clock::now()),
+    uses(0)
+{}
+
+ConnectionPool::ConnectionPool(boost::asio::io_context& ioc,
+    PoolConfiguration config, bool synchronized, Priv
+):
+    config(config),
+    synchronized(synchronized),
+    eviction_timer(ioc),
+    eviction_scheduled(false)
+{}
+
+std::shared_ptr<ConnectionPool> ConnectionPool::make(
+    boost::asio::io_context& ioc, PoolConfiguration config, bool synchronized)
+{
+    return std::make_shared<ConnectionPool>(ioc, config, synchronized,
+        Priv {});
+}
+
+void ConnectionPool::acquire(const std::string& host,
+    boost::asio::any_io_executor executor, AcquireHandler handler)
+{
+    auto guard = lock();
+    auto& h = hosts[host];
+    Waiter waiter {std::move(executor), std::move(handler)};
+    if (!h.idle.empty()) {
+        auto conn = std::move(h.idle.back());
+        h.idle.pop_back();
+        ++h.in_use;
+        hand_over(std::move(waiter), std::move(conn));
+    } else if (h.in_use < config.max_per_host) {
+        ++h.in_use;
+        hand_over(std::move(waiter), nullptr);
+    } else {
+        h.waiters.push_back(std::move(waiter));
+    }
+}
+
+void ConnectionPool::discard(const std::string& host) {
+    auto guard = lock();
+    auto& h = hosts[host];
+    if (!h.waiters.empty()) {
+        auto waiter = std::move(h.waiters.front());
+        h.waiters.pop_front();
+        hand_over(std::move(waiter), nullptr);
+        return;
+    }
+    --h.in_use;
+}
+
+void ConnectionPool::release(const std::string& host,
+    std::unique_ptr<Connection> conn)
+{
+    auto guard = lock();
+    auto& h = hosts[host];
+    conn->last_used = std::chrono::steady_clock::now();
+    if (!h.waiters.empty()) {
+        auto waiter = std::move(h.waiters.front());
+        h.waiters.pop_front();
+        hand_over(std::move(waiter), std::move(conn));
+        return;
+    }
+    --h.in_use;
+    if (h.idle.size() >= config.max_idle_per_host) {
+        boost::system::error_code ec;
+        conn->stream.lowest_layer().close(ec);
+        return;
+    }
+    h.idle.push_back(std::move(conn));
+    schedule_eviction();
+}
+
+void ConnectionPool::evict_idle() {
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto& [host, h]: hosts) {
+        while (!h.idle.empty()
+            && h.idle.front()->last_used + config.idle_timeout <= now)
+        {
+            boost::system::error_code ec;
+            h.idle.front()->stream.lowest_layer().close(ec);
+            h.idle.pop_front();
+        }
+        if (!h.idle.empty()) {
+            next = std::min(next, h.idle.front()->last_used
+                + config.idle_timeout);
+        }
+    }
+    if (next == std::chrono::steady_clock::time_point::max()) {return;}
+    eviction_scheduled = true;
+    eviction_timer.expires_at(next);
+    std::weak_ptr<ConnectionPool> weak_this = shared_from_this();
+    eviction_timer.async_wait([weak_this] (boost::system::error_code ec) {
+        auto this_ = weak_this.lock();
+        if (!this_) {return;}
+        auto guard = this_->lock();
+        this_->eviction_scheduled = false;
+        if (ec) {return;}
+        this_->evict_idle();
+    });
+}
+
+void ConnectionPool::hand_over(Waiter waiter,
+    std::unique_ptr<Connection> conn)
+{
+    boost::asio::post(waiter.executor, [handler = std::move(waiter.handler),
+        conn = std::move(conn)] () mutable
+    {
+        handler(std::move(conn));
+    });
+}
+
+std::unique_lock<std::mutex> ConnectionPool::lock() {
+    if (!synchronized) {return {};}
+    return std::unique_lock<std::mutex>(mutex);
+}
+
+void ConnectionPool::schedule_eviction() {
+    if (eviction_scheduled) {return;}
+    evict_idle();
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "tls_context.hpp"
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct PoolConfiguration {
+    // Maximum number of idle connections kept per host.
+    std::size_t max_idle_per_host;
+    // Maximum number of connections per host, idle or in use. Lookups past
+    // this limit wait for a connection to be released.
+    std::size_t max_per_host;
+    // Idle connections unused for this long are closed.
+    std::chrono::steady_clock::duration idle_timeout;
+};
+
+PoolConfiguration default_pool_config();
+
+// TLS connection to a backend host.
+struct Connection {
+    explicit Connection(boost::asio::io_context& ioc,
+        boost::asio::ssl::context& ssl_context);
+
+    TlsStream stream;
+    std::chrono::steady_clock::time_point last_used;
+    // Number of requests completed on this connection.
+    unsigned int uses;
+};
+
+// Keeps established connections to backend hosts for reuse. Every connection
+// in use occupies a slot for its host; a slot is released by handing the
+// connection back with release() or by reporting it closed with discard().
+// A synchronized pool may be used from several threads.
+class ConnectionPool: public std::enable_shared_from_this<ConnectionPool> {
+private:
+    struct Priv {};
+
+public:
+    // Called with an idle connection, or with null if the caller must
+    // establish a new connection in the slot reserved for it.
+    using AcquireHandler = std::function<void(std::unique_ptr<Connection>)>;
+
+    explicit ConnectionPool(boost::asio::io_context& ioc,
+        PoolConfiguration config, bool synchronized, Priv);
+
+    static std::shared_ptr<ConnectionPool> make(boost::asio::io_context& ioc,
+        PoolConfiguration config, bool synchronized);
+
+    // The handler is invoked through executor.
+    void acquire(const std::string& host,
+        boost::asio::any_io_executor executor, AcquireHandler handler);
+    void discard(const std::string& host);
+    void release(const std::string& host, std::unique_ptr<Connection> conn);
+
+private:
+    struct Waiter {
+        boost::asio::any_io_executor executor;
+        AcquireHandler handler;
+    };
+
+    struct Host {
+        // Ordered from least to most recently used.
+        std::deque<std::unique_ptr<Connection>> idle;
+        std::deque<Waiter> waiters;
+        std::size_t in_use = 0;
+    };
+
+    void evict_idle();
+    void hand_over(Waiter waiter, std::unique_ptr<Connection> conn);
+    std::unique_lock<std::mutex> lock();
+    void schedule_eviction();
+
+private:
+    PoolConfiguration config;
+    bool synchronized;
+    std::mutex mutex;
+    std::map<std::string, Host> hosts;
+    boost::asio::steady_timer eviction_timer;
+    bool eviction_scheduled;
+};
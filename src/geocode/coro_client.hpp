@@ -0,0 +1,349 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "client_context.hpp"
+#include "connection_pool.hpp"
+#include "dns_cache.hpp"
+#include "handler_memory.hpp"
+#include "lookup.hpp"
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "timeouts.hpp"
+#include "tls_context.hpp"
+#include <algorithm>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast.hpp>
+#include <boost/system/error_code.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Coroutine implementation of Client, used when building with
+// GEOCODE_COROUTINES. The lookup runs as one coroutine instead of a chain of
+// handlers; asio allocates its frame and those of the operations it awaits
+// from the thread's recycling cache. Behaves as Client does.
+template <typename Protocol, typename F>
+class CoroClient: public Lookup,
+    public std::enable_shared_from_this<CoroClient<Protocol, F>>
+{
+private:
+    struct Priv {};
+    using Result = ClientResult<Protocol>;
+
+public:
+    explicit CoroClient(std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const Protocol> protocol, std::string location,
+        F cont, Priv
+    ):
+        context(std::move(context)),
+        protocol(std::move(protocol)),
+        location(std::move(location)),
+        continuation(std::move(cont)),
+        executor(boost::asio::get_associated_executor(continuation,
+            this->context->ioc.get_executor())),
+        timer(executor),
+        authority(this->protocol->authority()),
+        stage(ClientStage::Acquire),
+        generation(0),
+        timing_stage(false),
+        holds_slot(false),
+        reconnected(false),
+        cancelled(false),
+        finished(false),
+        buffers(this->context->buffers->acquire([] {
+            return std::make_unique<ClientBuffers>();
+        }))
+    {}
+
+    ~CoroClient() {
+        if (holds_slot) {context->pool->discard(authority);}
+    }
+
+    static std::shared_ptr<CoroClient> make(
+        std::shared_ptr<ClientContext> context,
+        std::shared_ptr<const Protocol> protocol, std::string location,
+        F cont)
+    {
+        return std::make_shared<CoroClient>(std::move(context),
+            std::move(protocol), std::move(location), std::move(cont),
+            Priv {});
+    }
+
+    void cancel() override {
+        cancelled = true;
+        if (connection) {
+            boost::system::error_code ec;
+            connection->stream.lowest_layer().close(ec);
+        }
+    }
+
+    void run() {
+        boost::asio::co_spawn(executor, lookup(this->shared_from_this()),
+            boost::asio::detached);
+    }
+
+private:
+    using Awaitable = boost::asio::awaitable<void>;
+
+    auto acquire() {
+        return boost::asio::async_initiate<
+            const boost::asio::use_awaitable_t<>&,
+            void(std::unique_ptr<Connection>)>([this] (auto handler) {
+                // The pool takes copyable handlers.
+                auto h = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                context->pool->acquire(authority, executor, [h] (
+                    std::unique_ptr<Connection> conn)
+                {
+                    (*h)(std::move(conn));
+                });
+            }, boost::asio::use_awaitable);
+    }
+
+    void complete(Result result) {
+        if (finished) {return;}
+        finished = true;
+        end_stage();
+        timer.cancel();
+        continuation(std::move(result));
+    }
+
+    void drop_connection() {
+        if (connection) {
+            boost::system::error_code ec;
+            connection->stream.lowest_layer().close(ec);
+            connection.reset();
+        }
+        if (holds_slot) {
+            holds_slot = false;
+            context->pool->discard(authority);
+        }
+    }
+
+    // Records the duration of the current stage, once.
+    void end_stage() {
+        if (!timing_stage) {return;}
+        timing_stage = false;
+        record_client_stage(stage, std::chrono::steady_clock::now()
+            - stage_start);
+    }
+
+    // Arms the timer for a stage. The shutdown stage is not bounded by the
+    // overall deadline since the result is already known by then.
+    void enter(ClientStage next) {
+        end_stage();
+        stage = next;
+        stage_start = std::chrono::steady_clock::now();
+        timing_stage = true;
+        auto expiry = stage_start + context->config.timeouts.stage(stage);
+        if (stage != ClientStage::Shutdown) {
+            expiry = std::min(expiry, deadline);
+        }
+        auto this_ = this->shared_from_this();
+        timer.expires_at(expiry);
+        timer.async_wait(bind_arena(buffers->memory,
+            [this_, g = ++generation] (boost::system::error_code ec)
+        {
+            if (ec || g != this_->generation) {return;}
+            this_->on_timeout();
+        }));
+    }
+
+    // Establishes a new connection in the slot held.
+    boost::asio::awaitable<boost::system::error_code> establish() {
+        boost::system::error_code ec;
+        connection = std::make_unique<Connection>(context->ioc,
+            context->tls->context(protocol->host()));
+        context->tls->prepare(connection->stream, protocol->host());
+        enter(ClientStage::Resolve);
+        auto endpoints = co_await resolve(ec);
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
+        if (ec) {co_return ec;}
+        enter(ClientStage::Connect);
+        co_await boost::asio::async_connect(connection->stream.next_layer(),
+            endpoints, boost::asio::redirect_error(boost::asio::use_awaitable,
+            ec));
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
+        if (ec) {co_return ec;}
+        enter(ClientStage::Handshake);
+        co_await connection->stream.async_handshake(
+            boost::asio::ssl::stream_base::client,
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (cancelled) {ec = boost::asio::error::operation_aborted;}
+        if (ec) {co_return ec;}
+        context->tls->on_handshake(connection->stream);
+        co_return ec;
+    }
+
+    void finish_with_error(boost::system::error_code ec) {
+        finish_with_error(ErrorKind::BackendFailure, ec.message());
+    }
+
+    void finish_with_error(ErrorKind kind, std::string cause) {
+        drop_connection();
+        Error e{kind, std::move(cause)};
+        complete(Result{std::move(e)});
+    }
+
+    void finish_with_response() {
+        end_stage();
+        auto parse_start = std::chrono::steady_clock::now();
+        Result result;
+        try {
+            result = protocol->parse(buffers->response);
+        } catch (const LocationNotFoundError& e) {
+            result = Error {ErrorKind::LocationNotFound, e.what()};
+        } catch (const ThrottledError& e) {
+            protocol->throttle(e.retry_after());
+            result = Error {ErrorKind::BackendFailure, e.what()};
+        } catch (const std::exception& e) {
+            result = Error {ErrorKind::BackendFailure, e.what()};
+        }
+        record_response_parse(std::chrono::steady_clock::now() - parse_start);
+        complete(std::move(result));
+    }
+
+    // Each nested coroutine allocates a frame, so the lookup is one
+    // coroutine but for establishing a connection.
+    Awaitable lookup(std::shared_ptr<CoroClient>) {
+        deadline = std::chrono::steady_clock::now()
+            + context->config.timeouts.total;
+        enter(ClientStage::Acquire);
+        auto conn = co_await acquire();
+        holds_slot = true;
+        if (cancelled) {
+            if (conn) {
+                holds_slot = false;
+                context->pool->release(authority, std::move(conn));
+            }
+            finish_with_error(boost::asio::error::operation_aborted);
+            co_return;
+        }
+        connection = std::move(conn);
+        for (;;) {
+            boost::system::error_code ec;
+            if (!connection) {
+                try {
+                    ec = co_await establish();
+                } catch (const std::exception& e) {
+                    finish_with_error(ErrorKind::BackendFailure, e.what());
+                    co_return;
+                }
+                if (ec) {
+                    finish_with_error(ec);
+                    co_return;
+                }
+            }
+            protocol->request(location, buffers->target, buffers->request);
+            buffers->request.keep_alive(true);
+            enter(ClientStage::Write);
+            co_await boost::beast::http::async_write(connection->stream,
+                buffers->request, boost::asio::redirect_error(
+                boost::asio::use_awaitable, ec));
+            if (cancelled) {ec = boost::asio::error::operation_aborted;}
+            if (!ec) {
+                enter(ClientStage::Read);
+                co_await boost::beast::http::async_read(connection->stream,
+                    buffers->buffer, buffers->response,
+                    boost::asio::redirect_error(
+                    boost::asio::use_awaitable, ec));
+                if (cancelled) {ec = boost::asio::error::operation_aborted;}
+            }
+            if (!ec) {break;}
+            // A pooled connection may have been closed by the server while
+            // idle. Requests are idempotent, so they are retried once on a
+            // new connection.
+            if (connection->uses == 0 || reconnected || cancelled) {
+                finish_with_error(ec);
+                co_return;
+            }
+            reconnected = true;
+            boost::system::error_code close_ec;
+            connection->stream.lowest_layer().close(close_ec);
+            connection.reset();
+            buffers->buffer.consume(buffers->buffer.size());
+            buffers->response = Response {};
+        }
+        ++connection->uses;
+        if (buffers->response.keep_alive() && buffers->buffer.size() == 0) {
+            holds_slot = false;
+            context->pool->release(authority, std::move(connection));
+            finish_with_response();
+            co_return;
+        }
+        // The result does not depend on the shutdown, so it is delivered
+        // first.
+        finish_with_response();
+        enter(ClientStage::Shutdown);
+        boost::system::error_code ec;
+        co_await connection->stream.async_shutdown(
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        end_stage();
+        timer.cancel();
+        drop_connection();
+    }
+
+    // Cancels the pending operation, whose own completion is then ignored,
+    // and reports the stage that timed out.
+    void on_timeout() {
+        auto cause = to_string(stage) + " timed out";
+        cancel();
+        if (stage == ClientStage::Shutdown) {return;}
+        complete(Error {ErrorKind::BackendFailure, std::move(cause)});
+    }
+
+    auto resolve(boost::system::error_code& ec) {
+        auto token = boost::asio::redirect_error(boost::asio::use_awaitable,
+            ec);
+        return boost::asio::async_initiate<decltype(token),
+            void(boost::system::error_code, DnsCache::Endpoints)>(
+            [this] (auto handler) {
+                auto h = std::make_shared<decltype(handler)>(
+                    std::move(handler));
+                context->dns->async_resolve(protocol->host(),
+                    protocol->port(), executor, [h] (
+                    boost::system::error_code ec,
+                    DnsCache::Endpoints endpoints)
+                {
+                    (*h)(ec, std::move(endpoints));
+                });
+            }, token);
+    }
+
+private:
+    std::shared_ptr<ClientContext> context;
+    std::shared_ptr<const Protocol> protocol;
+    std::string location;
+    F continuation;
+    boost::asio::any_io_executor executor;
+    boost::asio::steady_timer timer;
+    // Owned by the protocol. Identifies the service in the connection pool.
+    const std::string& authority;
+    std::unique_ptr<Connection> connection;
+    std::chrono::steady_clock::time_point deadline;
+    ClientStage stage;
+    std::chrono::steady_clock::time_point stage_start;
+    // Identifies the latest stage timer, so that the expiry of an earlier
+    // one racing with a new stage is ignored.
+    unsigned int generation;
+    // Whether the current stage is yet to be recorded in the metrics.
+    bool timing_stage;
+    bool holds_slot;
+    bool reconnected;
+    bool cancelled;
+    bool finished;
+    // Pooled, so that buffer capacity is kept between lookups.
+    std::shared_ptr<ClientBuffers> buffers;
+};
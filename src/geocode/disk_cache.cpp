@@ -0,0 +1,600 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "disk_cache.hpp"
+#include <algorithm>
+#include <boost/crc.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+    const char LOG_MAGIC[8] = {'G', 'E', 'O', 'C', 'L', 'O', 'G', '\0'};
+    const char INDEX_MAGIC[8] = {'G', 'E', 'O', 'C', 'I', 'D', 'X', '\0'};
+    const std::uint32_t FORMAT_VERSION = 1;
+    // Longer keys are taken for corruption.
+    const std::uint32_t MAX_KEY_SIZE = 64 * 1024;
+    // Records kept in memory beyond which the log is compacted early.
+    const std::size_t MAX_RECENT = 100000;
+    const auto MIN_COMPACTION_INTERVAL = std::chrono::seconds(10);
+    // Size of the writes of a compaction.
+    const std::size_t WRITE_CHUNK = 1024 * 1024;
+
+    struct LogHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t reserved;
+        // Identifies the log written by a compaction, and thus the index
+        // matching it.
+        std::uint64_t generation;
+    };
+
+    struct IndexHeader {
+        char magic[8];
+        std::uint32_t version;
+        // Of the header, with this field zero.
+        std::uint32_t checksum;
+        std::uint64_t generation;
+        // Size of the log covered by the index.
+        std::uint64_t log_size;
+        // Power of two.
+        std::uint64_t slot_count;
+    };
+
+    // Followed by the key.
+    struct RecordHeader {
+        // Of the rest of the record.
+        std::uint32_t checksum;
+        std::uint32_t key_size;
+        double latitude;
+        double longitude;
+        // Seconds since the epoch.
+        std::int64_t timestamp;
+    };
+
+    // Offset of a record in the log, zero for an empty slot.
+    struct Slot {
+        std::uint64_t hash;
+        std::uint64_t offset;
+    };
+
+    static_assert(sizeof(LogHeader) == 24, "Unexpected padding");
+    static_assert(sizeof(IndexHeader) == 40, "Unexpected padding");
+    static_assert(sizeof(RecordHeader) == 32, "Unexpected padding");
+    static_assert(sizeof(Slot) == 16, "Unexpected padding");
+
+    struct Record {
+        std::string_view key;
+        Coordinates coords;
+        std::int64_t timestamp;
+    };
+
+    std::uint32_t checksum(const void* data, std::size_t size) {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+        return crc.checksum();
+    }
+
+    std::uint32_t checksum(IndexHeader header) {
+        header.checksum = 0;
+        return checksum(&header, sizeof(header));
+    }
+
+    // FNV-1a, which unlike std::hash is the same in every build.
+    std::uint64_t hash_key(std::string_view key) {
+        std::uint64_t h = 14695981039346656037ull;
+        for (auto c: key) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Returns the size of the record at data, or zero if there is no valid
+    // record.
+    std::size_t decode_record(const char* data, std::size_t available,
+        Record& record)
+    {
+        RecordHeader header;
+        if (available < sizeof(header)) {return 0;}
+        std::memcpy(&header, data, sizeof(header));
+        if (header.key_size > MAX_KEY_SIZE
+            || available - sizeof(header) < header.key_size)
+        {
+            return 0;
+        }
+        auto size = sizeof(header) + header.key_size;
+        auto rest = sizeof(header.checksum);
+        if (checksum(data + rest, size - rest) != header.checksum) {return 0;}
+        record.key = std::string_view(data + sizeof(header), header.key_size);
+        record.coords = Coordinates {header.latitude, header.longitude};
+        record.timestamp = header.timestamp;
+        return size;
+    }
+
+    void encode_record(std::string& out, std::string_view key,
+        const Coordinates& coords, std::int64_t timestamp)
+    {
+        RecordHeader header {0, static_cast<std::uint32_t>(key.size()),
+            coords.latitude, coords.longitude, timestamp};
+        auto start = out.size();
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(key);
+        auto rest = sizeof(header.checksum);
+        header.checksum = checksum(out.data() + start + rest,
+            out.size() - start - rest);
+        std::memcpy(&out[start], &header.checksum, sizeof(header.checksum));
+    }
+
+    std::int64_t unix_now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void write_all(std::FILE* file, const void* data, std::size_t size) {
+        if (std::fwrite(data, 1, size, file) != size) {
+            throw std::runtime_error("Failed to write disk cache");
+        }
+    }
+
+    // Writes a file under a temporary name and makes it durable; it is then
+    // renamed over the previous one.
+    class TempFile {
+    public:
+        explicit TempFile(boost::filesystem::path path):
+            path(std::move(path)),
+            file(std::fopen(this->path.string().c_str(), "wb"))
+        {
+            if (!file) {
+                throw std::runtime_error("Failed to create "
+                    + this->path.string());
+            }
+        }
+
+        TempFile(const TempFile&) = delete;
+        TempFile& operator=(const TempFile&) = delete;
+
+        ~TempFile() {
+            if (!file) {return;}
+            std::fclose(file);
+            boost::system::error_code ec;
+            boost::filesystem::remove(path, ec);
+        }
+
+        void write(const void* data, std::size_t size) {
+            write_all(file, data, size);
+        }
+
+        void commit(const boost::filesystem::path& target) {
+            if (std::fflush(file) != 0) {
+                throw std::runtime_error("Failed to write " + path.string());
+            }
+#ifndef _WIN32
+            ::fsync(fileno(file));
+#endif
+            std::fclose(file);
+            file = nullptr;
+            boost::filesystem::rename(path, target);
+        }
+
+    private:
+        boost::filesystem::path path;
+        std::FILE* file;
+    };
+}
+
+// Log prefix covered by the index, and the index, both mapped in memory.
+class DiskCache::Segment {
+public:
+    Segment():
+        log_data(nullptr),
+        log_size(0),
+        slots(nullptr),
+        slot_count(0)
+    {}
+
+    explicit Segment(const boost::filesystem::path& log_path,
+        std::uint64_t log_size, const boost::filesystem::path& index_path,
+        std::uint64_t slot_count
+    ):
+        log_mapping(log_path.string().c_str(), boost::interprocess::read_only),
+        log_region(log_mapping, boost::interprocess::read_only, 0,
+            static_cast<std::size_t>(log_size)),
+        index_mapping(index_path.string().c_str(),
+            boost::interprocess::read_only),
+        index_region(index_mapping, boost::interprocess::read_only),
+        log_data(static_cast<const char*>(log_region.get_address())),
+        log_size(log_size),
+        slots(static_cast<const char*>(index_region.get_address())
+            + sizeof(IndexHeader)),
+        slot_count(slot_count)
+    {}
+
+    std::optional<Record> find(std::string_view key, std::uint64_t h) const {
+        if (slot_count == 0) {return std::nullopt;}
+        auto mask = slot_count - 1;
+        auto i = h & mask;
+        for (std::uint64_t n = 0; n < slot_count; ++n, i = (i + 1) & mask) {
+            Slot slot;
+            std::memcpy(&slot, slots + i * sizeof(Slot), sizeof(Slot));
+            if (slot.offset == 0) {return std::nullopt;}
+            if (slot.hash != h) {continue;}
+            if (auto record = read(slot.offset); record && record->key == key) {
+                return record;
+            }
+        }
+        return std::nullopt;
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (std::uint64_t i = 0; i < slot_count; ++i) {
+            Slot slot;
+            std::memcpy(&slot, slots + i * sizeof(Slot), sizeof(Slot));
+            if (slot.offset == 0) {continue;}
+            if (auto record = read(slot.offset)) {f(*record);}
+        }
+    }
+
+private:
+    std::optional<Record> read(std::uint64_t offset) const {
+        if (offset >= log_size) {return std::nullopt;}
+        Record record;
+        if (!decode_record(log_data + offset,
+            static_cast<std::size_t>(log_size - offset), record))
+        {
+            return std::nullopt;
+        }
+        return record;
+    }
+
+private:
+    boost::interprocess::file_mapping log_mapping;
+    boost::interprocess::mapped_region log_region;
+    boost::interprocess::file_mapping index_mapping;
+    boost::interprocess::mapped_region index_region;
+    const char* log_data;
+    std::uint64_t log_size;
+    const char* slots;
+    std::uint64_t slot_count;
+};
+
+DiskCacheConfiguration default_disk_cache_config() {
+    return DiskCacheConfiguration {{}, std::chrono::hours(24 * 30),
+        std::chrono::hours(1)};
+}
+
+DiskCache::DiskCache(DiskCacheConfiguration config):
+    config(std::move(config)),
+    log_path(this->config.path / "cache.log"),
+    index_path(this->config.path / "cache.idx"),
+    segment(std::make_shared<const Segment>()),
+    generation(0),
+    stopping(false),
+    log(nullptr),
+    hits(0),
+    misses(0),
+    compactions(0)
+{
+    open();
+    worker = std::thread([this] {run();});
+}
+
+DiskCache::~DiskCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+    if (log) {std::fclose(log);}
+}
+
+std::optional<Coordinates> DiskCache::find(const std::string& key) {
+    auto now = unix_now();
+    auto found = [&] (const Entry& entry) -> std::optional<Coordinates> {
+        if (expired(entry.timestamp, now)) {
+            ++misses;
+            return std::nullopt;
+        }
+        ++hits;
+        return entry.coords;
+    };
+    std::shared_ptr<const Segment> current;
+    std::shared_ptr<const Frozen> layer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto it = recent.find(key); it != recent.end()) {
+            return found(it->second);
+        }
+        current = segment;
+        layer = frozen;
+    }
+    for (auto f = layer.get(); f; f = f->older.get()) {
+        if (auto it = f->entries.find(key); it != f->entries.end()) {
+            return found(it->second);
+        }
+    }
+    auto record = current->find(key, hash_key(key));
+    if (!record || expired(record->timestamp, now)) {
+        ++misses;
+        return std::nullopt;
+    }
+    ++hits;
+    return record->coords;
+}
+
+void DiskCache::insert(const std::string& key, const Coordinates& coords) {
+    if (key.size() > MAX_KEY_SIZE) {return;}
+    auto now = unix_now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        recent[key] = Entry {coords, now};
+        encode_record(pending, key, coords, now);
+    }
+    wake.notify_one();
+}
+
+// Freezes the recent records to read them without the lock. Records
+// inserted meanwhile are left out.
+void DiskCache::for_each(const std::function<void(std::string_view,
+    const Coordinates&)>& f) const
+{
+    auto now = unix_now();
+    std::shared_ptr<const Segment> current;
+    std::shared_ptr<const Frozen> layer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeze();
+        current = segment;
+        layer = frozen;
+    }
+    for_each_live(layer.get(), *current, now, [&] (std::string_view key,
+        const Coordinates& coords, std::int64_t)
+    {
+        f(key, coords);
+    });
+}
+
+DiskCacheStatistics DiskCache::statistics() const {
+    return DiskCacheStatistics {hits.load(), misses.load(),
+        compactions.load()};
+}
+
+// Writes the live records to a new log and index, then replaces the current
+// ones. The recent records are frozen first, so that lookups meanwhile only
+// wait for the lock to take them; records inserted since stay in memory, to
+// be appended to the new log.
+void DiskCache::compact() {
+    std::shared_ptr<const Segment> old;
+    std::shared_ptr<const Frozen> layer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeze();
+        old = segment;
+        layer = frozen;
+    }
+    auto now = unix_now();
+    auto next_generation = generation + 1;
+    TempFile log_file(log_path.string() + ".tmp");
+    LogHeader log_header {{}, FORMAT_VERSION, 0, next_generation};
+    std::memcpy(log_header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    log_file.write(&log_header, sizeof(log_header));
+    std::vector<Slot> entries;
+    std::uint64_t log_size = sizeof(log_header);
+    std::string buffer;
+    auto add = [&] (std::string_view key, const Coordinates& coords,
+        std::int64_t timestamp)
+    {
+        auto start = buffer.size();
+        encode_record(buffer, key, coords, timestamp);
+        entries.push_back(Slot {hash_key(key), log_size});
+        log_size += buffer.size() - start;
+        if (buffer.size() >= WRITE_CHUNK) {
+            log_file.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+    for_each_live(layer.get(), *old, now, add);
+    log_file.write(buffer.data(), buffer.size());
+    std::uint64_t slot_count = 16;
+    while (slot_count < entries.size() * 2) {slot_count *= 2;}
+    std::vector<Slot> slots(slot_count, Slot {0, 0});
+    for (auto& entry: entries) {
+        auto i = entry.hash & (slot_count - 1);
+        while (slots[i].offset != 0) {i = (i + 1) & (slot_count - 1);}
+        slots[i] = entry;
+    }
+    TempFile index_file(index_path.string() + ".tmp");
+    IndexHeader index_header {{}, FORMAT_VERSION, 0, next_generation,
+        log_size, slot_count};
+    std::memcpy(index_header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    index_header.checksum = checksum(index_header);
+    index_file.write(&index_header, sizeof(index_header));
+    index_file.write(slots.data(), slots.size() * sizeof(Slot));
+    // The log is replaced first. A crash before the index is replaced
+    // leaves an index of another generation, which is then ignored and the
+    // whole log read.
+    log_file.commit(log_path);
+    index_file.commit(index_path);
+    std::fclose(log);
+    log = std::fopen(log_path.string().c_str(), "ab");
+    auto next = std::make_shared<const Segment>(log_path, log_size,
+        index_path, slot_count);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        segment = std::move(next);
+        generation = next_generation;
+        // Layers frozen by for_each meanwhile still refer to the compacted
+        // ones, which are then dropped by the next compaction.
+        if (frozen == layer) {frozen.reset();}
+    }
+    ++compactions;
+}
+
+void DiskCache::for_each_live(const Frozen* frozen, const Segment& current,
+    std::int64_t now, const std::function<void(std::string_view,
+    const Coordinates&, std::int64_t)>& f) const
+{
+    // Whether a newer layer than until has the key.
+    auto replaced = [frozen] (const std::string& key, const Frozen* until) {
+        for (auto layer = frozen; layer != until; layer = layer->older.get()) {
+            if (layer->entries.count(key)) {return true;}
+        }
+        return false;
+    };
+    for (auto layer = frozen; layer; layer = layer->older.get()) {
+        for (auto& [key, entry]: layer->entries) {
+            if (!expired(entry.timestamp, now) && !replaced(key, layer)) {
+                f(key, entry.coords, entry.timestamp);
+            }
+        }
+    }
+    std::string key;
+    current.for_each([&] (const Record& record) {
+        key.assign(record.key);
+        if (!expired(record.timestamp, now) && !replaced(key, nullptr)) {
+            f(record.key, record.coords, record.timestamp);
+        }
+    });
+}
+
+void DiskCache::freeze() const {
+    if (recent.empty()) {return;}
+    frozen = std::make_shared<const Frozen>(Frozen {std::move(recent),
+        std::move(frozen)});
+    recent.clear();
+}
+
+bool DiskCache::expired(std::int64_t timestamp, std::int64_t now) const {
+    auto ttl = std::chrono::duration_cast<std::chrono::seconds>(config.ttl);
+    return now - timestamp >= ttl.count();
+}
+
+// Maps the log and index, reads the records appended after the indexed part
+// of the log and drops a torn record at its end.
+void DiskCache::open() {
+    boost::filesystem::create_directories(config.path);
+    std::uint64_t file_size = 0;
+    LogHeader log_header {};
+    if (boost::filesystem::exists(log_path)) {
+        boost::filesystem::ifstream in(log_path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(&log_header), sizeof(log_header));
+        if (in && std::memcmp(log_header.magic, LOG_MAGIC, sizeof(LOG_MAGIC))
+            == 0 && log_header.version == FORMAT_VERSION)
+        {
+            file_size = boost::filesystem::file_size(log_path);
+        }
+    }
+    if (file_size == 0) {
+        // Missing or unreadable; the cache starts over.
+        TempFile file(log_path.string() + ".tmp");
+        log_header = LogHeader {{}, FORMAT_VERSION, 0, 0};
+        std::memcpy(log_header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+        file.write(&log_header, sizeof(log_header));
+        file.commit(log_path);
+        file_size = sizeof(log_header);
+    }
+    generation = log_header.generation;
+    std::uint64_t indexed = sizeof(log_header);
+    if (boost::filesystem::exists(index_path)) {
+        IndexHeader header {};
+        boost::filesystem::ifstream in(index_path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        auto valid = in
+            && std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+            && header.version == FORMAT_VERSION
+            && header.checksum == checksum(header)
+            && header.generation == generation
+            && header.log_size >= indexed && header.log_size <= file_size
+            && header.slot_count > 0
+            && (header.slot_count & (header.slot_count - 1)) == 0
+            && boost::filesystem::file_size(index_path) == sizeof(header)
+                + header.slot_count * sizeof(Slot);
+        if (valid) {
+            in.close();
+            segment = std::make_shared<const Segment>(log_path,
+                header.log_size, index_path, header.slot_count);
+            indexed = header.log_size;
+        }
+    }
+    std::string tail;
+    {
+        boost::filesystem::ifstream in(log_path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(indexed));
+        tail.assign(std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>());
+    }
+    auto now = unix_now();
+    std::size_t pos = 0;
+    Record record;
+    while (auto size = decode_record(tail.data() + pos, tail.size() - pos,
+        record))
+    {
+        if (!expired(record.timestamp, now)) {
+            recent[std::string(record.key)] = Entry {record.coords,
+                record.timestamp};
+        }
+        pos += size;
+    }
+    if (pos < tail.size()) {
+        boost::filesystem::resize_file(log_path, indexed + pos);
+    }
+    log = std::fopen(log_path.string().c_str(), "ab");
+    if (!log) {
+        throw std::runtime_error("Failed to open " + log_path.string());
+    }
+}
+
+void DiskCache::run() {
+    auto next_compaction = std::chrono::steady_clock::now()
+        + config.compaction_interval;
+    auto last_compaction = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait_until(lock, next_compaction, [this] {
+            return stopping || !pending.empty();
+        });
+        std::string records;
+        std::swap(records, pending);
+        auto now = std::chrono::steady_clock::now();
+        auto due = now >= next_compaction || (recent.size() >= MAX_RECENT
+            && now >= last_compaction + MIN_COMPACTION_INTERVAL);
+        auto stop = stopping;
+        lock.unlock();
+        write(records);
+        if (due && !stop) {
+            try {
+                compact();
+            } catch (const std::exception& e) {
+                std::cerr << "Failed to compact disk cache: " << e.what()
+                    << std::endl;
+            }
+            last_compaction = std::chrono::steady_clock::now();
+            next_compaction = last_compaction + config.compaction_interval;
+        }
+        lock.lock();
+        if (stop && pending.empty()) {return;}
+    }
+}
+
+void DiskCache::write(const std::string& records) {
+    if (records.empty() || !log) {return;}
+    try {
+        write_all(log, records.data(), records.size());
+        std::fflush(log);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
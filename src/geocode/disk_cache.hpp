@@ -0,0 +1,121 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "protocol.hpp"
+#include <atomic>
+#include <boost/filesystem/path.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+struct DiskCacheConfiguration {
+    // Directory holding the cache files. An empty path disables the cache.
+    boost::filesystem::path path;
+    // How long coordinates are kept.
+    std::chrono::system_clock::duration ttl;
+    // Interval between compactions of the log.
+    std::chrono::steady_clock::duration compaction_interval;
+};
+
+DiskCacheConfiguration default_disk_cache_config();
+
+struct DiskCacheStatistics {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long compactions;
+};
+
+// Coordinates keyed by normalized location, kept on disk across restarts.
+//
+// Records are appended to a log, each with a checksum; a record torn by a
+// crash is dropped when the cache is opened. Compaction rewrites the live
+// records to a new log together with a hash index of their offsets, and
+// replaces both files atomically. Opening the cache maps the log and its
+// index into memory, so only records appended since the last compaction are
+// read. Those, and the records inserted since, are also kept in memory until
+// the next compaction, which freezes them so that they are read and written
+// without holding the lock. Appends and compactions run on a background
+// thread.
+// Files use the byte order of the machine. Safe to share between threads.
+class DiskCache {
+public:
+    // Opens the cache in config.path, creating it if needed. Throws if the
+    // files cannot be created.
+    explicit DiskCache(DiskCacheConfiguration config);
+    DiskCache(const DiskCache&) = delete;
+    DiskCache& operator=(const DiskCache&) = delete;
+    // Writes pending records.
+    ~DiskCache();
+
+    std::optional<Coordinates> find(const std::string& key);
+    void insert(const std::string& key, const Coordinates& coords);
+    // Calls f with each key and its coordinates that are not expired, e.g.
+    // to index them. Not counted as lookups.
+    void for_each(const std::function<void(std::string_view,
+        const Coordinates&)>& f) const;
+    DiskCacheStatistics statistics() const;
+
+private:
+    struct Entry {
+        Coordinates coords;
+        std::int64_t timestamp;
+    };
+
+    using Entries = std::unordered_map<std::string, Entry>;
+
+    // Records taken out of recent, no longer modified. Those of newer
+    // layers replace those of older ones.
+    struct Frozen {
+        Entries entries;
+        std::shared_ptr<const Frozen> older;
+    };
+
+    class Segment;
+
+    void compact();
+    bool expired(std::int64_t timestamp, std::int64_t now) const;
+    // Calls f with each record of frozen and then of current that is neither
+    // expired nor replaced by a newer one.
+    void for_each_live(const Frozen* frozen, const Segment& current,
+        std::int64_t now, const std::function<void(std::string_view,
+        const Coordinates&, std::int64_t)>& f) const;
+    // Moves recent to a new frozen layer. Requires the lock.
+    void freeze() const;
+    void open();
+    void run();
+    void write(const std::string& records);
+
+private:
+    DiskCacheConfiguration config;
+    boost::filesystem::path log_path;
+    boost::filesystem::path index_path;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    // Log and index as of the last compaction.
+    std::shared_ptr<const Segment> segment;
+    // Records more recent than the segment: those frozen to be compacted or
+    // read by for_each, then those inserted since into recent. Freezing
+    // leaves the records unchanged, so for_each may freeze.
+    mutable std::shared_ptr<const Frozen> frozen;
+    mutable Entries recent;
+    // Encoded records waiting to be appended.
+    std::string pending;
+    std::uint64_t generation;
+    bool stopping;
+    // Only used by the worker once the cache is open.
+    std::FILE* log;
+    std::atomic<unsigned long long> hits;
+    std::atomic<unsigned long long> misses;
+    std::atomic<unsigned long long> compactions;
+    std::thread worker;
+};
@@ -0,0 +1,128 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "dns_cache.hpp"
+#include <boost/asio/post.hpp>
+#include <utility>
+
+DnsConfiguration default_dns_config() {
+    return DnsConfiguration {std::chrono::seconds(60),
+        std::chrono::seconds(10), std::chrono::minutes(5)};
+}
+
+DnsCache::DnsCache(boost::asio::io_context& ioc, DnsConfiguration config,
+    bool synchronized, Priv
+):
+    config(config),
+    synchronized(synchronized),
+    resolver(ioc)
+{}
+
+std::shared_ptr<DnsCache> DnsCache::make(boost::asio::io_context& ioc,
+    DnsConfiguration config, bool synchronized)
+{
+    return std::make_shared<DnsCache>(ioc, config, synchronized, Priv {});
+}
+
+void DnsCache::async_resolve(const std::string& host,
+    const std::string& service, boost::asio::any_io_executor executor,
+    ResolveHandler handler)
+{
+    Waiter waiter {std::move(executor), std::move(handler)};
+    auto guard = lock();
+    auto key = host + ":" + service;
+    auto [it, inserted] = entries.try_emplace(key);
+    auto& entry = it->second;
+    if (inserted) {
+        entry.host = host;
+        entry.service = service;
+        entry.next = 0;
+        entry.resolving = false;
+        entry.failed = false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    // Once resolving has failed, stale endpoints are served right away
+    // instead of making every lookup wait for the resolver.
+    auto usable_until = entry.failed ? entry.expires_at + config.max_stale
+        : entry.expires_at;
+    if (!entry.endpoints.empty() && now < usable_until) {
+        if (now >= entry.refresh_at && !entry.resolving) {
+            start_resolve(key, entry);
+        }
+        complete(std::move(waiter), {}, rotate(entry));
+        return;
+    }
+    entry.waiters.push_back(std::move(waiter));
+    if (!entry.resolving) {start_resolve(key, entry);}
+}
+
+void DnsCache::complete(Waiter waiter, boost::system::error_code ec,
+    Endpoints endpoints)
+{
+    boost::asio::post(waiter.executor, [handler = std::move(waiter.handler),
+        ec, endpoints = std::move(endpoints)] () mutable
+    {
+        handler(ec, std::move(endpoints));
+    });
+}
+
+void DnsCache::on_resolve(const std::string& key, boost::system::error_code ec,
+    boost::asio::ip::tcp::resolver::results_type results)
+{
+    auto guard = lock();
+    auto& entry = entries[key];
+    entry.resolving = false;
+    auto now = std::chrono::steady_clock::now();
+    entry.failed = ec || results.empty();
+    if (!entry.failed) {
+        entry.endpoints.clear();
+        for (const auto& result: results) {
+            entry.endpoints.push_back(result.endpoint());
+        }
+        entry.expires_at = now + config.ttl;
+        entry.refresh_at = entry.expires_at - config.refresh_ahead;
+    } else {
+        // Keep serving the previous endpoints while they are not too stale,
+        // and wait a little before trying again.
+        if (entry.expires_at + config.max_stale <= now) {
+            entry.endpoints.clear();
+        }
+        entry.refresh_at = now + config.refresh_ahead;
+        if (!ec) {ec = boost::asio::error::host_not_found;}
+    }
+    auto waiters = std::move(entry.waiters);
+    entry.waiters.clear();
+    for (auto& waiter: waiters) {
+        if (entry.endpoints.empty()) {
+            complete(std::move(waiter), ec, {});
+        } else {
+            complete(std::move(waiter), {}, rotate(entry));
+        }
+    }
+}
+
+std::unique_lock<std::mutex> DnsCache::lock() {
+    if (!synchronized) {return {};}
+    return std::unique_lock<std::mutex>(mutex);
+}
+
+DnsCache::Endpoints DnsCache::rotate(Entry& entry) {
+    auto n = entry.endpoints.size();
+    Endpoints endpoints;
+    endpoints.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        endpoints.push_back(entry.endpoints[(entry.next + i) % n]);
+    }
+    entry.next = (entry.next + 1) % n;
+    return endpoints;
+}
+
+void DnsCache::start_resolve(const std::string& key, Entry& entry) {
+    entry.resolving = true;
+    auto this_ = shared_from_this();
+    resolver.async_resolve(entry.host, entry.service, [this_, key] (
+        boost::system::error_code ec,
+        boost::asio::ip::tcp::resolver::results_type results)
+    {
+        this_->on_resolve(key, ec, std::move(results));
+    });
+}
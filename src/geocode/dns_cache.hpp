@@ -0,0 +1,84 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/system/error_code.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct DnsConfiguration {
+    // How long resolved endpoints are used before resolving again.
+    std::chrono::steady_clock::duration ttl;
+    // Lookups this close to expiry trigger a refresh in the background.
+    std::chrono::steady_clock::duration refresh_ahead;
+    // How long past expiry endpoints may still be used if resolving fails.
+    std::chrono::steady_clock::duration max_stale;
+};
+
+DnsConfiguration default_dns_config();
+
+// Caches name resolutions. Each lookup returns the endpoints rotated by one
+// position so that connections are spread across the addresses of a host.
+// A synchronized cache may be used from several threads.
+class DnsCache: public std::enable_shared_from_this<DnsCache> {
+private:
+    struct Priv {};
+
+public:
+    using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+    using ResolveHandler = std::function<void(boost::system::error_code,
+        Endpoints)>;
+
+    explicit DnsCache(boost::asio::io_context& ioc, DnsConfiguration config,
+        bool synchronized, Priv);
+
+    static std::shared_ptr<DnsCache> make(boost::asio::io_context& ioc,
+        DnsConfiguration config, bool synchronized);
+
+    // The handler is invoked through executor.
+    void async_resolve(const std::string& host, const std::string& service,
+        boost::asio::any_io_executor executor, ResolveHandler handler);
+
+private:
+    struct Waiter {
+        boost::asio::any_io_executor executor;
+        ResolveHandler handler;
+    };
+
+    struct Entry {
+        std::string host;
+        std::string service;
+        Endpoints endpoints;
+        std::chrono::steady_clock::time_point expires_at;
+        std::chrono::steady_clock::time_point refresh_at;
+        std::size_t next;
+        bool resolving;
+        // Whether the last resolution failed.
+        bool failed;
+        std::vector<Waiter> waiters;
+    };
+
+    void complete(Waiter waiter, boost::system::error_code ec,
+        Endpoints endpoints);
+    std::unique_lock<std::mutex> lock();
+    void on_resolve(const std::string& key, boost::system::error_code ec,
+        boost::asio::ip::tcp::resolver::results_type results);
+    Endpoints rotate(Entry& entry);
+    void start_resolve(const std::string& key, Entry& entry);
+
+private:
+    DnsConfiguration config;
+    bool synchronized;
+    std::mutex mutex;
+    boost::asio::ip::tcp::resolver resolver;
+    std::map<std::string, Entry> entries;
+};
@@ -0,0 +1,279 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "client.hpp"
+#include "finder.hpp"
+#include "metrics.hpp"
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <utility>
+
+FinderConfiguration default_finder_config() {
+    return FinderConfiguration {Dispatch::Sequential, Ordering::Configured,
+        95.0, std::chrono::milliseconds(500), default_breaker_config()};
+}
+
+namespace {
+    template <typename... Backends>
+    std::optional<AnyProtocol> make_protocol(std::string_view name,
+        const ProtocolSettings& settings, BackendList<Backends...>)
+    {
+        std::optional<AnyProtocol> protocol;
+        ((name == ProtocolTraits<Backends>::name
+            && (protocol = std::make_shared<const Protocol<Backends>>(
+            settings))), ...);
+        return protocol;
+    }
+
+    class Finder: public std::enable_shared_from_this<Finder> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit Finder(std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& config, std::string location,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor, FindHandler handler, Priv
+        ):
+            context(std::move(context)),
+            protocols(std::move(protocols)),
+            config(config),
+            location(std::move(location)),
+            deadline(deadline),
+            executor(executor),
+            handler(std::move(handler)),
+            hedge_timer(executor),
+            deadline_timer(executor),
+            lookups(this->protocols.size()),
+            started(0),
+            pending(0),
+            done(false),
+            not_found(false),
+            rate_limited(false)
+        {}
+
+        static std::shared_ptr<Finder> make(
+            std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& config, std::string location,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor, FindHandler handler)
+        {
+            return std::make_shared<Finder>(std::move(context),
+                std::move(protocols), config, std::move(location), deadline,
+                std::move(executor), std::move(handler), Priv {});
+        }
+
+        void run() {
+            if (protocols.empty()) {
+                fail_early("No backend service configured");
+                return;
+            }
+            order_protocols(*context->stats, config, protocols);
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                auto this_ = shared_from_this();
+                deadline_timer.expires_at(deadline);
+                deadline_timer.async_wait([this_] (
+                    boost::system::error_code ec)
+                {
+                    if (ec || this_->done) {return;}
+                    this_->finish(Error {ErrorKind::BackendFailure,
+                        "Deadline exceeded"});
+                });
+            }
+            if (config.dispatch == Dispatch::Race) {
+                while (request_coordinates()) {}
+            } else {
+                request_coordinates();
+            }
+            if (pending == 0) {
+                deadline_timer.cancel();
+                fail_early(rate_limited ? RATE_LIMITED
+                    : "No backend service available");
+            }
+        }
+
+    private:
+        struct Attempt {
+            std::weak_ptr<Lookup> lookup;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        // Fails before any lookup started. Posted since the handler must
+        // not run before async_find returns.
+        void fail_early(const char* cause) {
+            done = true;
+            boost::asio::post(executor, [handler = std::move(handler),
+                cause]
+            {
+                handler(Error {ErrorKind::BackendFailure, cause});
+            });
+        }
+
+        void finish(ProtocolResult result) {
+            done = true;
+            hedge_timer.cancel();
+            deadline_timer.cancel();
+            for (auto& attempt: lookups) {
+                if (auto lookup = attempt.lookup.lock()) {lookup->cancel();}
+            }
+            handler(std::move(result));
+        }
+
+        void hedge() {
+            const auto& authority = protocol_authority(
+                protocols[started - 1]);
+            auto delay = context->stats->latency_percentile(authority,
+                config.hedge_percentile).value_or(config.hedge_delay);
+            auto this_ = shared_from_this();
+            hedge_timer.expires_after(delay);
+            hedge_timer.async_wait([this_] (boost::system::error_code ec) {
+                if (ec || this_->done) {return;}
+                if (this_->started < this_->protocols.size()
+                    && this_->request_coordinates())
+                {
+                    count_hedge();
+                }
+            });
+        }
+
+        void on_coordinates(std::size_t index, ProtocolResult result) {
+            --pending;
+            if (done) {return;}
+            auto& attempt = lookups[index];
+            auto e = std::get_if<Error>(&result);
+            auto outcome = !e ? LookupOutcome::Found
+                : e->kind == ErrorKind::LocationNotFound
+                ? LookupOutcome::NotFound : LookupOutcome::Failed;
+            context->stats->record(protocol_authority(protocols[index]),
+                outcome, std::chrono::steady_clock::now() - attempt.start,
+                config.breaker);
+            if (!e) {
+                finish(std::move(result));
+                return;
+            }
+            not_found = not_found || e->kind == ErrorKind::LocationNotFound;
+            hedge_timer.cancel();
+            if (request_coordinates()) {
+                count_fallback();
+                return;
+            }
+            if (pending == 0) {
+                auto kind = not_found ? ErrorKind::LocationNotFound
+                    : ErrorKind::BackendFailure;
+                auto limited = !not_found && rate_limited;
+                finish(Error {kind, limited ? RATE_LIMITED : ""});
+            }
+        }
+
+        // Whether a protocol may be queried. The rate limit comes first, so
+        // that a breaker letting a single lookup through is not left
+        // waiting for one that was throttled.
+        bool available(const AnyProtocol& protocol) {
+            if (!acquire_protocol(protocol)) {
+                count_rate_limit_skip();
+                rate_limited = true;
+                return false;
+            }
+            if (!context->stats->allow(protocol_authority(protocol),
+                config.breaker))
+            {
+                count_breaker_skip();
+                return false;
+            }
+            return true;
+        }
+
+        // Queries the next protocol not skipped by its rate limit or
+        // circuit breaker. Returns false if there is none left.
+        bool request_coordinates() {
+            while (started < protocols.size()
+                && !available(protocols[started]))
+            {
+                ++started;
+            }
+            if (started == protocols.size()) {return false;}
+            auto index = started++;
+            ++pending;
+            auto this_ = shared_from_this();
+            auto cont = boost::asio::bind_executor(executor, std::bind(
+                &Finder::on_coordinates, this_, index, std::placeholders::_1));
+            auto& attempt = lookups[index];
+            attempt.start = std::chrono::steady_clock::now();
+            attempt.lookup = std::visit([&] (const auto& proto) {
+                return async_find_lat_long(context, proto, location,
+                    std::move(cont));
+            }, protocols[index]);
+            if (config.dispatch == Dispatch::Hedged
+                && started < protocols.size())
+            {
+                hedge();
+            }
+            return true;
+        }
+
+    private:
+        std::shared_ptr<ClientContext> context;
+        std::vector<AnyProtocol> protocols;
+        FinderConfiguration config;
+        std::string location;
+        std::chrono::steady_clock::time_point deadline;
+        boost::asio::any_io_executor executor;
+        FindHandler handler;
+        boost::asio::steady_timer hedge_timer;
+        boost::asio::steady_timer deadline_timer;
+        std::vector<Attempt> lookups;
+        // Number of protocols queried so far.
+        std::size_t started;
+        // Number of lookups that have not completed.
+        std::size_t pending;
+        bool done;
+        // Whether a backend reported the location as unknown.
+        bool not_found;
+        // Whether a protocol was skipped because of its rate limit.
+        bool rate_limited;
+    };
+}
+
+std::optional<AnyProtocol> make_protocol(std::string_view name,
+    const ProtocolSettings& settings)
+{
+    return make_protocol(name, settings, Backends {});
+}
+
+// Protocols that never got an answer are tried first, so that their cost is
+// known. Ties keep the configured order.
+void order_protocols(BackendStats& stats, const FinderConfiguration& config,
+    std::vector<AnyProtocol>& protocols)
+{
+    if (config.ordering == Ordering::Configured || protocols.size() < 2) {
+        return;
+    }
+    std::vector<std::pair<double, AnyProtocol>> costs;
+    costs.reserve(protocols.size());
+    for (auto& protocol: protocols) {
+        costs.emplace_back(stats.cost(protocol_authority(protocol)),
+            std::move(protocol));
+    }
+    std::stable_sort(costs.begin(), costs.end(), [] (const auto& a,
+        const auto& b)
+    {
+        return a.first < b.first;
+    });
+    for (std::size_t i = 0; i < costs.size(); ++i) {
+        protocols[i] = std::move(costs[i].second);
+    }
+}
+
+void async_find(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols, const FinderConfiguration& config,
+    std::string location, std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, FindHandler handler)
+{
+    auto finder = Finder::make(std::move(context), std::move(protocols),
+        config, std::move(location), deadline, std::move(executor),
+        std::move(handler));
+    finder->run();
+}
@@ -0,0 +1,121 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "backend_stats.hpp"
+#include "client_context.hpp"
+#include "protocol.hpp"
+#include "protocol_here.hpp"
+#include "protocol_local.hpp"
+#include "protocol_mapquest.hpp"
+#include <boost/asio/any_io_executor.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+template <typename... Backends>
+struct BackendList {};
+
+// Backends that may be configured.
+using Backends = BackendList<Here, Local, MapQuest>;
+
+template <typename List>
+struct AnyProtocolOf;
+
+template <typename... Backends>
+struct AnyProtocolOf<BackendList<Backends...>> {
+    using type = std::variant<std::shared_ptr<const Protocol<Backends>>...>;
+};
+
+using AnyProtocol = AnyProtocolOf<Backends>::type;
+
+// Creates the protocol of the backend with the given name in the
+// configuration, if there is one.
+std::optional<AnyProtocol> make_protocol(std::string_view name,
+    const ProtocolSettings& settings);
+
+// Identifies the service of a protocol in the backend statistics.
+inline const std::string& protocol_authority(const AnyProtocol& protocol) {
+    return std::visit([] (const auto& proto) -> const std::string& {
+        return proto->authority();
+    }, protocol);
+}
+
+// Takes a request from the rate limit of the service of a protocol. Returns
+// false if the service must be skipped.
+inline bool acquire_protocol(const AnyProtocol& protocol) {
+    return std::visit([] (const auto& proto) {return proto->acquire();},
+        protocol);
+}
+
+// Time until the rate limit of the service of a protocol lets a request
+// through.
+inline std::chrono::steady_clock::duration protocol_delay(
+    const AnyProtocol& protocol)
+{
+    return std::visit([] (const auto& proto) {return proto->delay();},
+        protocol);
+}
+
+// Cause of the BackendFailure error of a lookup that skipped a service
+// because of its rate limit, and may succeed once the limit lets it
+// through.
+const char RATE_LIMITED[] = "Rate limited";
+
+using FindHandler = std::function<void(ProtocolResult)>;
+
+enum class Dispatch {
+    // Query the next protocol once the current one fails.
+    Sequential,
+    // Also query the next protocol once the current one is slower than
+    // usual.
+    Hedged,
+    // Query all protocols at once.
+    Race
+};
+
+enum class Ordering {
+    // Query the protocols in the configured order.
+    Configured,
+    // Query the protocols whose backends found locations the fastest
+    // first, accounting for their failures.
+    Adaptive
+};
+
+struct FinderConfiguration {
+    Dispatch dispatch;
+    Ordering ordering;
+    // Percentile of a backend's recent latencies after which the next
+    // protocol is queried when hedging.
+    double hedge_percentile;
+    // Delay before querying the next protocol when hedging, until enough
+    // latencies are known.
+    std::chrono::steady_clock::duration hedge_delay;
+    // Backends failing too often are skipped until they recover.
+    BreakerConfiguration breaker;
+};
+
+FinderConfiguration default_finder_config();
+
+// Puts protocols in the order they are queried in.
+void order_protocols(BackendStats& stats, const FinderConfiguration& config,
+    std::vector<AnyProtocol>& protocols);
+
+// Looks up a location with the given protocols, in order, until one finds
+// it. Protocols whose rate limit is reached or whose circuit breaker is open
+// are skipped. The first coordinates found win and the other lookups are
+// cancelled. If no protocol finds the location, the result is a
+// LocationNotFound error if at least one reported the location as unknown,
+// and a BackendFailure error otherwise, caused by RATE_LIMITED if a protocol
+// was skipped because of its rate limit. Past the deadline, the lookups are
+// cancelled and the result is a BackendFailure error. The handler is
+// invoked through executor.
+void async_find(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols, const FinderConfiguration& config,
+    std::string location, std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, FindHandler handler);
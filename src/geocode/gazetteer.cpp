@@ -0,0 +1,379 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "gazetteer.hpp"
+#include "location.hpp"
+#include <algorithm>
+#include <boost/crc.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+namespace {
+    const char MAGIC[8] = {'G', 'E', 'O', 'C', 'G', 'A', 'Z', '\0'};
+    const std::uint32_t FORMAT_VERSION = 1;
+    // No entry, or no single entry below a node.
+    const std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+    // Followed by the offsets of the words in the word data, the word data,
+    // the nodes, root first, and the coordinates of the entries. Sections
+    // are aligned on 8 bytes.
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        // Of the header, with this field zero.
+        std::uint32_t checksum;
+        std::uint64_t word_count;
+        std::uint64_t word_bytes;
+        std::uint64_t node_count;
+        std::uint64_t entry_count;
+    };
+
+    struct StoredNode {
+        std::uint32_t first_child;
+        std::uint32_t child_count;
+        std::uint32_t word;
+        std::uint32_t entry;
+        std::uint32_t unique;
+    };
+
+    static_assert(sizeof(Header) == 48, "Unexpected padding");
+    static_assert(sizeof(StoredNode) == 20, "Unexpected padding");
+    static_assert(sizeof(Coordinates) == 16, "Unexpected padding");
+
+    std::uint32_t checksum(Header header) {
+        header.checksum = 0;
+        boost::crc_32_type crc;
+        crc.process_bytes(&header, sizeof(header));
+        return crc.checksum();
+    }
+
+    std::uint64_t align(std::uint64_t size) {return (size + 7) / 8 * 8;}
+
+    std::vector<std::string_view> split_words(std::string_view key) {
+        std::vector<std::string_view> words;
+        while (!key.empty()) {
+            auto word = key.substr(0, key.find(' '));
+            words.push_back(word);
+            key.remove_prefix(std::min(word.size() + 1, key.size()));
+        }
+        return words;
+    }
+
+    [[noreturn]] void corrupt() {
+        throw std::runtime_error("Corrupt gazetteer");
+    }
+
+    template <typename T>
+    T read_at(const char* data, std::uint64_t index) {
+        T value;
+        std::memcpy(&value, data + index * sizeof(T), sizeof(T));
+        return value;
+    }
+
+    class GazetteerWriter {
+    public:
+        void add(const GazetteerEntry& entry) {
+            auto key = normalize_location(encode_location(entry.address));
+            if (key.empty()) {return;}
+            std::uint32_t current = 0;
+            for (auto word: split_words(key)) {
+                auto id = words.emplace(std::string(word), 0).first;
+                auto& children = nodes[current].children;
+                auto it = children.find(id->first);
+                if (it == children.end()) {
+                    check_limit(nodes.size());
+                    it = children.emplace(id->first, nodes.size()).first;
+                    nodes.emplace_back();
+                }
+                current = it->second;
+            }
+            auto& node = nodes[current];
+            if (node.entry == NONE) {
+                check_limit(coords.size());
+                node.entry = static_cast<std::uint32_t>(coords.size());
+                coords.push_back(entry.coords);
+            } else {
+                coords[node.entry] = entry.coords;
+            }
+        }
+
+        void write(const boost::filesystem::path& path) {
+            std::uint32_t rank = 0;
+            std::uint64_t word_bytes = 0;
+            for (auto& [word, id]: words) {
+                id = rank++;
+                word_bytes += word.size();
+            }
+            auto stored = layout();
+            Header header {{}, FORMAT_VERSION, 0, words.size(), word_bytes,
+                stored.size(), coords.size()};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.checksum = checksum(header);
+            boost::filesystem::ofstream out(path, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            std::uint64_t offset = 0;
+            for (auto& [word, id]: words) {
+                out.write(reinterpret_cast<const char*>(&offset),
+                    sizeof(offset));
+                offset += word.size();
+            }
+            out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+            for (auto& [word, id]: words) {out.write(word.data(), word.size());}
+            pad(out, word_bytes);
+            out.write(reinterpret_cast<const char*>(stored.data()),
+                stored.size() * sizeof(StoredNode));
+            pad(out, stored.size() * sizeof(StoredNode));
+            out.write(reinterpret_cast<const char*>(coords.data()),
+                coords.size() * sizeof(Coordinates));
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Failed to write " + path.string());
+            }
+        }
+
+    private:
+        // Children are keyed by word, which orders them like the ranks of
+        // their words.
+        struct BuildNode {
+            std::map<std::string_view, std::uint32_t> children;
+            std::uint32_t entry = NONE;
+        };
+
+        static void check_limit(std::size_t count) {
+            if (count >= NONE) {
+                throw std::runtime_error("Too many addresses in gazetteer");
+            }
+        }
+
+        static void pad(std::ostream& out, std::uint64_t size) {
+            const char zeros[8] = {};
+            out.write(zeros, static_cast<std::streamsize>(align(size) - size));
+        }
+
+        // Numbers nodes breadth first, so that the children of a node are
+        // stored together, and finds the single entry below each node.
+        std::vector<StoredNode> layout() const {
+            // Children are created after their parent.
+            std::vector<std::uint32_t> unique(nodes.size(), NONE);
+            std::vector<std::uint64_t> counts(nodes.size(), 0);
+            for (auto i = nodes.size(); i-- > 0;) {
+                auto& node = nodes[i];
+                auto& count = counts[i];
+                count = node.entry == NONE ? 0 : 1;
+                unique[i] = node.entry;
+                for (auto& [word, child]: node.children) {
+                    count += counts[child];
+                    if (counts[child] > 0) {unique[i] = unique[child];}
+                }
+                if (count != 1) {unique[i] = NONE;}
+            }
+            std::vector<std::uint32_t> order {0};
+            std::vector<std::uint32_t> positions(nodes.size(), 0);
+            for (std::size_t i = 0; i < order.size(); ++i) {
+                for (auto& [word, child]: nodes[order[i]].children) {
+                    positions[child] = static_cast<std::uint32_t>(
+                        order.size());
+                    order.push_back(child);
+                }
+            }
+            std::vector<StoredNode> stored;
+            stored.reserve(order.size());
+            for (auto index: order) {
+                auto& node = nodes[index];
+                StoredNode s {0, static_cast<std::uint32_t>(
+                    node.children.size()), 0, node.entry, unique[index]};
+                if (!node.children.empty()) {
+                    s.first_child = positions[node.children.begin()->second];
+                }
+                stored.push_back(s);
+            }
+            for (auto& node: nodes) {
+                for (auto& [word, child]: node.children) {
+                    stored[positions[child]].word = words.at(
+                        std::string(word));
+                }
+            }
+            return stored;
+        }
+
+    private:
+        // Words and their ranks.
+        std::map<std::string, std::uint32_t> words;
+        std::vector<BuildNode> nodes = std::vector<BuildNode>(1);
+        std::vector<Coordinates> coords;
+    };
+}
+
+void write_gazetteer(const std::vector<GazetteerEntry>& entries,
+    const boost::filesystem::path& path)
+{
+    GazetteerWriter writer;
+    for (auto& entry: entries) {writer.add(entry);}
+    writer.write(path);
+}
+
+Gazetteer::Gazetteer(const boost::filesystem::path& path):
+    mapping(path.string().c_str(), boost::interprocess::read_only),
+    region(mapping, boost::interprocess::read_only)
+{
+    auto data = static_cast<const char*>(region.get_address());
+    auto size = region.get_size();
+    Header header;
+    if (size < sizeof(header)) {corrupt();}
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.version != FORMAT_VERSION
+        || header.checksum != checksum(header)
+        || header.word_count >= NONE || header.node_count >= NONE
+        || header.entry_count >= NONE || header.node_count == 0
+        || header.word_bytes > size)
+    {
+        corrupt();
+    }
+    auto offsets_size = (header.word_count + 1) * sizeof(std::uint64_t);
+    auto nodes_size = header.node_count * sizeof(StoredNode);
+    auto expected = sizeof(header) + offsets_size + align(header.word_bytes)
+        + align(nodes_size) + header.entry_count * sizeof(Coordinates);
+    if (size != expected) {corrupt();}
+    word_offsets = data + sizeof(header);
+    word_data = word_offsets + offsets_size;
+    nodes = word_data + align(header.word_bytes);
+    entries = nodes + align(nodes_size);
+    word_count = static_cast<std::uint32_t>(header.word_count);
+    word_bytes = header.word_bytes;
+    node_count = static_cast<std::uint32_t>(header.node_count);
+    entry_count = static_cast<std::uint32_t>(header.entry_count);
+}
+
+std::optional<Coordinates> Gazetteer::find(std::string_view key,
+    GazetteerMatch match) const
+{
+    auto words = split_words(key);
+    if (words.empty()) {return std::nullopt;}
+    auto current = node(0);
+    for (std::size_t i = 0; i < words.size(); ++i) {
+        auto last = i + 1 == words.size();
+        auto partial = last && match == GazetteerMatch::Prefix;
+        auto [first_word, last_word] = this->words(words[i], !partial);
+        auto [first, end] = children(current, first_word, last_word);
+        if (first == end) {return std::nullopt;}
+        current = node(first);
+        if (!partial) {continue;}
+        // An address ending with the whole word wins over longer ones.
+        if (word(current.word) == words[i] && current.entry != NONE) {
+            return coordinates(current.entry);
+        }
+        if (end - first != 1 || current.unique == NONE) {return std::nullopt;}
+        return coordinates(current.unique);
+    }
+    if (current.entry == NONE) {return std::nullopt;}
+    return coordinates(current.entry);
+}
+
+// Walks the trie depth first, building the address of each node from the
+// one of its parent.
+std::vector<GazetteerEntry> Gazetteer::all_entries() const {
+    std::vector<GazetteerEntry> result;
+    result.reserve(entry_count);
+    // Nodes to visit, with the length of the address of their parent.
+    std::vector<std::pair<std::uint32_t, std::size_t>> stack;
+    auto push_children = [&] (const Node& parent, std::size_t length) {
+        for (auto i = parent.child_count; i-- > 0;) {
+            stack.emplace_back(parent.first_child + i, length);
+        }
+    };
+    push_children(node(0), 0);
+    std::string address;
+    std::uint32_t visited = 0;
+    while (!stack.empty()) {
+        auto [index, length] = stack.back();
+        stack.pop_back();
+        // Nodes are reached once unless children point back up.
+        if (++visited >= node_count) {corrupt();}
+        auto current = node(index);
+        address.resize(length);
+        if (length > 0) {address.push_back(' ');}
+        address.append(word(current.word));
+        if (current.entry != NONE) {
+            result.push_back(GazetteerEntry {address,
+                coordinates(current.entry)});
+        }
+        push_children(current, address.size());
+    }
+    return result;
+}
+
+std::pair<std::uint32_t, std::uint32_t> Gazetteer::children(
+    const Node& parent, std::uint32_t first, std::uint32_t last) const
+{
+    auto lower_bound = [&] (std::uint32_t word) {
+        auto low = parent.first_child;
+        auto high = parent.first_child + parent.child_count;
+        while (low < high) {
+            auto mid = low + (high - low) / 2;
+            if (node(mid).word < word) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    };
+    if (first == last) {return {0, 0};}
+    return {lower_bound(first), lower_bound(last)};
+}
+
+Coordinates Gazetteer::coordinates(std::uint32_t entry) const {
+    if (entry >= entry_count) {corrupt();}
+    return read_at<Coordinates>(entries, entry);
+}
+
+Gazetteer::Node Gazetteer::node(std::uint32_t index) const {
+    if (index >= node_count) {corrupt();}
+    auto stored = read_at<StoredNode>(nodes, index);
+    if (stored.child_count > node_count
+        || stored.first_child > node_count - stored.child_count)
+    {
+        corrupt();
+    }
+    return Node {stored.first_child, stored.child_count, stored.word,
+        stored.entry, stored.unique};
+}
+
+std::string_view Gazetteer::word(std::uint32_t index) const {
+    if (index >= word_count) {corrupt();}
+    auto begin = read_at<std::uint64_t>(word_offsets, index);
+    auto end = read_at<std::uint64_t>(word_offsets, index + 1);
+    if (begin > end || end > word_bytes) {corrupt();}
+    return std::string_view(word_data + begin,
+        static_cast<std::size_t>(end - begin));
+}
+
+std::pair<std::uint32_t, std::uint32_t> Gazetteer::words(
+    std::string_view prefix, bool exact) const
+{
+    // First word for which before returns false.
+    auto partition = [&] (std::uint32_t low, auto before) {
+        auto high = word_count;
+        while (low < high) {
+            auto mid = low + (high - low) / 2;
+            if (before(word(mid))) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    };
+    auto first = partition(0, [&] (std::string_view w) {return w < prefix;});
+    if (exact) {
+        auto found = first < word_count && word(first) == prefix;
+        return {first, found ? first + 1 : first};
+    }
+    auto last = partition(first, [&] (std::string_view w) {
+        return w.substr(0, prefix.size()) == prefix;
+    });
+    return {first, last};
+}
@@ -0,0 +1,91 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "protocol.hpp"
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class GazetteerMatch {
+    // The location must be an address of the gazetteer.
+    Exact,
+    // The location may also be the start of a single address, its last word
+    // possibly incomplete.
+    Prefix
+};
+
+struct GazetteerEntry {
+    std::string address;
+    Coordinates coords;
+};
+
+// Writes the index of a gazetteer. Addresses are normalized like locations
+// and split into words; an address given several times keeps its last
+// coordinates. Throws if the file cannot be written.
+void write_gazetteer(const std::vector<GazetteerEntry>& entries,
+    const boost::filesystem::path& path);
+
+// Addresses and their coordinates, looked up in an index written by
+// write_gazetteer and mapped into memory.
+//
+// The index is a trie over the words of the normalized addresses. Words are
+// stored once, sorted, and identified by their rank; the children of a node
+// are stored together, sorted by word, so that both a word and a range of
+// words sharing a prefix are found by binary search. Each node records the
+// address ending there, and the only address below it if there is just one.
+// Files use the byte order of the machine. Immutable and safe to share
+// between threads.
+class Gazetteer {
+public:
+    // Throws if the file is not a valid index.
+    explicit Gazetteer(const boost::filesystem::path& path);
+    Gazetteer(const Gazetteer&) = delete;
+    Gazetteer& operator=(const Gazetteer&) = delete;
+
+    // Looks up a normalized location.
+    std::optional<Coordinates> find(std::string_view key,
+        GazetteerMatch match) const;
+    // Number of addresses.
+    std::size_t size() const {return entry_count;}
+    // All the addresses, normalized, and their coordinates.
+    std::vector<GazetteerEntry> all_entries() const;
+
+private:
+    struct Node {
+        std::uint32_t first_child;
+        std::uint32_t child_count;
+        std::uint32_t word;
+        std::uint32_t entry;
+        std::uint32_t unique;
+    };
+
+    // Children of a node whose words are in [first, last).
+    std::pair<std::uint32_t, std::uint32_t> children(const Node& parent,
+        std::uint32_t first, std::uint32_t last) const;
+    Coordinates coordinates(std::uint32_t entry) const;
+    Node node(std::uint32_t index) const;
+    std::string_view word(std::uint32_t index) const;
+    // Words starting with prefix, or equal to it if exact.
+    std::pair<std::uint32_t, std::uint32_t> words(std::string_view prefix,
+        bool exact) const;
+
+private:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    const char* word_offsets;
+    const char* word_data;
+    const char* nodes;
+    const char* entries;
+    std::uint32_t word_count;
+    std::uint64_t word_bytes;
+    std::uint32_t node_count;
+    std::uint32_t entry_count;
+};
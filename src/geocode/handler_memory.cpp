@@ -0,0 +1,34 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "handler_memory.hpp"
+#include <new>
+
+namespace {
+    std::atomic<std::uint64_t> heap_allocations {0};
+}
+
+void* HandlerMemory::allocate(std::size_t size) {
+    if (size <= SLOT_SIZE) {
+        for (auto& slot: slots) {
+            if (!slot.in_use.exchange(true, std::memory_order_acquire)) {
+                return &slot.storage;
+            }
+        }
+    }
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(size);
+}
+
+void HandlerMemory::deallocate(void* pointer) {
+    for (auto& slot: slots) {
+        if (pointer == &slot.storage) {
+            slot.in_use.store(false, std::memory_order_release);
+            return;
+        }
+    }
+    ::operator delete(pointer);
+}
+
+std::uint64_t handler_heap_allocations() {
+    return heap_allocations.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,116 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// Storage for the operations in flight of one object, such as a connection
+// handler. Asio allocates the state of an operation through the allocator
+// associated with its completion handler; binding handlers to an arena with
+// bind_arena serves these allocations from a few fixed slots instead of the
+// heap. Allocations that do not fit go to the heap. Slots may be released
+// from any thread.
+class HandlerMemory {
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size);
+    void deallocate(void* pointer);
+
+private:
+    // An object has at most a timer wait and an I/O operation in flight,
+    // each possibly made of nested operations.
+    static constexpr std::size_t SLOTS = 4;
+    static constexpr std::size_t SLOT_SIZE = 1024;
+
+    struct Slot {
+        std::aligned_storage_t<SLOT_SIZE> storage;
+        std::atomic<bool> in_use {false};
+    };
+
+private:
+    std::array<Slot, SLOTS> slots;
+};
+
+// Number of handler allocations that did not fit in their arena since the
+// start of the process. It stops growing under a steady load once objects
+// are recycled.
+std::uint64_t handler_heap_allocations();
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory): memory(&memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept:
+        memory(other.memory)
+    {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(memory->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t) {memory->deallocate(pointer);}
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept {
+        return memory == other.memory;
+    }
+
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept {
+        return memory != other.memory;
+    }
+
+private:
+    template <typename U>
+    friend class HandlerAllocator;
+
+    HandlerMemory* memory;
+};
+
+// Completion handler allocating from an arena. The arena must outlive the
+// operations the handler is passed to.
+template <typename Handler>
+class ArenaHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    explicit ArenaHandler(HandlerMemory& memory, Handler handler):
+        memory(memory),
+        handler(std::move(handler))
+    {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory;
+    Handler handler;
+};
+
+// The executor associated with the handler is not kept, so handlers are
+// bound to an arena before being bound to an executor.
+template <typename Handler>
+ArenaHandler<std::decay_t<Handler>> bind_arena(HandlerMemory& memory,
+    Handler&& handler)
+{
+    return ArenaHandler<std::decay_t<Handler>>(memory,
+        std::forward<Handler>(handler));
+}
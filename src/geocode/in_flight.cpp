@@ -0,0 +1,94 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "in_flight.hpp"
+#include <boost/asio/post.hpp>
+#include <utility>
+
+// Completes the waiters of a key once. If the lookup is abandoned without
+// producing a result, the waiters get a BackendFailure error instead of
+// waiting forever.
+class InFlightLookups::Flight {
+public:
+    explicit Flight(std::weak_ptr<InFlightLookups> table, std::string key):
+        table(std::move(table)),
+        key(std::move(key)),
+        done(false)
+    {}
+
+    Flight(const Flight&) = delete;
+    Flight& operator=(const Flight&) = delete;
+
+    ~Flight() {
+        if (!done) {
+            complete(Error {ErrorKind::BackendFailure, "Lookup abandoned"});
+        }
+    }
+
+    void complete(const ProtocolResult& result) {
+        done = true;
+        if (auto t = table.lock()) {t->complete(key, result);}
+    }
+
+private:
+    std::weak_ptr<InFlightLookups> table;
+    std::string key;
+    bool done;
+};
+
+InFlightLookups::InFlightLookups(bool synchronized, Priv):
+    synchronized(synchronized),
+    started(0),
+    coalesced(0)
+{}
+
+std::shared_ptr<InFlightLookups> InFlightLookups::make(bool synchronized) {
+    return std::make_shared<InFlightLookups>(synchronized, Priv {});
+}
+
+void InFlightLookups::join(const std::string& key,
+    boost::asio::any_io_executor executor, FindHandler handler,
+    const Start& start)
+{
+    {
+        auto guard = lock();
+        auto [it, inserted] = flights.try_emplace(key);
+        it->second.push_back(Waiter {std::move(executor),
+            std::move(handler)});
+        if (!inserted) {
+            ++coalesced;
+            return;
+        }
+    }
+    ++started;
+    auto flight = std::make_shared<Flight>(shared_from_this(), key);
+    start([flight] (ProtocolResult result) {flight->complete(result);});
+}
+
+InFlightStatistics InFlightLookups::statistics() const {
+    return InFlightStatistics {started.load(), coalesced.load()};
+}
+
+void InFlightLookups::complete(const std::string& key,
+    const ProtocolResult& result)
+{
+    std::vector<Waiter> waiters;
+    {
+        auto guard = lock();
+        auto it = flights.find(key);
+        if (it == flights.end()) {return;}
+        waiters = std::move(it->second);
+        flights.erase(it);
+    }
+    for (auto& waiter: waiters) {
+        boost::asio::post(waiter.executor, [handler = std::move(
+            waiter.handler), result] () mutable
+        {
+            handler(std::move(result));
+        });
+    }
+}
+
+std::unique_lock<std::mutex> InFlightLookups::lock() {
+    if (!synchronized) {return {};}
+    return std::unique_lock<std::mutex>(mutex);
+}
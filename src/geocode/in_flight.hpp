@@ -0,0 +1,61 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "finder.hpp"
+#include "protocol.hpp"
+#include <atomic>
+#include <boost/asio/any_io_executor.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct InFlightStatistics {
+    // Lookups sent to the backends.
+    unsigned long long started;
+    // Lookups that joined one already in flight.
+    unsigned long long coalesced;
+};
+
+// Coalesces concurrent lookups of the same location. The first lookup of a
+// key runs and every lookup of that key joining before it completes gets its
+// result. A synchronized table may be used from several threads.
+class InFlightLookups: public std::enable_shared_from_this<InFlightLookups> {
+private:
+    struct Priv {};
+
+public:
+    // Starts a lookup and calls the given handler with its result.
+    using Start = std::function<void(FindHandler)>;
+
+    explicit InFlightLookups(bool synchronized, Priv);
+
+    static std::shared_ptr<InFlightLookups> make(bool synchronized);
+
+    // Calls handler through executor with the result of the lookup in flight
+    // for key, first starting one with start if there is none.
+    void join(const std::string& key, boost::asio::any_io_executor executor,
+        FindHandler handler, const Start& start);
+    InFlightStatistics statistics() const;
+
+private:
+    struct Waiter {
+        boost::asio::any_io_executor executor;
+        FindHandler handler;
+    };
+
+    class Flight;
+
+    void complete(const std::string& key, const ProtocolResult& result);
+    std::unique_lock<std::mutex> lock();
+
+private:
+    bool synchronized;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<Waiter>> flights;
+    std::atomic<unsigned long long> started;
+    std::atomic<unsigned long long> coalesced;
+};
@@ -0,0 +1,233 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "json_scanner.hpp"
+#include <charconv>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+    // Characters ending a value other than a string, object or array.
+    const char DELIMITERS[] = ",]} \t\r\n";
+
+    bool is_digit(char c) {return c >= '0' && c <= '9';}
+
+    // Whether a token is a number as JSON defines it: an optional minus
+    // sign, an integer part without leading zeros, an optional fraction and
+    // an optional exponent. std::from_chars also reads inf, nan and other
+    // forms that are not JSON.
+    bool is_json_number(std::string_view token) {
+        std::size_t i = 0;
+        auto digits = [&] {
+            auto begin = i;
+            while (i < token.size() && is_digit(token[i])) {++i;}
+            return i > begin;
+        };
+        if (i < token.size() && token[i] == '-') {++i;}
+        if (i < token.size() && token[i] == '0') {
+            ++i;
+        } else if (!digits()) {
+            return false;
+        }
+        if (i < token.size() && token[i] == '.') {
+            ++i;
+            if (!digits()) {return false;}
+        }
+        if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+            ++i;
+            if (i < token.size() && (token[i] == '+' || token[i] == '-')) {
+                ++i;
+            }
+            if (!digits()) {return false;}
+        }
+        return i == token.size();
+    }
+}
+
+JsonScanner::JsonScanner(std::string_view text):
+    text(text),
+    pos(0),
+    depth(0),
+    after_open(false)
+{}
+
+void JsonScanner::begin_array() {
+    expect('[');
+    ++depth;
+    after_open = true;
+}
+
+void JsonScanner::begin_object() {
+    expect('{');
+    ++depth;
+    after_open = true;
+}
+
+void JsonScanner::end_array() {
+    while (next_element()) {skip_value();}
+}
+
+void JsonScanner::end_object() {
+    while (next_key()) {skip_value();}
+}
+
+void JsonScanner::expect(char c) {
+    if (peek() != c) {fail();}
+    ++pos;
+}
+
+void JsonScanner::fail() const {
+    throw std::runtime_error("Invalid JSON");
+}
+
+void JsonScanner::finish() {
+    while (depth > 0) {
+        if (pos == text.size()) {fail();}
+        auto c = text[pos++];
+        if (c == '"') {
+            skip_string();
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            --depth;
+        }
+    }
+    skip_whitespace();
+    if (pos != text.size()) {fail();}
+}
+
+bool JsonScanner::find_key(std::string_view key) {
+    while (auto k = next_key()) {
+        if (*k == key) {return true;}
+        skip_value();
+    }
+    return false;
+}
+
+void JsonScanner::leave() {
+    ++pos;
+    after_open = false;
+    --depth;
+}
+
+bool JsonScanner::next_element() {
+    auto c = peek();
+    if (c == ']') {
+        leave();
+        return false;
+    }
+    if (after_open) {
+        after_open = false;
+        return true;
+    }
+    expect(',');
+    return true;
+}
+
+std::optional<std::string_view> JsonScanner::next_key() {
+    auto c = peek();
+    if (c == '}') {
+        leave();
+        return std::nullopt;
+    }
+    if (!after_open) {expect(',');}
+    after_open = false;
+    auto key = read_string();
+    expect(':');
+    return key;
+}
+
+char JsonScanner::peek() {
+    skip_whitespace();
+    if (pos == text.size()) {fail();}
+    return text[pos];
+}
+
+// The number must be followed by a delimiter, as it is in an array or an
+// object, so that a truncated one is not read.
+double JsonScanner::read_number() {
+    peek();
+    auto end = text.find_first_of(DELIMITERS, pos);
+    if (end == std::string_view::npos) {fail();}
+    auto token = text.substr(pos, end - pos);
+    if (!is_json_number(token)) {fail();}
+    double value = 0;
+    auto last = token.data() + token.size();
+    auto [stop, err] = std::from_chars(token.data(), last, value);
+    if (err != std::errc() || stop != last) {fail();}
+    pos = end;
+    after_open = false;
+    return value;
+}
+
+std::pair<double, double> JsonScanner::read_numbers(std::string_view first,
+    std::string_view second)
+{
+    std::optional<double> a;
+    std::optional<double> b;
+    while (!a || !b) {
+        auto key = next_key();
+        if (!key) {fail();}
+        if (*key == first) {
+            a = read_number();
+        } else if (*key == second) {
+            b = read_number();
+        } else {
+            skip_value();
+        }
+    }
+    end_object();
+    return {*a, *b};
+}
+
+std::string_view JsonScanner::read_string() {
+    expect('"');
+    auto begin = pos;
+    skip_string();
+    return text.substr(begin, pos - begin - 1);
+}
+
+// Skips the rest of a string whose opening quote was consumed.
+void JsonScanner::skip_string() {
+    while (pos < text.size()) {
+        auto c = text[pos++];
+        if (c == '"') {return;}
+        if (c == '\\') {++pos;}
+    }
+    fail();
+}
+
+void JsonScanner::skip_value() {
+    auto c = peek();
+    after_open = false;
+    if (c == '"') {
+        ++pos;
+        skip_string();
+        return;
+    }
+    if (c != '{' && c != '[') {
+        auto end = text.find_first_of(DELIMITERS, pos);
+        if (end == pos) {fail();}
+        pos = end == std::string_view::npos ? text.size() : end;
+        return;
+    }
+    std::size_t depth = 0;
+    while (pos < text.size()) {
+        c = text[pos++];
+        if (c == '"') {
+            skip_string();
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {return;}
+        }
+    }
+    fail();
+}
+
+void JsonScanner::skip_whitespace() {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t'
+        || text[pos] == '\r' || text[pos] == '\n'))
+    {
+        ++pos;
+    }
+}
@@ -0,0 +1,66 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+// Reads values out of a JSON document in one forward pass without building
+// it in memory, allocating nothing. The scanner does not validate what it
+// skips beyond matching brackets and quotes, and stops wherever the caller
+// stops, or at the end of the document with finish(). Keys are compared as
+// they appear in the document, escape sequences included. Malformed input
+// throws std::runtime_error.
+class JsonScanner {
+public:
+    explicit JsonScanner(std::string_view text);
+
+    // Enters the object or array at the cursor.
+    void begin_array();
+    void begin_object();
+    // Skips the remaining elements or members of the current array or
+    // object and leaves it.
+    void end_array();
+    void end_object();
+    // Moves the cursor to the value of the member with the given key of the
+    // current object. If there is no such member, leaves the object and
+    // returns false.
+    bool find_key(std::string_view key);
+    // Skips the rest of the document, checking that its brackets are
+    // balanced and that nothing follows it, so that a malformed document
+    // is not taken for a result.
+    void finish();
+    // Moves the cursor to the next element of the current array. At the end
+    // of the array, leaves it and returns false.
+    bool next_element();
+    // Returns the key of the next member of the current object, with the
+    // cursor on its value. At the end of the object, leaves it and returns
+    // nothing.
+    std::optional<std::string_view> next_key();
+    // Reads the number at the cursor. Throws if it is not a JSON number.
+    double read_number();
+    // Reads the numbers of two members of the current object and leaves
+    // it, so that a number is not read out of a malformed object.
+    std::pair<double, double> read_numbers(std::string_view first,
+        std::string_view second);
+    void skip_value();
+
+private:
+    void expect(char c);
+    [[noreturn]] void fail() const;
+    void leave();
+    char peek();
+    std::string_view read_string();
+    void skip_string();
+    void skip_whitespace();
+
+private:
+    std::string_view text;
+    std::size_t pos;
+    // Number of objects and arrays entered and not left.
+    std::size_t depth;
+    // Whether the cursor is right after an opening bracket.
+    bool after_open;
+};
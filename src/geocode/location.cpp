@@ -0,0 +1,77 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "location.hpp"
+#include <cctype>
+#include <cstddef>
+#include <optional>
+
+namespace {
+    std::optional<int> hex_value(char c) {
+        if (c >= '0' && c <= '9') {return c - '0';}
+        if (c >= 'a' && c <= 'f') {return c - 'a' + 10;}
+        if (c >= 'A' && c <= 'F') {return c - 'A' + 10;}
+        return std::nullopt;
+    }
+
+    char to_lower(char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    bool is_unreserved(unsigned char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+            || (c >= 'A' && c <= 'Z') || c == '-' || c == '.' || c == '_'
+            || c == '~';
+    }
+
+    // ASCII whitespace and punctuation. Bytes of multibyte UTF-8 sequences
+    // are kept as is.
+    bool is_separator(unsigned char c) {
+        return c < 0x80 && (std::isspace(c) || std::ispunct(c));
+    }
+}
+
+std::string normalize_location(std::string_view location) {
+    std::string normalized;
+    normalized.reserve(location.size());
+    bool pending_separator = false;
+    for (std::size_t i = 0; i < location.size(); ++i) {
+        unsigned char c = location[i];
+        if (c == '+') {
+            c = ' ';
+        } else if (c == '%' && i + 2 < location.size()
+            && hex_value(location[i + 1]) && hex_value(location[i + 2]))
+        {
+            c = static_cast<unsigned char>(*hex_value(location[i + 1]) * 16
+                + *hex_value(location[i + 2]));
+            i += 2;
+        }
+        if (is_separator(c)) {
+            pending_separator = !normalized.empty();
+            continue;
+        }
+        if (pending_separator) {
+            normalized.push_back(' ');
+            pending_separator = false;
+        }
+        normalized.push_back(to_lower(static_cast<char>(c)));
+    }
+    return normalized;
+}
+
+std::string encode_location(std::string_view location) {
+    const char digits[] = "0123456789ABCDEF";
+    std::string encoded;
+    encoded.reserve(location.size());
+    for (unsigned char c: location) {
+        if (is_unreserved(c)) {
+            encoded.push_back(static_cast<char>(c));
+        } else if (c == ' ') {
+            encoded.push_back('+');
+        } else {
+            encoded.push_back('%');
+            encoded.push_back(digits[c >> 4]);
+            encoded.push_back(digits[c & 0xF]);
+        }
+    }
+    return encoded;
+}
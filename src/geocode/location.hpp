@@ -0,0 +1,15 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Normalizes a URL-encoded location so that spellings of the same location
+// that differ only in case, spacing or punctuation compare equal. The
+// location is URL-decoded, ASCII letters are lowercased, and runs of
+// whitespace and punctuation are collapsed into a single space.
+std::string normalize_location(std::string_view location);
+
+// URL-encodes a location for use in a query string.
+std::string encode_location(std::string_view location);
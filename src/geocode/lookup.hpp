@@ -0,0 +1,23 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "protocol.hpp"
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+// Handle to a running lookup.
+class Lookup {
+public:
+    virtual ~Lookup() = default;
+    // Stops the lookup, which then completes with operation_aborted. Must be
+    // called through the lookup's executor.
+    virtual void cancel() = 0;
+};
+
+// Outcome of a request made with Protocol: what Protocol::parse returns, or
+// an error. For a protocol parsing coordinates, this is ProtocolResult.
+template <typename Protocol>
+using ClientResult = std::variant<std::decay_t<decltype(std::declval<
+    const Protocol&>().parse(std::declval<const Response&>()))>, Error>;
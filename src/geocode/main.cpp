@@ -1,5 +1,6 @@
 // Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
 
+#include "bulk.hpp"
 #include "service.hpp"
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
@@ -11,12 +12,96 @@
 
 void print_help_header() {
     auto help = "Geocoding proxy service\n\n"
-        "Usage: geocode [OPTIONS] --config=<CONFIG>\n";
+        "Usage: geocode [OPTIONS] --config=<CONFIG>\n"
+        "       geocode batch [BATCH OPTIONS] --config=<CONFIG> "
+        "--input=<FILE> --output=<FILE>\n";
     std::cout << help << std::endl;
 }
 
+// Geocodes the addresses of a file instead of starting the service.
+int run_batch(int argc, char** argv) {
+    boost::program_options::options_description options("Batch options");
+    options.add_options()
+        ("checkpoint-interval",
+            boost::program_options::value<std::size_t>()->default_value(10000),
+            "Number of results written between flushes of the output")
+        ("column", boost::program_options::value<std::size_t>()
+            ->default_value(0), "Column of the address in CSV input, from 0")
+        ("concurrency",
+            boost::program_options::value<std::size_t>()->default_value(64),
+            "Number of lookups in flight at once")
+        ("config,c", boost::program_options::value<std::string>(),
+            "Path to configuration file")
+        ("format", boost::program_options::value<std::string>(),
+            "Input and output format: \"csv\" or \"ndjson\" [default: csv "
+            "for a .csv input, ndjson otherwise]")
+        ("header", "CSV input starts with a header line")
+        ("help,h", "Display help message")
+        ("input,i", boost::program_options::value<std::string>(),
+            "Path to input file")
+        ("order", boost::program_options::value<std::string>()
+            ->default_value("input"), "Order of the results: \"input\" or "
+            "\"completion\"")
+        ("output,o", boost::program_options::value<std::string>(),
+            "Path to output file")
+        ("resume", "Keep the results already in the output and look up the "
+            "other records");
+    boost::program_options::variables_map vm;
+    boost::program_options::store(
+        boost::program_options::parse_command_line(argc, argv, options), vm);
+    boost::program_options::notify(vm);
+    if (vm.count("help")) {
+        print_help_header();
+        std::cout << options << std::endl;
+        return 0;
+    }
+    for (auto name: {"config", "input", "output"}) {
+        if (!vm.count(name)) {
+            std::cerr << "Missing \"" << name << "\" parameter" << std::endl;
+            return 1;
+        }
+    }
+    BulkOptions bulk;
+    bulk.input = vm["input"].as<std::string>();
+    bulk.output = vm["output"].as<std::string>();
+    auto format = vm.count("format") ? vm["format"].as<std::string>()
+        : bulk.input.extension() == ".csv" ? "csv" : "ndjson";
+    if (format == "csv") {
+        bulk.format = BulkFormat::Csv;
+    } else if (format == "ndjson") {
+        bulk.format = BulkFormat::Ndjson;
+    } else {
+        std::cerr << "Invalid \"format\" parameter" << std::endl;
+        return 1;
+    }
+    bulk.column = vm["column"].as<std::size_t>();
+    bulk.header = vm.count("header") > 0;
+    auto order = vm["order"].as<std::string>();
+    if (order == "input") {
+        bulk.order = BulkOrder::Input;
+    } else if (order == "completion") {
+        bulk.order = BulkOrder::Completion;
+    } else {
+        std::cerr << "Invalid \"order\" parameter" << std::endl;
+        return 1;
+    }
+    bulk.concurrency = vm["concurrency"].as<std::size_t>();
+    bulk.checkpoint_interval = vm["checkpoint-interval"].as<std::size_t>();
+    bulk.resume = vm.count("resume") > 0;
+    auto config = load_service_config(vm["config"].as<std::string>());
+    auto summary = run_bulk(config, bulk);
+    std::cout << summary.records << " records, " << summary.resumed
+        << " resumed, " << summary.lookups << " lookups, "
+        << summary.duplicates << " duplicates, " << summary.throttled
+        << " throttled, " << summary.failed << " failed" << std::endl;
+    return 0;
+}
+
 int main(int argc, char** argv) {
     try {
+        if (argc > 1 && std::string(argv[1]) == "batch") {
+            return run_batch(argc - 1, argv + 1);
+        }
         boost::program_options::options_description options("Options");
         options.add_options()
             ("address,a", boost::program_options::value<std::string>(),
@@ -25,7 +110,13 @@ int main(int argc, char** argv) {
                 "Path to configuration file")
             ("help,h", "Display help message")
             ("port,p", boost::program_options::value<unsigned short>(),
-                "Port to start service on");
+                "Port to start service on")
+            ("threading", boost::program_options::value<std::string>(),
+                "Threading model: \"per-thread\" runs an event loop and "
+                "acceptor per thread, \"shared\" runs one event loop on all "
+                "threads")
+            ("threads,t", boost::program_options::value<unsigned int>(),
+                "Number of threads [default: number of cores]");
         boost::program_options::variables_map vm;
         boost::program_options::store(
             boost::program_options::parse_command_line(argc, argv, options),
@@ -49,11 +140,27 @@ int main(int argc, char** argv) {
         if (vm.count("port")) {
             config.endpoint.port(vm["port"].as<unsigned short>());
         }
+        if (vm.count("threading")) {
+            auto threading = vm["threading"].as<std::string>();
+            if (threading == "per-thread") {
+                config.threading = Threading::PerThread;
+            } else if (threading == "shared") {
+                config.threading = Threading::Shared;
+            } else {
+                std::cerr << "Invalid \"threading\" parameter" << std::endl;
+                return 1;
+            }
+        }
+        if (vm.count("threads")) {
+            config.threads = vm["threads"].as<unsigned int>();
+            if (config.threads == 0) {
+                std::cerr << "Invalid \"threads\" parameter" << std::endl;
+                return 1;
+            }
+        }
         std::cout << "Geocoding service starting on " << config.endpoint
-            << std::endl;
-        boost::asio::io_context ioc;
-        run_service(ioc, config);
-        ioc.run();
+            << " with " << config.threads << " thread(s)" << std::endl;
+        run_service(config, config_path);
         return 0;
     } catch (const std::exception& e) {
         std::cerr << "Exiting with exception: " << e.what() << std::endl;
@@ -0,0 +1,390 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "metrics.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+    const ClientStage CLIENT_STAGES[] = {ClientStage::Acquire,
+        ClientStage::Resolve, ClientStage::Connect, ClientStage::Handshake,
+        ClientStage::Write, ClientStage::Read, ClientStage::Shutdown};
+    const std::size_t CLIENT_STAGE_COUNT = std::size(CLIENT_STAGES);
+
+    // Powers of two microseconds exported as histogram buckets, which are
+    // bucket bounds of LatencyHistogram.
+    const unsigned int MIN_EXPORTED_OCTAVE = 6;
+    const unsigned int MAX_EXPORTED_OCTAVE = 25;
+
+    struct ThreadMetrics {
+        LatencyHistogram requests;
+        LatencyHistogram parses;
+        LatencyHistogram queue_waits;
+        std::array<LatencyHistogram, CLIENT_STAGE_COUNT> stages;
+        std::atomic<std::uint64_t> fallbacks {0};
+        std::atomic<std::uint64_t> hedges {0};
+        std::atomic<std::uint64_t> breaker_skips {0};
+        std::atomic<std::uint64_t> rate_limit_skips {0};
+        std::atomic<std::uint64_t> reverse_index_hits {0};
+        std::atomic<std::uint64_t> reverse_fallbacks {0};
+        // Connections opened minus connections closed on the thread, which
+        // may be negative when connections move between threads.
+        std::atomic<std::int64_t> connections {0};
+    };
+
+    // Metrics of every thread that recorded some. They are kept after their
+    // thread exits so that counters do not go back.
+    struct ThreadRegistry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadMetrics>> threads;
+    };
+
+    ThreadRegistry& registry() {
+        static ThreadRegistry instance;
+        return instance;
+    }
+
+    ThreadMetrics* register_thread() {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.threads.push_back(std::make_unique<ThreadMetrics>());
+        return r.threads.back().get();
+    }
+
+#ifdef GEOCODE_COUNT_ALLOCATIONS
+    // Shared by all threads, so counting slows allocations down. Only meant
+    // for benchmarks.
+    std::atomic<std::uint64_t> allocations {0};
+#endif
+
+    ThreadMetrics& local() {
+        thread_local ThreadMetrics* metrics = register_thread();
+        return *metrics;
+    }
+
+    template <typename T>
+    void increment(std::atomic<T>& counter, T n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+
+    const char* type_name(MetricType type) {
+        switch (type) {
+        case MetricType::Counter: return "counter";
+        case MetricType::Gauge: return "gauge";
+        case MetricType::Histogram: return "histogram";
+        }
+        throw std::logic_error("Unreachable");
+    }
+
+    void append_number(std::string& out, double value) {
+        char buffer[32];
+        if (value == static_cast<double>(static_cast<long long>(value))) {
+            std::snprintf(buffer, sizeof(buffer), "%lld",
+                static_cast<long long>(value));
+        } else {
+            std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+        }
+        out.append(buffer);
+    }
+
+    // Adds histograms merged over all threads, one per label set.
+    template <typename Get>
+    void add_merged(MetricSet& set, const std::string& name,
+        const std::vector<std::unique_ptr<ThreadMetrics>>& threads,
+        std::string_view labels, Get get)
+    {
+        std::vector<std::uint64_t> fine(LatencyHistogram::BUCKETS, 0);
+        std::uint64_t total_us = 0;
+        for (auto& thread: threads) {get(*thread).merge(fine, total_us);}
+        std::vector<double> bounds;
+        std::vector<std::uint64_t> counts(
+            MAX_EXPORTED_OCTAVE - MIN_EXPORTED_OCTAVE + 2, 0);
+        for (auto octave = MIN_EXPORTED_OCTAVE;
+            octave <= MAX_EXPORTED_OCTAVE; ++octave)
+        {
+            bounds.push_back(static_cast<double>(1ull << octave) / 1e6);
+        }
+        std::size_t coarse = 0;
+        for (std::size_t i = 0; i < fine.size(); ++i) {
+            while (coarse < bounds.size() && LatencyHistogram::upper_bound(i)
+                > (1ull << (MIN_EXPORTED_OCTAVE + coarse)))
+            {
+                ++coarse;
+            }
+            counts[coarse] += fine[i];
+        }
+        set.add_histogram(name, labels, bounds, counts,
+            static_cast<double>(total_us) / 1e6);
+    }
+}
+
+void MetricSet::family(const std::string& name, MetricType type,
+    const std::string& help)
+{
+    if (indices.count(name)) {return;}
+    indices.emplace(name, families.size());
+    families.push_back(Family {name, type, help, {}, {}});
+}
+
+void MetricSet::add(const std::string& name, const std::string& sample,
+    double value)
+{
+    auto& family = families.at(indices.at(name));
+    auto [it, inserted] = family.indices.emplace(sample,
+        family.samples.size());
+    if (inserted) {
+        family.samples.emplace_back(sample, value);
+    } else {
+        family.samples[it->second].second += value;
+    }
+}
+
+void MetricSet::add_histogram(const std::string& name,
+    std::string_view labels, const std::vector<double>& bounds,
+    const std::vector<std::uint64_t>& counts, double sum)
+{
+    // Bucket samples share their name and labels up to le.
+    std::string prefix = "_bucket{";
+    prefix.append(labels);
+    if (!labels.empty()) {prefix.append(",");}
+    prefix.append("le=\"");
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        cumulative += counts[i];
+        auto sample = prefix;
+        if (i < bounds.size()) {
+            append_number(sample, bounds[i]);
+        } else {
+            sample.append("+Inf");
+        }
+        sample.append("\"}");
+        add(name, sample, static_cast<double>(cumulative));
+    }
+    std::string suffix;
+    if (!labels.empty()) {suffix.append("{").append(labels).append("}");}
+    add(name, "_sum" + suffix, sum);
+    add(name, "_count" + suffix, static_cast<double>(cumulative));
+}
+
+void MetricSet::write(std::string& out) const {
+    for (auto& family: families) {
+        out.append("# HELP ").append(family.name).append(" ")
+            .append(family.help).append("\n");
+        out.append("# TYPE ").append(family.name).append(" ")
+            .append(type_name(family.type)).append("\n");
+        for (auto& [sample, value]: family.samples) {
+            out.append(family.name).append(sample).append(" ");
+            append_number(out, value);
+            out.append("\n");
+        }
+    }
+}
+
+void LatencyHistogram::merge(std::vector<std::uint64_t>& counts,
+    std::uint64_t& total_us) const
+{
+    for (std::size_t i = 0; i < BUCKETS; ++i) {
+        counts[i] += this->counts[i].load(std::memory_order_relaxed);
+    }
+    total_us += this->total_us.load(std::memory_order_relaxed);
+}
+
+std::size_t LatencyHistogram::bucket(std::uint64_t us) {
+    if (us < SUB_BUCKETS) {return static_cast<std::size_t>(us);}
+    std::size_t exponent = 0;
+    for (auto v = us; v >>= 1;) {++exponent;}
+    auto sub = static_cast<std::size_t>(us >> (exponent - SUB_BUCKET_BITS))
+        - SUB_BUCKETS;
+    auto index = (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    return std::min(index, BUCKETS - 1);
+}
+
+std::uint64_t LatencyHistogram::upper_bound(std::size_t bucket) {
+    if (bucket < SUB_BUCKETS) {return bucket + 1;}
+    auto shift = bucket / SUB_BUCKETS - 1;
+    auto sub = bucket % SUB_BUCKETS;
+    return static_cast<std::uint64_t>(SUB_BUCKETS + sub + 1) << shift;
+}
+
+void record_client_stage(ClientStage stage,
+    std::chrono::steady_clock::duration duration)
+{
+    local().stages[static_cast<std::size_t>(stage)].record(duration);
+}
+
+void record_response_parse(std::chrono::steady_clock::duration duration) {
+    local().parses.record(duration);
+}
+
+void record_request_latency(std::chrono::steady_clock::duration duration) {
+    local().requests.record(duration);
+}
+
+void record_queue_wait(std::chrono::steady_clock::duration duration) {
+    local().queue_waits.record(duration);
+}
+
+void count_fallback() {
+    increment<std::uint64_t>(local().fallbacks, 1);
+}
+
+void count_hedge() {
+    increment<std::uint64_t>(local().hedges, 1);
+}
+
+void count_breaker_skip() {
+    increment<std::uint64_t>(local().breaker_skips, 1);
+}
+
+void count_rate_limit_skip() {
+    increment<std::uint64_t>(local().rate_limit_skips, 1);
+}
+
+void count_reverse_index_hit() {
+    increment<std::uint64_t>(local().reverse_index_hits, 1);
+}
+
+void count_reverse_fallback() {
+    increment<std::uint64_t>(local().reverse_fallbacks, 1);
+}
+
+void add_active_connections(std::int64_t delta) {
+    increment(local().connections, delta);
+}
+
+std::optional<std::uint64_t> heap_allocations() {
+#ifdef GEOCODE_COUNT_ALLOCATIONS
+    return allocations.load(std::memory_order_relaxed);
+#else
+    return std::nullopt;
+#endif
+}
+
+#ifdef GEOCODE_COUNT_ALLOCATIONS
+// GCC warns about memory from operator new given to std::free once these
+// replacements are inlined into the rest of the file.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// The other forms of operator new and delete call these ones.
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size == 0 ? 1 : size)) {return p;}
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void Metrics::add_collector(Collector collector) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collectors.push_back(std::move(collector));
+}
+
+std::string Metrics::scrape() const {
+    MetricSet set;
+    {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        set.family("geocode_request_duration_seconds", MetricType::Histogram,
+            "Time to respond to client requests.");
+        add_merged(set, "geocode_request_duration_seconds", r.threads, "",
+            [] (const ThreadMetrics& t) -> auto& {return t.requests;});
+        set.family("geocode_backend_stage_duration_seconds",
+            MetricType::Histogram,
+            "Time spent in each stage of lookups to backend services.");
+        for (std::size_t i = 0; i < CLIENT_STAGE_COUNT; ++i) {
+            std::string labels = "stage=\"";
+            for (unsigned char c: to_string(CLIENT_STAGES[i])) {
+                labels.push_back(static_cast<char>(std::tolower(c)));
+            }
+            labels.push_back('"');
+            add_merged(set, "geocode_backend_stage_duration_seconds",
+                r.threads, labels, [i] (const ThreadMetrics& t) -> auto& {
+                    return t.stages[i];
+                });
+        }
+        add_merged(set, "geocode_backend_stage_duration_seconds", r.threads,
+            "stage=\"parse\"", [] (const ThreadMetrics& t) -> auto& {
+                return t.parses;
+            });
+        set.family("geocode_admission_queue_wait_seconds",
+            MetricType::Histogram,
+            "Time lookups waited in the admission queue, until they ran or "
+            "timed out.");
+        add_merged(set, "geocode_admission_queue_wait_seconds", r.threads,
+            "", [] (const ThreadMetrics& t) -> auto& {return t.queue_waits;});
+        set.family("geocode_fallbacks_total", MetricType::Counter,
+            "Lookups started on a backend service other than the first one "
+            "of a request.");
+        set.family("geocode_hedges_total", MetricType::Counter,
+            "Lookups started because the previous backend service was slow.");
+        set.family("geocode_breaker_skips_total", MetricType::Counter,
+            "Backend services skipped because their circuit breaker was "
+            "open.");
+        set.family("geocode_rate_limit_skips_total", MetricType::Counter,
+            "Backend services skipped because their rate limit or quota was "
+            "reached, or they asked to wait.");
+        set.family("geocode_reverse_lookups_total", MetricType::Counter,
+            "Reverse lookups, by whether the index or the backend services "
+            "answered them.");
+        set.family("geocode_active_connections", MetricType::Gauge,
+            "Open client connections.");
+        for (auto& t: r.threads) {
+            auto load = [] (const auto& value) {
+                return static_cast<double>(
+                    value.load(std::memory_order_relaxed));
+            };
+            set.add("geocode_fallbacks_total", "", load(t->fallbacks));
+            set.add("geocode_hedges_total", "", load(t->hedges));
+            set.add("geocode_breaker_skips_total", "",
+                load(t->breaker_skips));
+            set.add("geocode_rate_limit_skips_total", "",
+                load(t->rate_limit_skips));
+            set.add("geocode_reverse_lookups_total", "{source=\"index\"}",
+                load(t->reverse_index_hits));
+            set.add("geocode_reverse_lookups_total", "{source=\"backend\"}",
+                load(t->reverse_fallbacks));
+            set.add("geocode_active_connections", "", load(t->connections));
+        }
+    }
+    set.family("process_cpu_seconds_total", MetricType::Counter,
+        "CPU time used by the process.");
+    set.add("process_cpu_seconds_total", "",
+        static_cast<double>(std::clock()) / CLOCKS_PER_SEC);
+    if (auto count = heap_allocations()) {
+        set.family("geocode_heap_allocations_total", MetricType::Counter,
+            "Heap allocations of the process.");
+        set.add("geocode_heap_allocations_total", "",
+            static_cast<double>(*count));
+    }
+    std::vector<Collector> current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = collectors;
+    }
+    for (auto& collector: current) {collector(set);}
+    std::string out;
+    set.write(out);
+    return out;
+}
@@ -0,0 +1,145 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "timeouts.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum class MetricType {
+    Counter,
+    Gauge,
+    Histogram
+};
+
+// Samples gathered on a scrape, written in the Prometheus text format.
+// Samples with the same name and labels are summed, so that sources such as
+// the caches of each event loop add up.
+class MetricSet {
+public:
+    // Declares a family of samples. Must be called before adding samples to
+    // it.
+    void family(const std::string& name, MetricType type,
+        const std::string& help);
+    // Adds to the sample of a family. The sample is the part of the sample
+    // name after the family name, such as "_bucket", followed by its labels,
+    // such as {le="0.1"}.
+    void add(const std::string& name, const std::string& sample,
+        double value);
+    // Adds cumulative buckets from counts of the values up to each bound,
+    // the last count being for the values above the last bound.
+    void add_histogram(const std::string& name, std::string_view labels,
+        const std::vector<double>& bounds,
+        const std::vector<std::uint64_t>& counts, double sum);
+    void write(std::string& out) const;
+
+private:
+    struct Family {
+        std::string name;
+        MetricType type;
+        std::string help;
+        std::vector<std::pair<std::string, double>> samples;
+        std::unordered_map<std::string, std::size_t> indices;
+    };
+
+private:
+    std::vector<Family> families;
+    std::unordered_map<std::string, std::size_t> indices;
+};
+
+// Histogram of durations recorded by one thread and read by others. Buckets
+// grow logarithmically with 8 buckets per power of two microseconds, which
+// keeps relative errors under 12.5% from a microsecond to days.
+class LatencyHistogram {
+public:
+    static constexpr std::size_t SUB_BUCKET_BITS = 3;
+    static constexpr std::size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr std::size_t BUCKETS = SUB_BUCKETS * 40;
+
+    // Must only be called by the thread owning the histogram.
+    void record(std::chrono::steady_clock::duration duration) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            duration).count();
+        auto value = static_cast<std::uint64_t>(us > 0 ? us : 0);
+        increment(counts[bucket(value)]);
+        increment(total_us, value);
+    }
+
+    // Adds the counts to the given ones, indexed like the buckets.
+    void merge(std::vector<std::uint64_t>& counts,
+        std::uint64_t& total_us) const;
+
+    static std::size_t bucket(std::uint64_t us);
+    // Exclusive upper bound of a bucket, in microseconds.
+    static std::uint64_t upper_bound(std::size_t bucket);
+
+private:
+    // Only the owning thread writes, so a plain load and store are enough.
+    static void increment(std::atomic<std::uint64_t>& counter,
+        std::uint64_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKETS> counts {};
+    std::atomic<std::uint64_t> total_us {0};
+};
+
+// Metrics recorded on the hot path. Each thread records to its own copy,
+// without locks or contended cache lines, and the copies are merged when
+// metrics are scraped.
+
+// Stage of a lookup to a backend.
+void record_client_stage(ClientStage stage,
+    std::chrono::steady_clock::duration duration);
+// Parsing of a backend response.
+void record_response_parse(std::chrono::steady_clock::duration duration);
+// Time to respond to a client request.
+void record_request_latency(std::chrono::steady_clock::duration duration);
+// Time a lookup waited for admission.
+void record_queue_wait(std::chrono::steady_clock::duration duration);
+// Lookup started on a backend other than the first one of a request.
+void count_fallback();
+// Lookup started because the previous backend was slow to answer.
+void count_hedge();
+// Backend skipped because its circuit breaker is open.
+void count_breaker_skip();
+// Backend skipped because its rate limit or quota was reached.
+void count_rate_limit_skip();
+// Reverse lookup answered from the index.
+void count_reverse_index_hit();
+// Reverse lookup sent to the backend services.
+void count_reverse_fallback();
+void add_active_connections(std::int64_t delta);
+
+// Number of heap allocations since the start of the process, if they are
+// counted, which is the case when building with GEOCODE_COUNT_ALLOCATIONS.
+std::optional<std::uint64_t> heap_allocations();
+
+// Gathers the metrics of the service. Sources register collectors adding
+// their samples on each scrape. Safe to share between threads.
+class Metrics {
+public:
+    using Collector = std::function<void(MetricSet&)>;
+
+    void add_collector(Collector collector);
+    // Thread metrics and samples of the collectors, in the Prometheus text
+    // format.
+    std::string scrape() const;
+
+private:
+    mutable std::mutex mutex;
+    std::vector<Collector> collectors;
+};
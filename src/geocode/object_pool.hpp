@@ -0,0 +1,88 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Keeps objects whose last reference was dropped for reuse, together with
+// the storage they hold, such as buffer capacity. T::recycle() is called
+// when an object comes back to the pool and must leave it ready for its
+// next user. A synchronized pool may be used from several threads.
+template <typename T>
+class ObjectPool: public std::enable_shared_from_this<ObjectPool<T>> {
+private:
+    struct Priv {};
+
+public:
+    explicit ObjectPool(std::size_t max_idle, bool synchronized, Priv):
+        max_idle(max_idle),
+        synchronized(synchronized),
+        created_count(0),
+        reused_count(0)
+    {}
+
+    static std::shared_ptr<ObjectPool> make(std::size_t max_idle,
+        bool synchronized)
+    {
+        return std::make_shared<ObjectPool>(max_idle, synchronized, Priv {});
+    }
+
+    // Returns an idle object, or the one returned by factory if there is
+    // none.
+    template <typename Factory>
+    std::shared_ptr<T> acquire(Factory factory) {
+        std::unique_ptr<T> object;
+        {
+            auto guard = lock();
+            if (!idle.empty()) {
+                object = std::move(idle.back());
+                idle.pop_back();
+            }
+        }
+        if (object) {
+            reused_count.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            object = factory();
+            created_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        auto this_ = this->shared_from_this();
+        return std::shared_ptr<T>(object.release(), [this_] (T* p) {
+            this_->release(std::unique_ptr<T>(p));
+        });
+    }
+
+    // Number of objects made by a factory, and of objects handed out again.
+    std::uint64_t created() const {
+        return created_count.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t reused() const {
+        return reused_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::unique_lock<std::mutex> lock() {
+        if (!synchronized) {return {};}
+        return std::unique_lock<std::mutex>(mutex);
+    }
+
+    void release(std::unique_ptr<T> object) {
+        object->recycle();
+        auto guard = lock();
+        if (idle.size() < max_idle) {idle.push_back(std::move(object));}
+    }
+
+private:
+    std::size_t max_idle;
+    bool synchronized;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<T>> idle;
+    std::atomic<std::uint64_t> created_count;
+    std::atomic<std::uint64_t> reused_count;
+};
@@ -2,10 +2,19 @@
 
 #pragma once
 
+#include "rate_limiter.hpp"
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/beast/http/field.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <charconv>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 
 using Request = boost::beast::http::request<boost::beast::http::string_body>;
@@ -19,10 +28,20 @@ struct Coordinates {
     double longitude;
 };
 
+// Address found at or near a point.
+struct Place {
+    std::string address;
+    Coordinates coords;
+    // Distance in meters from the point looked up.
+    double distance;
+};
+
 enum class ErrorKind {
     BackendFailure,
     BadRequest,
-    LocationNotFound
+    LocationNotFound,
+    // The service is at capacity and refused the request.
+    Overloaded
 };
 
 struct Error {
@@ -32,11 +51,203 @@ struct Error {
 
 using ProtocolResult = std::variant<Coordinates, Error>;
 
+// Thrown by Protocol::parse when the backend has no match for the location.
+class LocationNotFoundError: public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Thrown by Protocol::parse when the backend refuses requests for a while
+// because its rate limit or quota was exceeded.
+class ThrottledError: public std::runtime_error {
+public:
+    explicit ThrottledError(const std::string& what,
+        std::chrono::seconds retry_after
+    ):
+        std::runtime_error(what),
+        delay(retry_after)
+    {}
+
+    std::chrono::seconds retry_after() const {return delay;}
+
+private:
+    std::chrono::seconds delay;
+};
+
+// How long a backend is left alone after a quota error without Retry-After.
+const std::chrono::seconds QUOTA_RETRY_DELAY(3600);
+
+// Throws if the response is not successful. Status 429, and status 403 for
+// a rate or quota, throw ThrottledError with the delay given in
+// Retry-After, in seconds, or a default one.
+inline void check_response_status(const Response& resp) {
+    auto status = resp.result_int();
+    if (status >= 200 && status < 300) {return;}
+    auto quota = status == 403 && (boost::algorithm::icontains(resp.body(),
+        "quota") || boost::algorithm::icontains(resp.body(), "limit"));
+    if (status != 429 && !quota) {
+        throw std::runtime_error("Unexpected status "
+            + std::to_string(status));
+    }
+    auto delay = quota ? QUOTA_RETRY_DELAY : std::chrono::seconds(1);
+    auto it = resp.find(boost::beast::http::field::retry_after);
+    if (it != resp.end()) {
+        auto value = it->value();
+        unsigned int seconds = 0;
+        auto [end, err] = std::from_chars(value.data(),
+            value.data() + value.size(), seconds);
+        if (err == std::errc() && end == value.data() + value.size()) {
+            delay = std::chrono::seconds(seconds);
+        }
+    }
+    throw ThrottledError(quota ? "Quota exceeded" : "Too many requests",
+        delay);
+}
+
+// Appends a point to a request target as latitude,longitude.
+inline void append_point(std::string& target, const Coordinates& coords) {
+    char buf[32];
+    auto end = std::to_chars(buf, buf + sizeof(buf), coords.latitude).ptr;
+    target.append(buf, end);
+    target.push_back(',');
+    end = std::to_chars(buf, buf + sizeof(buf), coords.longitude).ptr;
+    target.append(buf, end);
+}
+
 inline std::string to_string(ErrorKind kind) {
     switch (kind) {
     case ErrorKind::BackendFailure: return "BackendFailure";
     case ErrorKind::BadRequest: return "BadRequest";
     case ErrorKind::LocationNotFound: return "LocationNotFound";
+    case ErrorKind::Overloaded: return "Overloaded";
     }
     throw std::logic_error("Unreachable");
 }
+
+// Settings of a backend from the configuration file, such as its keys.
+// The optional host and port settings override where a network service is
+// reached, e.g. to point it to a mock service. The optional rate, burst and
+// daily_quota settings limit the requests sent to it.
+using ProtocolSettings = std::map<std::string, std::string>;
+
+// Port of the network services unless overridden.
+const char DEFAULT_PROTOCOL_PORT[] = "https";
+
+// Describes a backend service. Each backend is a tag type with a
+// specialization providing:
+// - name: name of the backend in the configuration file.
+// - host: host name of the service.
+// - Settings: state computed once from the configuration, with at least
+//   target_prefix, the request target up to the URL-encoded location, keys
+//   included.
+// - load(const ProtocolSettings&): creates the Settings.
+// - parse(const Response&): coordinates found in a successful response.
+//   Throws LocationNotFoundError if the service has no match.
+// A backend able to look up several locations in one request also provides
+// max_batch, batch_request(const Settings&, locations, Request&) and
+// parse_batch(const Response&, count).
+// A backend with a reverse geocoding API also provides reverse_host, the
+// host name of that API, reverse_request(const Settings&, const
+// Coordinates&, target), appending the request target for a point, and
+// parse_reverse(const Response&), the place found, at distance zero.
+// A backend answered without a network service, like Local, only provides
+// name, host, Settings and load, and has its own async_find_lat_long.
+template <typename Backend>
+struct ProtocolTraits;
+
+// Configured backend. Instances are immutable and shared by all the lookups
+// using them.
+template <typename Backend>
+class Protocol {
+public:
+    using Traits = ProtocolTraits<Backend>;
+    using Settings = typename Traits::Settings;
+
+    explicit Protocol(const ProtocolSettings& settings):
+        config(Traits::load(settings)),
+        host_name(setting(settings, "host", Traits::host)),
+        port_name(setting(settings, "port", DEFAULT_PROTOCOL_PORT)),
+        authority_name(port_name == DEFAULT_PROTOCOL_PORT ? host_name
+            : host_name + ":" + port_name),
+        limits(load_rate_limit(settings)),
+        limiter(rate_limiter(Traits::name, authority_name))
+    {}
+
+    const std::string& host() const {return host_name;}
+    // Port number or service name.
+    const std::string& port() const {return port_name;}
+    // Host, with the port unless it is the default one. Identifies the
+    // service in connection pools and statistics.
+    const std::string& authority() const {return authority_name;}
+
+    Coordinates parse(const Response& resp) const {
+        check_response_status(resp);
+        return Traits::parse(resp);
+    }
+
+    // Takes a request from the rate limit of the service. Returns false if
+    // the service must be skipped.
+    bool acquire() const {return limiter->try_acquire(limits);}
+    // Time until the rate limit of the service lets a request through.
+    std::chrono::steady_clock::duration delay() const {
+        return limiter->delay(limits);
+    }
+    // Skips the service for the given duration.
+    void throttle(std::chrono::steady_clock::duration duration) const {
+        limiter->throttle(duration);
+    }
+
+    // Fills req with the request for a URL-encoded location. The target is
+    // built in the caller's buffer.
+    void request(std::string_view location, std::string& target,
+        Request& req) const
+    {
+        target.assign(config.target_prefix);
+        target.append(location);
+        req.method(boost::beast::http::verb::get);
+        req.target(target);
+        req.version(HTTP_VERSION);
+        req.set(boost::beast::http::field::host, authority_name);
+    }
+
+    const Settings& settings() const {return config;}
+
+private:
+    // Unlimited by default. The burst defaults to a second of requests.
+    static RateLimitConfiguration load_rate_limit(
+        const ProtocolSettings& settings)
+    {
+        RateLimitConfiguration limits {0, 0, 0};
+        try {
+            limits.rate = std::stod(setting(settings, "rate", "0"));
+            limits.burst = std::stod(setting(settings, "burst",
+                std::to_string(limits.rate)));
+            limits.daily_quota = std::stoull(setting(settings,
+                "daily_quota", "0"));
+        } catch (const std::logic_error&) {
+            throw std::invalid_argument("Invalid rate limit of "
+                + std::string(Traits::name));
+        }
+        if (limits.rate < 0 || limits.burst < 0) {
+            throw std::invalid_argument("Invalid rate limit of "
+                + std::string(Traits::name));
+        }
+        return limits;
+    }
+
+    static std::string setting(const ProtocolSettings& settings,
+        const std::string& name, std::string_view default_value)
+    {
+        auto it = settings.find(name);
+        return it != settings.end() ? it->second
+            : std::string(default_value);
+    }
+
+private:
+    Settings config;
+    std::string host_name;
+    std::string port_name;
+    std::string authority_name;
+    RateLimitConfiguration limits;
+    std::shared_ptr<RateLimiter> limiter;
+};
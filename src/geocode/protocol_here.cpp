@@ -1,35 +1,69 @@
 // Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
 
+#include "json_scanner.hpp"
 #include "protocol_here.hpp"
-#include <boost/beast.hpp>
 #include <boost/format.hpp>
 #include <nlohmann/json.hpp>
-#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
 
-using json = nlohmann::json;
-
-ProtocolHere::ProtocolHere(std::string app_id, std::string app_code):
-    app_id(std::move(app_id)),
-    app_code(std::move(app_code))
-{}
+ProtocolTraits<Here>::Settings ProtocolTraits<Here>::load(
+    const ProtocolSettings& settings)
+{
+    auto prefix = (boost::format("/6.2/geocode.json?app_id=%1%&app_code=%2%"
+        "&searchtext=") % settings.at("app_id") % settings.at("app_code"))
+        .str();
+    auto reverse = (boost::format("/6.2/reversegeocode.json?app_id=%1%"
+        "&app_code=%2%&mode=retrieveAddresses&maxresults=1&prox=")
+        % settings.at("app_id") % settings.at("app_code")).str();
+    return Settings {std::move(prefix), std::move(reverse)};
+}
 
-Request ProtocolHere::request(const std::string& location) const {
-    auto uri = (boost::format("/6.2/geocode.json?app_id=%1%&app_code=%2%"
-        "&searchtext=%3%") % app_id % app_code % location).str();
-    Request req(boost::beast::http::verb::get, uri, HTTP_VERSION);
-    req.set(boost::beast::http::field::host, host());
-    return req;
+Coordinates ProtocolTraits<Here>::parse(const Response& resp) {
+    // Reads /Response/View/0/Result/0/Location/DisplayPosition.
+    JsonScanner scanner(resp.body());
+    auto enter = [&] (std::string_view key) {
+        scanner.begin_object();
+        if (!scanner.find_key(key)) {
+            throw std::runtime_error("Missing " + std::string(key));
+        }
+    };
+    enter("Response");
+    enter("View");
+    scanner.begin_array();
+    if (!scanner.next_element()) {
+        scanner.finish();
+        throw LocationNotFoundError("No match");
+    }
+    enter("Result");
+    scanner.begin_array();
+    if (!scanner.next_element()) {throw std::runtime_error("Missing Result");}
+    enter("Location");
+    enter("DisplayPosition");
+    scanner.begin_object();
+    auto [latitude, longitude] = scanner.read_numbers("Latitude",
+        "Longitude");
+    scanner.finish();
+    return Coordinates {latitude, longitude};
 }
 
-std::string ProtocolHere::host() const {
-    return "geocoder.api.here.com";
+void ProtocolTraits<Here>::reverse_request(const Settings& settings,
+    const Coordinates& coords, std::string& target)
+{
+    target.assign(settings.reverse_prefix);
+    append_point(target, coords);
 }
 
-Coordinates ProtocolHere::parse(const Response& resp) const {
-    auto j = json::parse(resp.body());
-    const auto& coords = j.at("/Response/View/0/Result/0/Location/"
-        "DisplayPosition"_json_pointer);
-    auto latitude = coords.at("Latitude").get<double>();
-    auto longitude = coords.at("Longitude").get<double>();
-    return Coordinates {latitude, longitude};
+// Reverse lookups are not on the hot path, so the response is parsed whole
+// to read members in any order.
+Place ProtocolTraits<Here>::parse_reverse(const Response& resp) {
+    auto view = nlohmann::json::parse(resp.body()).at("Response").at("View");
+    if (view.empty()) {throw LocationNotFoundError("No match");}
+    const auto& location = view.at(0).at("Result").at(0).at("Location");
+    const auto& position = location.at("DisplayPosition");
+    return Place {location.at("Address").at("Label").get<std::string>(),
+        Coordinates {position.at("Latitude").get<double>(),
+        position.at("Longitude").get<double>()}, 0};
 }
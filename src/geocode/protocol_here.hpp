@@ -4,15 +4,28 @@
 
 #include "protocol.hpp"
 #include <string>
+#include <string_view>
 
-class ProtocolHere {
-public:
-    explicit ProtocolHere(std::string app_id, std::string app_code);
-    std::string host() const;
-    Coordinates parse(const Response& resp) const;
-    Request request(const std::string& location) const;
+struct Here {};
 
-private:
-    std::string app_id;
-    std::string app_code;
+template <>
+struct ProtocolTraits<Here> {
+    static constexpr std::string_view name = "Here";
+    static constexpr std::string_view host = "geocoder.api.here.com";
+    static constexpr std::string_view reverse_host =
+        "reverse.geocoder.api.here.com";
+
+    struct Settings {
+        std::string target_prefix;
+        std::string reverse_prefix;
+    };
+
+    static Settings load(const ProtocolSettings& settings);
+    static Coordinates parse(const Response& resp);
+
+    static void reverse_request(const Settings& settings,
+        const Coordinates& coords, std::string& target);
+    static Place parse_reverse(const Response& resp);
 };
+
+using ProtocolHere = Protocol<Here>;
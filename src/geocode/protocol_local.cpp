@@ -0,0 +1,19 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "protocol_local.hpp"
+#include <stdexcept>
+
+ProtocolTraits<Local>::Settings ProtocolTraits<Local>::load(
+    const ProtocolSettings& settings)
+{
+    auto match = GazetteerMatch::Exact;
+    if (auto it = settings.find("match"); it != settings.end()) {
+        if (it->second == "prefix") {
+            match = GazetteerMatch::Prefix;
+        } else if (it->second != "exact") {
+            throw std::invalid_argument("Invalid gazetteer match");
+        }
+    }
+    return Settings {std::make_shared<const Gazetteer>(settings.at("path")),
+        match};
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "gazetteer.hpp"
+#include "protocol.hpp"
+#include <memory>
+#include <string_view>
+
+struct Local {};
+
+// Gazetteer on the local machine. There is no service to send requests to;
+// lookups are answered from the index without I/O.
+template <>
+struct ProtocolTraits<Local> {
+    static constexpr std::string_view name = "Local";
+    // Names the backend in statistics.
+    static constexpr std::string_view host = "local";
+
+    struct Settings {
+        std::shared_ptr<const Gazetteer> gazetteer;
+        GazetteerMatch match;
+    };
+
+    static Settings load(const ProtocolSettings& settings);
+};
+
+using ProtocolLocal = Protocol<Local>;
@@ -1,33 +1,133 @@
 // Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
 
+#include "json_scanner.hpp"
 #include "protocol_mapquest.hpp"
-#include <boost/beast.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/verb.hpp>
 #include <boost/format.hpp>
 #include <nlohmann/json.hpp>
-#include <sstream>
+#include <optional>
+#include <stdexcept>
+#include <utility>
 
 using json = nlohmann::json;
 
-ProtocolMapQuest::ProtocolMapQuest(std::string key):
-    key(std::move(key))
-{}
+namespace {
+    // Reads the result at the cursor and leaves the scanner after it.
+    // Returns nothing if the location was not found.
+    std::optional<Coordinates> scan_result(JsonScanner& scanner) {
+        scanner.begin_object();
+        if (!scanner.find_key("locations")) {
+            throw std::runtime_error("Missing locations");
+        }
+        std::optional<Coordinates> coords;
+        scanner.begin_array();
+        if (scanner.next_element()) {
+            scanner.begin_object();
+            if (!scanner.find_key("latLng")) {
+                throw std::runtime_error("Missing latLng");
+            }
+            scanner.begin_object();
+            auto [latitude, longitude] = scanner.read_numbers("lat", "lng");
+            coords = Coordinates {latitude, longitude};
+            scanner.end_object();
+            scanner.end_array();
+        }
+        scanner.end_object();
+        return coords;
+    }
 
-Request ProtocolMapQuest::request(const std::string& location) const {
-    auto uri = (boost::format("/geocoding/v1/address?key=%1%"
-        "&location=%2%") % key % location).str();
-    Request req(boost::beast::http::verb::get, uri, HTTP_VERSION);
-    req.set(boost::beast::http::field::host, host());
-    return req;
+    void enter_results(JsonScanner& scanner) {
+        scanner.begin_object();
+        if (!scanner.find_key("results")) {
+            throw std::runtime_error("Missing results");
+        }
+        scanner.begin_array();
+    }
 }
 
-std::string ProtocolMapQuest::host() const {
-    return "www.mapquestapi.com";
+ProtocolTraits<MapQuest>::Settings ProtocolTraits<MapQuest>::load(
+    const ProtocolSettings& settings)
+{
+    const auto& key = settings.at("key");
+    auto prefix = (boost::format("/geocoding/v1/address?key=%1%"
+        "&location=") % key).str();
+    auto batch = (boost::format("/geocoding/v1/batch?key=%1%") % key).str();
+    auto reverse = (boost::format("/geocoding/v1/reverse?key=%1%"
+        "&location=") % key).str();
+    return Settings {std::move(prefix), std::move(batch), std::move(reverse)};
 }
 
-Coordinates ProtocolMapQuest::parse(const Response& resp) const {
-    auto j = json::parse(resp.body());
-    const auto& coords = j.at("/results/0/locations/0/latLng"_json_pointer);
-    auto latitude = coords.at("lat").get<double>();
-    auto longitude = coords.at("lng").get<double>();
-    return Coordinates {latitude, longitude};
+Coordinates ProtocolTraits<MapQuest>::parse(const Response& resp) {
+    JsonScanner scanner(resp.body());
+    enter_results(scanner);
+    if (!scanner.next_element()) {throw std::runtime_error("No result");}
+    auto coords = scan_result(scanner);
+    scanner.finish();
+    if (!coords) {throw LocationNotFoundError("No match");}
+    return *coords;
+}
+
+void ProtocolTraits<MapQuest>::batch_request(const Settings& settings,
+    const std::vector<std::string>& locations, Request& req)
+{
+    json body = {
+        {"locations", locations},
+        {"options", {{"maxResults", 1}, {"thumbMaps", false}}}
+    };
+    req.method(boost::beast::http::verb::post);
+    req.target(settings.batch_target);
+    req.version(HTTP_VERSION);
+    req.set(boost::beast::http::field::content_type, "application/json");
+    req.body() = body.dump();
+    req.prepare_payload();
+}
+
+std::vector<ProtocolResult> ProtocolTraits<MapQuest>::parse_batch(
+    const Response& resp, std::size_t count)
+{
+    JsonScanner scanner(resp.body());
+    enter_results(scanner);
+    std::vector<ProtocolResult> parsed;
+    parsed.reserve(count);
+    while (scanner.next_element()) {
+        ProtocolResult result = Error {ErrorKind::LocationNotFound,
+            "No match"};
+        if (auto coords = scan_result(scanner)) {result = *coords;}
+        parsed.push_back(std::move(result));
+    }
+    scanner.finish();
+    if (parsed.size() != count) {
+        throw std::runtime_error("Unexpected number of batch results");
+    }
+    return parsed;
+}
+
+void ProtocolTraits<MapQuest>::reverse_request(const Settings& settings,
+    const Coordinates& coords, std::string& target)
+{
+    target.assign(settings.reverse_prefix);
+    append_point(target, coords);
+}
+
+// The address is made of the street, city, state, postal code and country
+// found, those missing being left out.
+Place ProtocolTraits<MapQuest>::parse_reverse(const Response& resp) {
+    auto body = json::parse(resp.body());
+    const auto& locations = body.at("results").at(0).at("locations");
+    if (locations.empty()) {throw LocationNotFoundError("No match");}
+    const auto& location = locations.at(0);
+    std::string address;
+    for (auto part: {"street", "adminArea5", "adminArea3", "postalCode",
+        "adminArea1"})
+    {
+        auto value = location.value(part, "");
+        if (value.empty()) {continue;}
+        if (!address.empty()) {address.append(", ");}
+        address.append(value);
+    }
+    if (address.empty()) {throw LocationNotFoundError("No address");}
+    const auto& at = location.at("latLng");
+    return Place {std::move(address), Coordinates {at.at("lat").get<double>(),
+        at.at("lng").get<double>()}, 0};
 }
@@ -3,15 +3,42 @@
 #pragma once
 
 #include "protocol.hpp"
+#include <cstddef>
 #include <string>
+#include <string_view>
+#include <vector>
 
-class ProtocolMapQuest {
-public:
-    explicit ProtocolMapQuest(std::string key);
-    std::string host() const;
-    Coordinates parse(const Response& resp) const;
-    Request request(const std::string& location) const;
+struct MapQuest {};
 
-private:
-    std::string key;
+template <>
+struct ProtocolTraits<MapQuest> {
+    static constexpr std::string_view name = "MapQuest";
+    static constexpr std::string_view host = "www.mapquestapi.com";
+    static constexpr std::string_view reverse_host = host;
+    // Maximum number of locations in a batch request.
+    static constexpr std::size_t max_batch = 100;
+
+    struct Settings {
+        std::string target_prefix;
+        std::string batch_target;
+        std::string reverse_prefix;
+    };
+
+    static Settings load(const ProtocolSettings& settings);
+    static Coordinates parse(const Response& resp);
+
+    // Fills req with a request for several locations at once, but for its
+    // Host header. Unlike single requests, the locations are not
+    // URL-encoded.
+    static void batch_request(const Settings& settings,
+        const std::vector<std::string>& locations, Request& req);
+    // Returns one result per location of the batch request, in order.
+    static std::vector<ProtocolResult> parse_batch(const Response& resp,
+        std::size_t count);
+
+    static void reverse_request(const Settings& settings,
+        const Coordinates& coords, std::string& target);
+    static Place parse_reverse(const Response& resp);
 };
+
+using ProtocolMapQuest = Protocol<MapQuest>;
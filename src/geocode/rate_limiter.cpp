@@ -0,0 +1,127 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "rate_limiter.hpp"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace {
+    const unsigned int DAILY_COUNT_BITS = 40;
+    const std::uint64_t DAILY_COUNT_MASK =
+        (std::uint64_t(1) << DAILY_COUNT_BITS) - 1;
+
+    std::uint64_t current_day() {
+        auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<
+            std::chrono::hours>(since_epoch).count() / 24);
+    }
+
+    // Nanoseconds a request adds to the time the bucket is full.
+    std::int64_t token_interval(const RateLimitConfiguration& config) {
+        return static_cast<std::int64_t>(1e9 / config.rate);
+    }
+
+    // Nanoseconds ahead the time the bucket is full may be.
+    std::int64_t bucket_capacity(const RateLimitConfiguration& config) {
+        return static_cast<std::int64_t>(std::max(config.burst, 1.0) * 1e9
+            / config.rate);
+    }
+}
+
+RateLimiter::RateLimiter():
+    full_at(0),
+    throttled_until(0),
+    daily(0)
+{}
+
+bool RateLimiter::try_acquire(const RateLimitConfiguration& config) {
+    auto t = now();
+    if (t < throttled_until.load(std::memory_order_relaxed)) {return false;}
+    std::int64_t interval = 0;
+    if (config.rate > 0) {
+        // Each request adds its interval to the time the bucket is full.
+        // The bucket is empty when that time is a burst ahead.
+        interval = token_interval(config);
+        auto capacity = bucket_capacity(config);
+        auto full = full_at.load(std::memory_order_relaxed);
+        std::int64_t next = 0;
+        do {
+            next = std::max(full, t) + interval;
+            if (next - t > capacity) {return false;}
+        } while (!full_at.compare_exchange_weak(full, next,
+            std::memory_order_relaxed));
+    }
+    if (config.daily_quota > 0) {
+        auto day = current_day();
+        auto state = daily.load(std::memory_order_relaxed);
+        std::uint64_t next = 0;
+        do {
+            auto count = state >> DAILY_COUNT_BITS == day
+                ? state & DAILY_COUNT_MASK : 0;
+            if (count >= config.daily_quota) {
+                // The request is not sent, so it gives its token back.
+                // Taking the interval off leaves the bucket at most as
+                // full as if it had been full when the token was taken.
+                full_at.fetch_sub(interval, std::memory_order_relaxed);
+                return false;
+            }
+            next = day << DAILY_COUNT_BITS | (count + 1);
+        } while (!daily.compare_exchange_weak(state, next,
+            std::memory_order_relaxed));
+    }
+    return true;
+}
+
+RateLimiter::Clock::duration RateLimiter::delay(
+    const RateLimitConfiguration& config) const
+{
+    auto t = now();
+    auto wait = throttled_until.load(std::memory_order_relaxed) - t;
+    if (config.rate > 0) {
+        wait = std::max(wait, full_at.load(std::memory_order_relaxed)
+            + token_interval(config) - bucket_capacity(config) - t);
+    }
+    if (config.daily_quota > 0) {
+        auto day = current_day();
+        auto state = daily.load(std::memory_order_relaxed);
+        if (state >> DAILY_COUNT_BITS == day
+            && (state & DAILY_COUNT_MASK) >= config.daily_quota)
+        {
+            // Until midnight UTC.
+            auto tomorrow = std::chrono::hours(24) * (day + 1);
+            auto since_epoch = std::chrono::system_clock::now()
+                .time_since_epoch();
+            wait = std::max<std::int64_t>(wait, std::chrono::duration_cast<
+                std::chrono::nanoseconds>(tomorrow - since_epoch).count());
+        }
+    }
+    return std::chrono::nanoseconds(std::max<std::int64_t>(wait, 0));
+}
+
+void RateLimiter::throttle(Clock::duration duration) {
+    auto until = now() + std::chrono::duration_cast<
+        std::chrono::nanoseconds>(duration).count();
+    auto current = throttled_until.load(std::memory_order_relaxed);
+    while (current < until && !throttled_until.compare_exchange_weak(current,
+        until, std::memory_order_relaxed))
+    {}
+}
+
+std::int64_t RateLimiter::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+// Only looked up when a configuration is loaded.
+std::shared_ptr<RateLimiter> rate_limiter(std::string_view backend,
+    const std::string& authority)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<std::string, std::string>,
+        std::shared_ptr<RateLimiter>> limiters;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& limiter = limiters[{std::string(backend), authority}];
+    if (!limiter) {limiter = std::make_shared<RateLimiter>();}
+    return limiter;
+}
@@ -0,0 +1,60 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct RateLimitConfiguration {
+    // Requests per second. Zero disables the rate limit.
+    double rate;
+    // Requests that may be sent at once after a quiet period.
+    double burst;
+    // Requests per day, from midnight UTC. Zero disables the quota.
+    std::uint64_t daily_quota;
+};
+
+// Token bucket and daily quota of a backend service, also refusing requests
+// for as long as the service asks. The limits are passed on each request,
+// so that a reloaded configuration applies to the current state.
+// Lock-free: each limit is a single atomic word updated by
+// compare-and-swap, so that the threads share it without contention.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    RateLimiter();
+
+    // Takes a request from the limits. Returns false, taking nothing, if the
+    // bucket is empty, the daily quota is spent or the service asked to
+    // wait.
+    bool try_acquire(const RateLimitConfiguration& config);
+    // Time until try_acquire may take a request, zero if it may now.
+    Clock::duration delay(const RateLimitConfiguration& config) const;
+    // Refuses requests for the given duration, e.g. after the service
+    // answered that its rate or quota was exceeded.
+    void throttle(Clock::duration duration);
+
+private:
+    static std::int64_t now();
+
+private:
+    // Time at which the bucket would be full if it were not drawn from
+    // again, which fits a token bucket in one word (the generic cell rate
+    // algorithm). In nanoseconds of the steady clock.
+    std::atomic<std::int64_t> full_at;
+    std::atomic<std::int64_t> throttled_until;
+    // Day since the epoch in the upper bits and requests sent that day in
+    // the lower ones.
+    std::atomic<std::uint64_t> daily;
+};
+
+// Rate limiter of a backend service, identified by the backend name and the
+// authority it is reached at. Limiters live as long as the process, so that
+// their state survives configuration reloads.
+std::shared_ptr<RateLimiter> rate_limiter(std::string_view backend,
+    const std::string& authority);
@@ -0,0 +1,93 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "result_cache.hpp"
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+namespace {
+    // Rough per-entry overhead of the list node and index bucket.
+    const std::size_t ENTRY_OVERHEAD = 64;
+}
+
+ResultCacheConfiguration default_result_cache_config() {
+    return ResultCacheConfiguration {100000, 64 * 1024 * 1024,
+        std::chrono::hours(24), std::chrono::minutes(5), 16};
+}
+
+ResultCache::ResultCache(ResultCacheConfiguration config):
+    config(config),
+    max_entries_per_shard(std::max<std::size_t>(config.max_entries
+        / std::max<std::size_t>(config.shards, 1), 1)),
+    max_bytes_per_shard(config.max_bytes
+        / std::max<std::size_t>(config.shards, 1)),
+    hits(0),
+    misses(0),
+    evictions(0),
+    expirations(0)
+{
+    for (std::size_t i = 0; i < std::max<std::size_t>(config.shards, 1); ++i) {
+        shards.push_back(std::make_unique<Shard>());
+    }
+}
+
+std::optional<ProtocolResult> ResultCache::find(const std::string& key) {
+    auto& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        ++misses;
+        return std::nullopt;
+    }
+    auto entry = it->second;
+    if (entry->expires_at <= std::chrono::steady_clock::now()) {
+        erase(shard, entry);
+        ++expirations;
+        ++misses;
+        return std::nullopt;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+    ++hits;
+    return entry->result;
+}
+
+void ResultCache::insert(const std::string& key, const ProtocolResult& result) {
+    auto ttl = config.ttl;
+    if (auto e = std::get_if<Error>(&result)) {
+        if (e->kind != ErrorKind::LocationNotFound) {return;}
+        ttl = config.not_found_ttl;
+    }
+    auto size = sizeof(Entry) + ENTRY_OVERHEAD + key.size();
+    if (auto e = std::get_if<Error>(&result)) {size += e->cause.size();}
+    auto& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (auto it = shard.index.find(key); it != shard.index.end()) {
+        erase(shard, it->second);
+    }
+    shard.entries.push_front(Entry {key, result,
+        std::chrono::steady_clock::now() + ttl, size});
+    auto entry = shard.entries.begin();
+    shard.index.emplace(entry->key, entry);
+    shard.bytes += size;
+    while (shard.entries.size() > max_entries_per_shard
+        || (shard.bytes > max_bytes_per_shard && shard.entries.size() > 1))
+    {
+        erase(shard, std::prev(shard.entries.end()));
+        ++evictions;
+    }
+}
+
+ResultCacheStatistics ResultCache::statistics() const {
+    return ResultCacheStatistics {hits.load(), misses.load(), evictions.load(),
+        expirations.load()};
+}
+
+void ResultCache::erase(Shard& shard, std::list<Entry>::iterator it) {
+    shard.bytes -= it->size;
+    shard.index.erase(it->key);
+    shard.entries.erase(it);
+}
+
+ResultCache::Shard& ResultCache::shard_for(const std::string& key) {
+    return *shards[std::hash<std::string>()(key) % shards.size()];
+}
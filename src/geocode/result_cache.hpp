@@ -0,0 +1,83 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "protocol.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct ResultCacheConfiguration {
+    // Maximum number of cached locations. Zero disables the cache.
+    std::size_t max_entries;
+    // Approximate maximum memory used by cached locations.
+    std::size_t max_bytes;
+    // How long found coordinates are kept.
+    std::chrono::steady_clock::duration ttl;
+    // How long locations the backends could not find are kept.
+    std::chrono::steady_clock::duration not_found_ttl;
+    // Number of independently locked shards.
+    std::size_t shards;
+};
+
+ResultCacheConfiguration default_result_cache_config();
+
+struct ResultCacheStatistics {
+    unsigned long long hits;
+    unsigned long long misses;
+    // Entries removed to stay within the size limits.
+    unsigned long long evictions;
+    // Entries removed because they expired.
+    unsigned long long expirations;
+};
+
+// Least recently used cache of lookup results keyed by normalized location.
+// Only coordinates and LocationNotFound errors are cached. Safe to share
+// between threads; locations are spread over shards with their own locks.
+class ResultCache {
+public:
+    explicit ResultCache(ResultCacheConfiguration config);
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    std::optional<ProtocolResult> find(const std::string& key);
+    void insert(const std::string& key, const ProtocolResult& result);
+    ResultCacheStatistics statistics() const;
+
+private:
+    struct Entry {
+        std::string key;
+        ProtocolResult result;
+        std::chrono::steady_clock::time_point expires_at;
+        std::size_t size;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Ordered from most to least recently used.
+        std::list<Entry> entries;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+        std::size_t bytes = 0;
+    };
+
+    void erase(Shard& shard, std::list<Entry>::iterator it);
+    Shard& shard_for(const std::string& key);
+
+private:
+    ResultCacheConfiguration config;
+    std::size_t max_entries_per_shard;
+    std::size_t max_bytes_per_shard;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<unsigned long long> hits;
+    std::atomic<unsigned long long> misses;
+    std::atomic<unsigned long long> evictions;
+    std::atomic<unsigned long long> expirations;
+};
@@ -0,0 +1,190 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "result_json.hpp"
+#include <charconv>
+#include <cmath>
+#include <string_view>
+#include <variant>
+
+namespace {
+    std::string_view kind_name(ErrorKind kind) {
+        switch (kind) {
+        case ErrorKind::BackendFailure: return "BackendFailure";
+        case ErrorKind::BadRequest: return "BadRequest";
+        case ErrorKind::LocationNotFound: return "LocationNotFound";
+        case ErrorKind::Overloaded: return "Overloaded";
+        }
+        return "";
+    }
+
+    // Writes the shortest representation that reads back as the same
+    // double, keeping a fractional part so that it reads as a float.
+    void append_number(std::string& out, double value) {
+        if (!std::isfinite(value)) {
+            out += "null";
+            return;
+        }
+        char buf[32];
+        auto end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        std::string_view digits(buf, static_cast<std::size_t>(end - buf));
+        out += digits;
+        if (digits.find_first_of(".e") == digits.npos) {out += ".0";}
+    }
+
+    void append_string(std::string& out, std::string_view s) {
+        const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (char c: s) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (auto u = static_cast<unsigned char>(c); u < 0x20) {
+                    out += "\\u00";
+                    out += hex[u >> 4];
+                    out += hex[u & 0xF];
+                } else {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    class Writer {
+    public:
+        explicit Writer(std::string& out, JsonFormat format):
+            out(out),
+            pretty(format == JsonFormat::Pretty),
+            depth(0)
+        {}
+
+        void close(char c) {
+            --depth;
+            newline();
+            out += c;
+        }
+
+        void key(std::string_view k) {
+            append_string(out, k);
+            out += pretty ? ": " : ":";
+        }
+
+        void open(char c) {
+            out += c;
+            ++depth;
+            newline();
+        }
+
+        void separator() {
+            out += ',';
+            newline();
+        }
+
+        void member(const Coordinates& coords) {
+            key("Ok");
+            open('{');
+            key("latitude");
+            append_number(out, coords.latitude);
+            separator();
+            key("longitude");
+            append_number(out, coords.longitude);
+            close('}');
+        }
+
+        void member(const Place& place) {
+            key("Ok");
+            open('{');
+            key("address");
+            append_string(out, place.address);
+            separator();
+            key("distance");
+            append_number(out, place.distance);
+            separator();
+            key("latitude");
+            append_number(out, place.coords.latitude);
+            separator();
+            key("longitude");
+            append_number(out, place.coords.longitude);
+            close('}');
+        }
+
+        void member(const Error& error) {
+            key("Err");
+            open('{');
+            key("cause");
+            open('[');
+            append_string(out, error.cause);
+            close(']');
+            separator();
+            key("kind");
+            append_string(out, kind_name(error.kind));
+            close('}');
+        }
+
+    private:
+        void newline() {
+            if (!pretty) {return;}
+            out += '\n';
+            out.append(2 * depth, ' ');
+        }
+
+    private:
+        std::string& out;
+        bool pretty;
+        std::size_t depth;
+    };
+
+    template <typename T>
+    void append_json(std::string& out, const T& value, JsonFormat format) {
+        Writer writer(out, format);
+        writer.open('{');
+        writer.member(value);
+        writer.close('}');
+    }
+}
+
+void append_result_json(std::string& out, const Coordinates& coords,
+    JsonFormat format)
+{
+    append_json(out, coords, format);
+}
+
+void append_result_json(std::string& out, const Error& error,
+    JsonFormat format)
+{
+    append_json(out, error, format);
+}
+
+void append_result_json(std::string& out, const Place& place,
+    JsonFormat format)
+{
+    append_json(out, place, format);
+}
+
+void append_result_json(std::string& out, const ProtocolResult& result,
+    JsonFormat format)
+{
+    std::visit([&] (const auto& value) {append_json(out, value, format);},
+        result);
+}
+
+void append_batch_line(std::string& out, std::size_t index,
+    const ProtocolResult& result)
+{
+    Writer writer(out, JsonFormat::Compact);
+    writer.open('{');
+    std::visit([&] (const auto& value) {writer.member(value);}, result);
+    writer.separator();
+    writer.key("index");
+    char buf[24];
+    auto end = std::to_chars(buf, buf + sizeof(buf), index).ptr;
+    out.append(buf, end);
+    writer.close('}');
+    out += '\n';
+}
@@ -0,0 +1,30 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "protocol.hpp"
+#include <cstddef>
+#include <string>
+
+enum class JsonFormat {
+    // Everything on one line.
+    Compact,
+    // Indented with two spaces.
+    Pretty
+};
+
+// Appends the JSON representation of a result, {"Ok": {...}} or
+// {"Err": {...}}, to out. Appending reuses the capacity of out, so nothing
+// is allocated once out is large enough.
+void append_result_json(std::string& out, const Coordinates& coords,
+    JsonFormat format);
+void append_result_json(std::string& out, const Error& error,
+    JsonFormat format);
+void append_result_json(std::string& out, const Place& place,
+    JsonFormat format);
+void append_result_json(std::string& out, const ProtocolResult& result,
+    JsonFormat format);
+// Appends a line of a batch response: the compact representation of a
+// result with the index of its location, then a newline.
+void append_batch_line(std::string& out, std::size_t index,
+    const ProtocolResult& result);
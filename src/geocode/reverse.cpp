@@ -0,0 +1,270 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "client.hpp"
+#include "gazetteer.hpp"
+#include "metrics.hpp"
+#include "reverse.hpp"
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+ReverseConfiguration default_reverse_config() {
+    return ReverseConfiguration {100, {}, true};
+}
+
+namespace {
+    template <typename Traits, typename = void>
+    struct SupportsReverse: std::false_type {};
+
+    template <typename Traits>
+    struct SupportsReverse<Traits,
+        std::void_t<decltype(&Traits::parse_reverse)>>: std::true_type
+    {};
+
+    // Protocol looking up the address at a point with the reverse geocoding
+    // API of a backend. The API has its own host, unless the host of the
+    // backend is overridden, and shares the rate limit of the backend.
+    template <typename Backend>
+    class ReverseProtocol {
+    public:
+        using Traits = ProtocolTraits<Backend>;
+
+        explicit ReverseProtocol(
+            std::shared_ptr<const Protocol<Backend>> protocol,
+            const Coordinates& coords
+        ):
+            protocol(std::move(protocol)),
+            coords(coords),
+            host_name(this->protocol->host() == Traits::host
+                ? std::string(Traits::reverse_host) : this->protocol->host()),
+            authority_name(this->protocol->port() == DEFAULT_PROTOCOL_PORT
+                ? host_name : host_name + ":" + this->protocol->port())
+        {}
+
+        const std::string& host() const {return host_name;}
+        const std::string& port() const {return protocol->port();}
+        const std::string& authority() const {return authority_name;}
+
+        Place parse(const Response& resp) const {
+            check_response_status(resp);
+            return Traits::parse_reverse(resp);
+        }
+
+        void throttle(std::chrono::steady_clock::duration duration) const {
+            protocol->throttle(duration);
+        }
+
+        // The location passed by the client is ignored.
+        void request(std::string_view, std::string& target, Request& req)
+            const
+        {
+            Traits::reverse_request(protocol->settings(), coords, target);
+            req.method(boost::beast::http::verb::get);
+            req.target(target);
+            req.version(HTTP_VERSION);
+            req.set(boost::beast::http::field::host, authority_name);
+        }
+
+    private:
+        std::shared_ptr<const Protocol<Backend>> protocol;
+        Coordinates coords;
+        std::string host_name;
+        std::string authority_name;
+    };
+
+    class PlaceFinder: public std::enable_shared_from_this<PlaceFinder> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit PlaceFinder(std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& config, Coordinates coords,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor, PlaceHandler handler, Priv
+        ):
+            context(std::move(context)),
+            protocols(std::move(protocols)),
+            config(config),
+            coords(coords),
+            deadline(deadline),
+            executor(executor),
+            handler(std::move(handler)),
+            deadline_timer(executor),
+            started(0),
+            done(false),
+            not_found(false)
+        {}
+
+        static std::shared_ptr<PlaceFinder> make(
+            std::shared_ptr<ClientContext> context,
+            std::vector<AnyProtocol> protocols,
+            const FinderConfiguration& config, Coordinates coords,
+            std::chrono::steady_clock::time_point deadline,
+            boost::asio::any_io_executor executor, PlaceHandler handler)
+        {
+            return std::make_shared<PlaceFinder>(std::move(context),
+                std::move(protocols), config, coords, deadline,
+                std::move(executor), std::move(handler), Priv {});
+        }
+
+        void run() {
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                auto this_ = shared_from_this();
+                deadline_timer.expires_at(deadline);
+                deadline_timer.async_wait([this_] (
+                    boost::system::error_code ec)
+                {
+                    if (ec || this_->done) {return;}
+                    this_->finish(Error {ErrorKind::BackendFailure,
+                        "Deadline exceeded"});
+                });
+            }
+            if (!request_place() && !done) {
+                deadline_timer.cancel();
+                fail_early("No backend service available");
+            }
+        }
+
+    private:
+        // Fails before any lookup started. Posted since the handler must
+        // not run before async_find_place returns.
+        void fail_early(const char* cause) {
+            done = true;
+            boost::asio::post(executor, [handler = std::move(handler),
+                cause]
+            {
+                handler(Error {ErrorKind::BackendFailure, cause});
+            });
+        }
+
+        void finish(PlaceResult result) {
+            done = true;
+            deadline_timer.cancel();
+            if (auto current = lookup.lock()) {current->cancel();}
+            handler(std::move(result));
+        }
+
+        void on_place(PlaceResult result) {
+            if (done) {return;}
+            auto e = std::get_if<Error>(&result);
+            auto outcome = !e ? LookupOutcome::Found
+                : e->kind == ErrorKind::LocationNotFound
+                ? LookupOutcome::NotFound : LookupOutcome::Failed;
+            context->stats->record(authority, outcome,
+                std::chrono::steady_clock::now() - start, config.breaker);
+            if (!e) {
+                auto& place = std::get<Place>(result);
+                place.distance = distance_between(coords, place.coords);
+                finish(std::move(result));
+                return;
+            }
+            not_found = not_found || e->kind == ErrorKind::LocationNotFound;
+            if (request_place()) {
+                count_fallback();
+                return;
+            }
+            if (done) {return;}
+            auto kind = not_found ? ErrorKind::LocationNotFound
+                : ErrorKind::BackendFailure;
+            finish(Error {kind, ""});
+        }
+
+        // Queries the next protocol with a reverse geocoding API that is not
+        // skipped. Returns false if there is none left.
+        bool request_place() {
+            while (started < protocols.size()) {
+                auto index = started++;
+                if (std::visit([this] (const auto& proto) {
+                    return start_lookup(proto);
+                }, protocols[index]))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        template <typename Backend>
+        bool start_lookup(const std::shared_ptr<const Protocol<Backend>>& proto)
+        {
+            if constexpr (SupportsReverse<ProtocolTraits<Backend>>::value) {
+                // Skipping a service does not allocate its reverse protocol.
+                if (!proto->acquire()) {
+                    count_rate_limit_skip();
+                    return false;
+                }
+                auto reverse = std::make_shared<const ReverseProtocol<Backend>>(
+                    proto, coords);
+                if (!context->stats->allow(reverse->authority(),
+                    config.breaker))
+                {
+                    count_breaker_skip();
+                    return false;
+                }
+                authority = reverse->authority();
+                start = std::chrono::steady_clock::now();
+                auto this_ = shared_from_this();
+                lookup = async_find_lat_long(context, std::move(reverse),
+                    std::string(), boost::asio::bind_executor(executor,
+                    [this_] (PlaceResult result) {
+                        this_->on_place(std::move(result));
+                    }));
+                return true;
+            } else {
+                static_cast<void>(proto);
+                return false;
+            }
+        }
+
+    private:
+        std::shared_ptr<ClientContext> context;
+        std::vector<AnyProtocol> protocols;
+        FinderConfiguration config;
+        Coordinates coords;
+        std::chrono::steady_clock::time_point deadline;
+        boost::asio::any_io_executor executor;
+        PlaceHandler handler;
+        boost::asio::steady_timer deadline_timer;
+        // Lookup running, its service and when it started.
+        std::weak_ptr<Lookup> lookup;
+        std::string authority;
+        std::chrono::steady_clock::time_point start;
+        // Number of protocols considered so far.
+        std::size_t started;
+        bool done;
+        // Whether a backend reported the point as unknown.
+        bool not_found;
+    };
+}
+
+std::shared_ptr<const ReverseIndex> make_reverse_index(
+    const ReverseConfiguration& config, const DiskCache* disk_cache)
+{
+    std::vector<GazetteerEntry> entries;
+    if (!config.gazetteer.empty()) {
+        entries = Gazetteer(config.gazetteer).all_entries();
+    }
+    if (config.disk_cache && disk_cache) {
+        disk_cache->for_each([&entries] (std::string_view key,
+            const Coordinates& coords)
+        {
+            entries.push_back(GazetteerEntry {std::string(key), coords});
+        });
+    }
+    return std::make_shared<const ReverseIndex>(entries);
+}
+
+void async_find_place(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols, const FinderConfiguration& config,
+    Coordinates coords, std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, PlaceHandler handler)
+{
+    auto finder = PlaceFinder::make(std::move(context), std::move(protocols),
+        config, coords, deadline, std::move(executor), std::move(handler));
+    finder->run();
+}
@@ -0,0 +1,48 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "client_context.hpp"
+#include "disk_cache.hpp"
+#include "finder.hpp"
+#include "protocol.hpp"
+#include "reverse_index.hpp"
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/filesystem/path.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <variant>
+#include <vector>
+
+struct ReverseConfiguration {
+    // Points farther than this from any indexed address, in meters, are
+    // looked up with the backend services.
+    double radius;
+    // Gazetteer whose addresses are indexed. An empty path indexes none.
+    boost::filesystem::path gazetteer;
+    // Whether the locations of the disk cache are indexed.
+    bool disk_cache;
+};
+
+ReverseConfiguration default_reverse_config();
+
+using PlaceResult = std::variant<Place, Error>;
+using PlaceHandler = std::function<void(PlaceResult)>;
+
+// Indexes the addresses of the gazetteer of config and, if config says so,
+// the locations of the disk cache, which may be null. Throws if the
+// gazetteer cannot be read.
+std::shared_ptr<const ReverseIndex> make_reverse_index(
+    const ReverseConfiguration& config, const DiskCache* disk_cache);
+
+// Looks up the address at a point with the reverse geocoding APIs of the
+// given protocols, one at a time in the configured order, until one finds
+// it. Protocols without such an API are skipped, as are those whose rate
+// limit is reached or whose circuit breaker is open. Results are reported
+// as by async_find, with the distance from the point to the place found.
+// The handler is invoked through executor.
+void async_find_place(std::shared_ptr<ClientContext> context,
+    std::vector<AnyProtocol> protocols, const FinderConfiguration& config,
+    Coordinates coords, std::chrono::steady_clock::time_point deadline,
+    boost::asio::any_io_executor executor, PlaceHandler handler);
@@ -0,0 +1,164 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "reverse_index.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+    // Mean radius of the Earth.
+    const double EARTH_RADIUS_M = 6371008.8;
+    const double PI = 3.14159265358979323846;
+    // Maximum number of points in a leaf. Scanning a leaf costs about as
+    // much as descending a level of the tree.
+    const std::uint32_t LEAF_SIZE = 16;
+    // Bounds the depth of the tree, whose leaves hold at least half of
+    // LEAF_SIZE points.
+    const std::size_t MAX_DEPTH = 64;
+    const std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+    double radians(double degrees) {return degrees * PI / 180;}
+
+    std::array<double, 3> unit_vector(const Coordinates& coords) {
+        auto latitude = radians(coords.latitude);
+        auto longitude = radians(coords.longitude);
+        return {std::cos(latitude) * std::cos(longitude),
+            std::cos(latitude) * std::sin(longitude), std::sin(latitude)};
+    }
+
+    // Squared distances from q to n points given by their coordinates on
+    // each axis. A plain loop without branches over separate arrays, so
+    // that it is vectorized.
+    void squared_distances(const double* xs, const double* ys,
+        const double* zs, std::size_t n, const std::array<double, 3>& q,
+        double* out)
+    {
+        for (std::size_t i = 0; i < n; ++i) {
+            auto dx = xs[i] - q[0];
+            auto dy = ys[i] - q[1];
+            auto dz = zs[i] - q[2];
+            out[i] = dx * dx + dy * dy + dz * dz;
+        }
+    }
+}
+
+double distance_between(const Coordinates& a, const Coordinates& b) {
+    auto dlat = radians(b.latitude - a.latitude);
+    auto dlon = radians(b.longitude - a.longitude);
+    auto h = std::sin(dlat / 2) * std::sin(dlat / 2)
+        + std::cos(radians(a.latitude)) * std::cos(radians(b.latitude))
+        * std::sin(dlon / 2) * std::sin(dlon / 2);
+    return 2 * EARTH_RADIUS_M * std::asin(std::min(1.0, std::sqrt(h)));
+}
+
+ReverseIndex::ReverseIndex(const std::vector<GazetteerEntry>& entries) {
+    if (entries.size() >= NONE) {
+        throw std::runtime_error("Too many addresses in reverse index");
+    }
+    if (entries.empty()) {return;}
+    std::vector<Vector> vectors;
+    vectors.reserve(entries.size());
+    std::vector<std::uint32_t> order;
+    order.reserve(entries.size());
+    for (auto& entry: entries) {
+        order.push_back(static_cast<std::uint32_t>(vectors.size()));
+        vectors.push_back(unit_vector(entry.coords));
+    }
+    build(0, static_cast<std::uint32_t>(order.size()), vectors, order);
+    for (auto& axis: axes) {axis.reserve(order.size());}
+    points.reserve(order.size());
+    address_offsets.reserve(order.size() + 1);
+    for (auto i: order) {
+        for (std::size_t axis = 0; axis < axes.size(); ++axis) {
+            axes[axis].push_back(vectors[i][axis]);
+        }
+        points.push_back(entries[i].coords);
+        address_offsets.push_back(addresses.size());
+        addresses.append(entries[i].address);
+    }
+    address_offsets.push_back(addresses.size());
+}
+
+// The stack holds the nodes left to visit with a lower bound of the squared
+// distance to their points. The far child of a node is pushed before the
+// near one, so that it is only visited once the near subtree has tightened
+// the best distance.
+std::optional<Place> ReverseIndex::nearest(const Coordinates& coords,
+    double max_distance) const
+{
+    if (nodes.empty() || !(max_distance >= 0)) {return std::nullopt;}
+    auto q = unit_vector(coords);
+    auto chord = 2 * std::sin(std::min(max_distance / EARTH_RADIUS_M, PI) / 2);
+    // Leaves room for rounding errors. Candidates are checked against the
+    // great-circle distance.
+    auto best = (chord + 1e-12) * (chord + 1e-12);
+    auto found = NONE;
+    std::array<std::pair<std::uint32_t, double>, MAX_DEPTH> stack;
+    std::size_t depth = 0;
+    stack[depth++] = {0, 0.0};
+    std::array<double, LEAF_SIZE> distances;
+    while (depth > 0) {
+        auto [index, bound] = stack[--depth];
+        if (bound >= best) {continue;}
+        const auto& node = nodes[index];
+        if (node.right == 0) {
+            auto n = node.end - node.begin;
+            squared_distances(axes[0].data() + node.begin,
+                axes[1].data() + node.begin, axes[2].data() + node.begin, n,
+                q, distances.data());
+            for (std::uint32_t i = 0; i < n; ++i) {
+                if (distances[i] < best) {
+                    best = distances[i];
+                    found = node.begin + i;
+                }
+            }
+            continue;
+        }
+        auto diff = q[node.axis] - node.split;
+        auto near = diff < 0 ? index + 1 : node.right;
+        auto far = diff < 0 ? node.right : index + 1;
+        stack[depth++] = {far, std::max(bound, diff * diff)};
+        stack[depth++] = {near, bound};
+    }
+    if (found == NONE) {return std::nullopt;}
+    auto distance = distance_between(coords, points[found]);
+    if (distance > max_distance) {return std::nullopt;}
+    auto begin = address_offsets[found];
+    return Place {addresses.substr(begin, address_offsets[found + 1] - begin),
+        points[found], distance};
+}
+
+// Splits the points at the median of the axis along which they spread the
+// most, so that the tree is balanced and its cells compact.
+void ReverseIndex::build(std::uint32_t begin, std::uint32_t end,
+    std::vector<Vector>& vectors, std::vector<std::uint32_t>& order)
+{
+    auto index = nodes.size();
+    nodes.push_back(Node {begin, end, 0, 0, 0});
+    if (end - begin <= LEAF_SIZE) {return;}
+    std::uint32_t axis = 0;
+    double spread = -1;
+    for (std::uint32_t a = 0; a < 3; ++a) {
+        auto [low, high] = std::minmax_element(order.begin() + begin,
+            order.begin() + end, [&] (std::uint32_t i, std::uint32_t j) {
+                return vectors[i][a] < vectors[j][a];
+            });
+        auto s = vectors[*high][a] - vectors[*low][a];
+        if (s > spread) {
+            spread = s;
+            axis = a;
+        }
+    }
+    auto mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid,
+        order.begin() + end, [&] (std::uint32_t i, std::uint32_t j) {
+            return vectors[i][axis] < vectors[j][axis];
+        });
+    nodes[index].axis = axis;
+    nodes[index].split = vectors[order[mid]][axis];
+    build(begin, mid, vectors, order);
+    nodes[index].right = static_cast<std::uint32_t>(nodes.size());
+    build(mid, end, vectors, order);
+}
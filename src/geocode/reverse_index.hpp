@@ -0,0 +1,70 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include "gazetteer.hpp"
+#include "protocol.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Great-circle distance in meters between two points.
+double distance_between(const Coordinates& a, const Coordinates& b);
+
+// Addresses indexed by their coordinates, to find the one nearest to a
+// point.
+//
+// Points are stored as unit vectors, so that distances on the sphere compare
+// like chord lengths, which need no trigonometry. They are indexed by a k-d
+// tree packed in arrays: nodes are stored depth first, a left child right
+// after its parent, and the points are sorted so that the points of each
+// node are a contiguous run, with one array per axis. A query descends to the
+// leaf holding the point, then scans the leaves that may hold a nearer one,
+// skipping the other subtrees by the distance to their splitting plane. The
+// distances to the points of a leaf are computed by a loop over the axis
+// arrays that the compiler vectorizes. Immutable and safe to share between
+// threads.
+class ReverseIndex {
+public:
+    // An address given several times is indexed at each of its coordinates.
+    // Throws if there are too many addresses.
+    explicit ReverseIndex(const std::vector<GazetteerEntry>& entries);
+    ReverseIndex(const ReverseIndex&) = delete;
+    ReverseIndex& operator=(const ReverseIndex&) = delete;
+
+    // Address nearest to a point, if one is within max_distance meters.
+    std::optional<Place> nearest(const Coordinates& coords,
+        double max_distance) const;
+    // Number of addresses.
+    std::size_t size() const {return points.size();}
+
+private:
+    struct Node {
+        // Points of the subtree.
+        std::uint32_t begin;
+        std::uint32_t end;
+        // Index of the right child, or zero for a leaf.
+        std::uint32_t right;
+        std::uint32_t axis;
+        // Points of the left child are at most this far along the axis, and
+        // those of the right child at least.
+        double split;
+    };
+
+    using Vector = std::array<double, 3>;
+
+    void build(std::uint32_t begin, std::uint32_t end,
+        std::vector<Vector>& vectors, std::vector<std::uint32_t>& order);
+
+private:
+    std::vector<Node> nodes;
+    std::array<std::vector<double>, 3> axes;
+    std::vector<Coordinates> points;
+    // The address of point i is at [address_offsets[i],
+    // address_offsets[i + 1]) in addresses.
+    std::vector<std::size_t> address_offsets;
+    std::string addresses;
+};
@@ -1,67 +1,314 @@
 // Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
 
-#include "client.hpp"
+#include "admission.hpp"
+#include "batch.hpp"
+#include "client_context.hpp"
+#include "config_store.hpp"
+#include "disk_cache.hpp"
+#include "finder.hpp"
+#include "handler_memory.hpp"
+#include "in_flight.hpp"
+#include "location.hpp"
+#include "metrics.hpp"
+#include "object_pool.hpp"
 #include "protocol.hpp"
+#include "result_cache.hpp"
+#include "result_json.hpp"
+#include "reverse.hpp"
 #include "service.hpp"
+#include "tls_context.hpp"
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 using json = nlohmann::json;
 
 namespace {
+    // Optional request header bounding, in milliseconds, the time spent
+    // looking up the location.
+    const char DEADLINE_HEADER[] = "X-Deadline-Ms";
+
+    const char BATCH_TARGET[] = "/geocode/batch";
+
+    const char RELOAD_TARGET[] = "/admin/reload";
+
+    const char METRICS_TARGET[] = "/metrics";
+
+    const char REVERSE_PREFIX[] = "/reverse?";
+
+    const char JSON_CONTENT_TYPE[] = "application/json; charset=utf-8";
+
+    const char METRICS_CONTENT_TYPE[] =
+        "text/plain; version=0.0.4; charset=utf-8";
+
+    // Connection handlers kept for reuse on each io_context.
+    const std::size_t MAX_IDLE_HANDLERS = 256;
+
+    // Parses the locations of a batch request, given either as a JSON array
+    // of strings or as one JSON string per line.
+    std::optional<std::vector<std::string>> parse_batch(
+        const std::string& body)
+    {
+        const char whitespace[] = " \t\r\n";
+        try {
+            auto first = body.find_first_not_of(whitespace);
+            if (first != std::string::npos && body[first] == '[') {
+                return json::parse(body).get<std::vector<std::string>>();
+            }
+            std::vector<std::string> locations;
+            std::string_view rest(body);
+            while (!rest.empty()) {
+                auto line = rest.substr(0, rest.find('\n'));
+                rest.remove_prefix(std::min(line.size() + 1, rest.size()));
+                if (line.find_first_not_of(whitespace) == line.npos) {
+                    continue;
+                }
+                locations.push_back(json::parse(line.begin(), line.end())
+                    .get<std::string>());
+            }
+            return locations;
+        } catch (const json::exception&) {
+            return std::nullopt;
+        }
+    }
+
+    // Reads the point of a reverse request from the lat and lon parameters
+    // of its target, in degrees.
+    std::optional<Coordinates> parse_point(std::string_view target) {
+        std::optional<double> latitude;
+        std::optional<double> longitude;
+        auto rest = target.substr(std::min(target.find('?') + 1,
+            target.size()));
+        while (!rest.empty()) {
+            auto param = rest.substr(0, rest.find('&'));
+            rest.remove_prefix(std::min(param.size() + 1, rest.size()));
+            auto name = param.substr(0, param.find('='));
+            if (name != "lat" && name != "lon") {continue;}
+            auto value = param.substr(std::min(name.size() + 1,
+                param.size()));
+            double number = 0;
+            auto [end, err] = std::from_chars(value.data(),
+                value.data() + value.size(), number);
+            if (err != std::errc() || end != value.data() + value.size()) {
+                return std::nullopt;
+            }
+            (name == "lat" ? latitude : longitude) = number;
+        }
+        if (!latitude || !longitude || !(std::abs(*latitude) <= 90)
+            || !(std::abs(*longitude) <= 180))
+        {
+            return std::nullopt;
+        }
+        return Coordinates {*latitude, *longitude};
+    }
+
+    // Stores a lookup result in the caches. Only coordinates are kept on
+    // disk.
+    void cache_result(const std::shared_ptr<ResultCache>& cache,
+        const std::shared_ptr<DiskCache>& disk_cache, const std::string& key,
+        const ProtocolResult& result)
+    {
+        if (cache) {cache->insert(key, result);}
+        if (!disk_cache) {return;}
+        if (auto coords = std::get_if<Coordinates>(&result)) {
+            disk_cache->insert(key, *coords);
+        }
+    }
+
+    // Serves the requests of one connection. Handlers are pooled by the
+    // service: once a connection is closed and the last reference to its
+    // handler dropped, the handler is recycled, keeping its buffers, for
+    // the next connection accepted.
     class ServiceHandler: public std::enable_shared_from_this<ServiceHandler> {
     private:
         struct Priv {};
 
     public:
-        explicit ServiceHandler(boost::asio::ip::tcp::socket socket,
-            ServiceConfiguration config, Priv
+        explicit ServiceHandler(boost::asio::any_io_executor executor,
+            std::shared_ptr<ConfigStore> store,
+            std::shared_ptr<ClientContext> client_context,
+            std::shared_ptr<ResultCache> cache,
+            std::shared_ptr<DiskCache> disk_cache,
+            std::shared_ptr<const ReverseIndex> reverse_index,
+            std::shared_ptr<InFlightLookups> in_flight,
+            std::shared_ptr<Admission> admission,
+            std::shared_ptr<Metrics> metrics, Priv
         ):
-            config(std::move(config)),
-            socket(std::move(socket)),
+            store(std::move(store)),
+            client_context(std::move(client_context)),
+            cache(std::move(cache)),
+            disk_cache(std::move(disk_cache)),
+            reverse_index(std::move(reverse_index)),
+            in_flight(std::move(in_flight)),
+            admission(std::move(admission)),
+            metrics(std::move(metrics)),
+            socket(executor),
+            deadline_timer(executor),
+            idle_timer(executor),
             http_version(11),
-            attempts(0)
+            requests(0),
+            connected(false),
+            admitted(false),
+            reading(false),
+            responded(false),
+            keep_alive(false),
+            batch_remaining(0),
+            writing(false),
+            batch_failed(false)
         {}
 
-        static std::shared_ptr<ServiceHandler> make(
-            boost::asio::ip::tcp::socket socket, ServiceConfiguration config)
+        static std::unique_ptr<ServiceHandler> make(
+            boost::asio::any_io_executor executor,
+            std::shared_ptr<ConfigStore> store,
+            std::shared_ptr<ClientContext> client_context,
+            std::shared_ptr<ResultCache> cache,
+            std::shared_ptr<DiskCache> disk_cache,
+            std::shared_ptr<const ReverseIndex> reverse_index,
+            std::shared_ptr<InFlightLookups> in_flight,
+            std::shared_ptr<Admission> admission,
+            std::shared_ptr<Metrics> metrics)
         {
-            return std::make_shared<ServiceHandler>(std::move(socket),
-                std::move(config), Priv {});
+            return std::make_unique<ServiceHandler>(std::move(executor),
+                std::move(store), std::move(client_context),
+                std::move(cache), std::move(disk_cache),
+                std::move(reverse_index), std::move(in_flight),
+                std::move(admission), std::move(metrics), Priv {});
         }
 
+        // Socket to accept the connection into.
+        boost::asio::ip::tcp::socket& connection() {return socket;}
+
+        // A connection past the limit is answered with status 503 and
+        // closed.
         void process() {
+            connected = true;
+            add_active_connections(1);
+            admitted = admission->admit_connection();
+            config = store->current();
+            read_request();
+        }
+
+        void recycle() {
+            close();
+            if (connected) {
+                connected = false;
+                add_active_connections(-1);
+            }
+            if (admitted) {
+                admitted = false;
+                admission->release_connection();
+            }
+            config.reset();
+            buffer.consume(buffer.size());
+            request.clear();
+            request.body().clear();
+            response.body().clear();
+            http_version = 11;
+            requests = 0;
+            reading = false;
+            responded = false;
+            keep_alive = false;
+            location.clear();
+            key.clear();
+            batch_serializer.reset();
+            batch_keys.clear();
+            batch_indices.clear();
+            batch_remaining = 0;
+            batch_output.clear();
+            batch_chunk.clear();
+            writing = false;
+            batch_failed = false;
+        }
+
+    private:
+        // Answers with a BackendFailure error once the deadline of the
+        // current request passes.
+        void arm_deadline(std::chrono::steady_clock::time_point deadline) {
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                return;
+            }
             auto this_ = shared_from_this();
-            boost::beast::http::async_read(socket, buffer, request,
-                [this_] (boost::system::error_code ec, std::size_t) {
-                    this_->on_request(ec);
+            deadline_timer.expires_at(deadline);
+            deadline_timer.async_wait(bind_arena(memory,
+                [this_, id = requests] (boost::system::error_code ec)
+            {
+                if (ec || this_->responded || id != this_->requests) {
+                    return;
                 }
-            );
+                this_->respond_with_error(Error {
+                    ErrorKind::BackendFailure, "Deadline exceeded"});
+            }));
         }
 
-    private:
-        void finalize_response(Response& response) {
-            response.set(boost::beast::http::field::content_type,
-                "application/json; charset=utf-8");
-        }
-        
-        Response make_error_response(const Error& error) {
-            json j = {
-                {"Err", {
-                    {"kind", to_string(error.kind)},
-                    {"cause", {error.cause}}
-                }}
-            };
+        void close() {
+            boost::system::error_code ec;
+            socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+            socket.close(ec);
+        }
+
+        // Fills the response in place so that its storage is reused across
+        // requests on the connection.
+        // The body must already be written.
+        void finalize_response(boost::beast::http::status status,
+            boost::beast::string_view content_type = JSON_CONTENT_TYPE)
+        {
+            response.result(status);
+            response.version(http_version);
+            auto it = response.find(boost::beast::http::field::content_type);
+            if (it == response.end() || it->value() != content_type) {
+                response.set(boost::beast::http::field::content_type,
+                    content_type);
+            }
+            if (status == boost::beast::http::status::service_unavailable) {
+                response.set(boost::beast::http::field::retry_after,
+                    std::to_string(admission->configuration().retry_after
+                    .count()));
+            } else {
+                response.erase(boost::beast::http::field::retry_after);
+            }
+            keep_alive = admitted && request.keep_alive()
+                && requests < config->keep_alive.max_requests;
+            response.keep_alive(keep_alive);
+            response.prepare_payload();
+        }
+
+        // Coordinates found on disk are brought into the memory cache.
+        std::optional<ProtocolResult> find_cached(const std::string& key) {
+            if (cache) {
+                if (auto result = cache->find(key)) {return result;}
+            }
+            if (!disk_cache) {return std::nullopt;}
+            auto coords = disk_cache->find(key);
+            if (!coords) {return std::nullopt;}
+            if (cache) {cache->insert(key, *coords);}
+            return ProtocolResult(*coords);
+        }
+
+        void make_error_response(const Error& error) {
+            response.body().clear();
+            append_result_json(response.body(), error,
+                config->response_format);
             boost::beast::http::status status = boost::beast::http::status::ok;
             switch (error.kind) {
             case ErrorKind::BackendFailure:
@@ -71,40 +318,108 @@ namespace {
                 break;
             case ErrorKind::LocationNotFound:
                 break;
+            case ErrorKind::Overloaded:
+                status = boost::beast::http::status::service_unavailable;
+                break;
             }
-            Response resp(status, http_version, j.dump(2));
-            finalize_response(resp);
-            return resp;
+            finalize_response(status);
         }
 
-        Response make_success_response(const Coordinates& coords) {
-            json j = {
-                {"Ok", {
-                    {"latitude", coords.latitude},
-                    {"longitude", coords.longitude}
-                }}
-            };
-            Response resp(boost::beast::http::status::ok, http_version,
-                j.dump(2));
-            finalize_response(resp);
-            return resp;
+        void make_success_response(const Coordinates& coords) {
+            response.body().clear();
+            append_result_json(response.body(), coords,
+                config->response_format);
+            finalize_response(boost::beast::http::status::ok);
+        }
+
+        void on_batch_result(std::size_t index, ProtocolResult result) {
+            const auto& indices = batch_indices[index];
+            cache_result(cache, disk_cache, batch_keys[index], result);
+            for (auto i: indices) {write_batch_result(i, result);}
+            batch_remaining -= indices.size();
+            write_batch();
         }
-        
-        void on_coordinates(ProtocolResult result) {
-            if (std::get_if<Error>(&result)) {
-                ++attempts;
-                request_coordinates(location);
+
+        void on_batch_written(bool last, boost::system::error_code ec,
+            std::size_t)
+        {
+            writing = false;
+            if (ec) {
+                batch_failed = true;
+                close();
                 return;
             }
-            response = make_success_response(std::get<Coordinates>(result));
-            respond();
+            if (last) {
+                on_responded(ec, 0);
+                return;
+            }
+            write_batch();
         }
-        
+
+        void on_coordinates(unsigned int id, ProtocolResult result) {
+            if (responded || id != requests) {return;}
+            if (auto e = std::get_if<Error>(&result)) {
+                auto kind = e->kind == ErrorKind::Overloaded
+                    ? ErrorKind::Overloaded : ErrorKind::LocationNotFound;
+                respond_with_error(Error {kind, std::move(e->cause)});
+                return;
+            }
+            respond_with_result(result);
+        }
+
+        void on_place(unsigned int id, PlaceResult result) {
+            if (responded || id != requests) {return;}
+            if (auto e = std::get_if<Error>(&result)) {
+                respond_with_error(*e);
+                return;
+            }
+            respond_with_place(std::get<Place>(result));
+        }
+
         void on_request(boost::system::error_code ec) {
-            if (ec) {return;}
+            reading = false;
+            idle_timer.cancel();
+            if (ec) {
+                close();
+                return;
+            }
+            ++requests;
+            request_start = std::chrono::steady_clock::now();
+            responded = false;
+            // Each request uses the configuration current when it starts.
+            config = store->current();
             http_version = request.version();
+            if (!admitted) {
+                respond_with_error(Error {ErrorKind::Overloaded,
+                    "Too many connections"});
+                return;
+            }
             const char prefix[] = "/geocode?location=";
             const auto& target = request.target();
+            if (target == RELOAD_TARGET) {
+                reload();
+                return;
+            }
+            if (target == METRICS_TARGET) {
+                serve_metrics();
+                return;
+            }
+            if (boost::starts_with(target, REVERSE_PREFIX)) {
+                if (request.method() != boost::beast::http::verb::get) {
+                    respond_with_error(Error {ErrorKind::BadRequest, ""});
+                    return;
+                }
+                process_reverse();
+                return;
+            }
+            if (target == BATCH_TARGET) {
+                if (request.method() != boost::beast::http::verb::post) {
+                    respond_with_error(Error {ErrorKind::BadRequest, ""});
+                    return;
+                }
+                process_batch();
+                return;
+            }
             if (request.method() != boost::beast::http::verb::get
                 || !boost::starts_with(target, prefix))
             {
@@ -112,52 +427,411 @@ namespace {
                 return;
             }
             location = target.substr(std::size(prefix) - 1).to_string();
-            request_coordinates(location);
+            key = normalize_location(location);
+            if (auto result = find_cached(key)) {
+                respond_with_result(*result);
+                return;
+            }
+            auto deadline = read_deadline();
+            if (!deadline) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Invalid deadline"});
+                return;
+            }
+            request_coordinates(*deadline);
         }
 
         void on_responded(boost::system::error_code ec, std::size_t) {
-            socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+            record_request_latency(std::chrono::steady_clock::now()
+                - request_start);
+            if (ec || !keep_alive) {
+                close();
+                return;
+            }
+            read_request();
         }
 
-        void request_coordinates(const std::string& location) {
-            if (attempts >= config.protocols.size()) {
-                std::string cause;
-                if (config.protocols.empty()) {
-                    cause = "No backend service configured";
+        // Results of a batch request are streamed as chunks of JSON lines
+        // tagged with the index of their location, in completion order.
+        // Repeated locations are looked up once.
+        void process_batch() {
+            auto deadline = read_deadline();
+            if (!deadline) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Invalid deadline"});
+                return;
+            }
+            auto locations = parse_batch(request.body());
+            if (!locations) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Invalid batch"});
+                return;
+            }
+            if (locations->size() > config->batch.max_locations) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Too many locations"});
+                return;
+            }
+            batch_keys.clear();
+            batch_indices.clear();
+            batch_output.clear();
+            batch_remaining = 0;
+            batch_failed = false;
+            std::vector<std::string> pending;
+            std::unordered_map<std::string, std::size_t> positions;
+            for (std::size_t i = 0; i < locations->size(); ++i) {
+                auto& location = (*locations)[i];
+                auto key = normalize_location(encode_location(location));
+                if (auto result = find_cached(key)) {
+                    write_batch_result(i, *result);
+                    continue;
+                }
+                auto [it, inserted] = positions.emplace(key,
+                    batch_keys.size());
+                if (inserted) {
+                    batch_keys.push_back(std::move(key));
+                    batch_indices.emplace_back();
+                    pending.push_back(std::move(location));
+                }
+                batch_indices[it->second].push_back(i);
+                ++batch_remaining;
+            }
+            if (pending.empty()) {
+                start_batch(std::move(pending), *deadline, false);
+                return;
+            }
+            // A batch takes a single lookup slot, its backend queries being
+            // bounded by the batch concurrency.
+            auto this_ = shared_from_this();
+            admission->admit_lookup(socket.get_executor(), *deadline,
+                [this_, pending = std::move(pending), deadline = *deadline] (
+                    bool admitted) mutable
+                {
+                    if (!admitted) {
+                        this_->respond_with_error(Error {
+                            ErrorKind::Overloaded, "Too many lookups"});
+                        return;
+                    }
+                    this_->start_batch(std::move(pending), deadline, true);
+                });
+        }
+
+        // Points near an indexed address are answered from the index, and
+        // the others by the backend services once admitted.
+        void process_reverse() {
+            const auto& target = request.target();
+            auto point = parse_point(std::string_view(target.data(),
+                target.size()));
+            if (!point) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Invalid coordinates"});
+                return;
+            }
+            auto place = reverse_index->nearest(*point,
+                config->reverse.radius);
+            if (place) {
+                count_reverse_index_hit();
+                respond_with_place(*place);
+                return;
+            }
+            auto deadline = read_deadline();
+            if (!deadline) {
+                respond_with_error(Error {ErrorKind::BadRequest,
+                    "Invalid deadline"});
+                return;
+            }
+            count_reverse_fallback();
+            arm_deadline(*deadline);
+            auto this_ = shared_from_this();
+            auto executor = socket.get_executor();
+            admission->admit_lookup(executor, *deadline, [this_,
+                client_context = client_context, config = config,
+                point = *point, deadline = *deadline, executor,
+                id = requests] (bool admitted)
+            {
+                if (!admitted) {
+                    this_->on_place(id, Error {ErrorKind::Overloaded,
+                        "Too many lookups"});
+                    return;
                 }
-                respond_with_error(Error {ErrorKind::LocationNotFound,
-                    std::move(cause)});
+                async_find_place(client_context, config->protocols,
+                    config->finder, point, deadline, executor, [this_, id] (
+                        PlaceResult result)
+                {
+                    this_->admission->release_lookup();
+                    this_->on_place(id, std::move(result));
+                });
+            });
+        }
+
+        // Only accepted from the local host.
+        void reload() {
+            boost::system::error_code ec;
+            auto peer = socket.remote_endpoint(ec);
+            if (request.method() != boost::beast::http::verb::post || ec
+                || !peer.address().is_loopback())
+            {
+                respond_with_error(Error {ErrorKind::BadRequest, ""});
                 return;
             }
-            std::visit([location, this] (auto proto) {
-                auto this_ = shared_from_this();
-                async_find_lat_long(socket.get_io_context(), proto, location,
-                    std::bind(&ServiceHandler::on_coordinates, this_,
-                    std::placeholders::_1));
-            }, config.protocols[attempts]);
+            try {
+                store->reload();
+            } catch (const std::exception& e) {
+                respond_with_error(Error {ErrorKind::BadRequest, e.what()});
+                return;
+            }
+            std::cout << "Configuration reloaded" << std::endl;
+            response.body().clear();
+            finalize_response(boost::beast::http::status::no_content);
+            respond();
+        }
+
+        // Returns max() if the request has no deadline, and nothing if the
+        // deadline is invalid.
+        std::optional<std::chrono::steady_clock::time_point> read_deadline()
+            const
+        {
+            auto deadline = std::chrono::steady_clock::time_point::max();
+            auto it = request.find(DEADLINE_HEADER);
+            if (it == request.end()) {return deadline;}
+            auto value = it->value();
+            unsigned int ms = 0;
+            auto [end, err] = std::from_chars(value.data(),
+                value.data() + value.size(), ms);
+            if (err != std::errc() || end != value.data() + value.size()) {
+                return std::nullopt;
+            }
+            return std::chrono::steady_clock::now()
+                + std::chrono::milliseconds(ms);
+        }
+
+        // Requests on a connection are handled one at a time; pipelined
+        // requests wait in the buffer until the previous response is sent.
+        void read_request() {
+            auto this_ = shared_from_this();
+            request.clear();
+            request.body().clear();
+            reading = true;
+            idle_timer.expires_after(config->keep_alive.idle_timeout);
+            idle_timer.async_wait(bind_arena(memory, [this_] (
+                boost::system::error_code ec)
+            {
+                if (ec || !this_->reading) {return;}
+                this_->close();
+            }));
+            boost::beast::http::async_read(socket, buffer, request,
+                bind_arena(memory, [this_] (boost::system::error_code ec,
+                    std::size_t)
+                {
+                    this_->on_request(ec);
+                })
+            );
+        }
+
+        // Identical lookups in flight are coalesced. The first one waits for
+        // admission, queries the backends and caches the result, or fails
+        // with an Overloaded error if it is not admitted. A lookup joined by
+        // later requests stops at the deadline of the request that started
+        // it; each request still stops waiting at its own deadline.
+        void request_coordinates(
+            std::chrono::steady_clock::time_point deadline)
+        {
+            auto this_ = shared_from_this();
+            auto executor = socket.get_executor();
+            arm_deadline(deadline);
+            in_flight->join(key, executor, std::bind(
+                &ServiceHandler::on_coordinates, this_, requests,
+                std::placeholders::_1),
+                [this, deadline] (FindHandler done) {
+                    start_lookup(deadline, std::move(done));
+                });
         }
 
         void respond() {
             auto this_ = shared_from_this();
-            boost::beast::http::async_write(socket, response, std::bind(
-                &ServiceHandler::on_responded, this_, std::placeholders::_1,
-                std::placeholders::_2));
+            responded = true;
+            deadline_timer.cancel();
+            boost::beast::http::async_write(socket, response, bind_arena(
+                memory, std::bind(&ServiceHandler::on_responded, this_,
+                std::placeholders::_1, std::placeholders::_2)));
+        }
+
+        void serve_metrics() {
+            if (request.method() != boost::beast::http::verb::get) {
+                respond_with_error(Error {ErrorKind::BadRequest, ""});
+                return;
+            }
+            response.body() = metrics->scrape();
+            finalize_response(boost::beast::http::status::ok,
+                METRICS_CONTENT_TYPE);
+            respond();
+        }
+
+        void start_batch_response() {
+            auto this_ = shared_from_this();
+            keep_alive = request.keep_alive()
+                && requests < config->keep_alive.max_requests;
+            batch_response = {};
+            batch_response.result(boost::beast::http::status::ok);
+            batch_response.version(http_version);
+            batch_response.set(boost::beast::http::field::content_type,
+                "application/x-ndjson");
+            batch_response.keep_alive(keep_alive);
+            batch_response.chunked(true);
+            batch_serializer.emplace(batch_response);
+            writing = true;
+            boost::beast::http::async_write_header(socket, *batch_serializer,
+                bind_arena(memory, std::bind(&ServiceHandler::on_batch_written,
+                this_, false, std::placeholders::_1, std::placeholders::_2)));
+        }
+
+        // Looks up the locations of a batch request missing from the caches.
+        // A batch that was admitted releases its lookup slot once done.
+        void start_batch(std::vector<std::string> locations,
+            std::chrono::steady_clock::time_point deadline, bool admitted)
+        {
+            start_batch_response();
+            auto this_ = shared_from_this();
+            BatchDoneHandler done = [] {};
+            if (admitted) {
+                done = [admission = admission] {admission->release_lookup();};
+            }
+            async_find_batch(client_context, config->protocols, config->finder,
+                config->batch, std::move(locations), deadline,
+                socket.get_executor(), std::bind(
+                &ServiceHandler::on_batch_result, this_, std::placeholders::_1,
+                std::placeholders::_2), std::move(done));
+        }
+
+        // Looks up the location once admitted, and caches the result. The
+        // lookup may outlive the request that started it.
+        void start_lookup(std::chrono::steady_clock::time_point deadline,
+            FindHandler done)
+        {
+            auto executor = socket.get_executor();
+            admission->admit_lookup(executor, deadline, [
+                admission = admission, client_context = client_context,
+                config = config, cache = cache, disk_cache = disk_cache,
+                location = location, key = key, deadline, executor,
+                done = std::move(done)] (bool admitted) mutable
+            {
+                if (!admitted) {
+                    done(Error {ErrorKind::Overloaded, "Too many lookups"});
+                    return;
+                }
+                async_find(std::move(client_context), config->protocols,
+                    config->finder, std::move(location), deadline, executor,
+                    [admission = std::move(admission), cache = std::move(cache),
+                    disk_cache = std::move(disk_cache), key = std::move(key),
+                    done = std::move(done)] (ProtocolResult result)
+                {
+                    admission->release_lookup();
+                    cache_result(cache, disk_cache, key, result);
+                    done(std::move(result));
+                });
+            });
+        }
+
+        // Sends the results not written yet in one chunk, then the last
+        // chunk once all results are written.
+        void write_batch() {
+            if (writing || batch_failed) {return;}
+            auto this_ = shared_from_this();
+            if (batch_output.empty()) {
+                if (batch_remaining > 0) {return;}
+                writing = true;
+                boost::asio::async_write(socket,
+                    boost::beast::http::make_chunk_last(), bind_arena(memory,
+                    std::bind(&ServiceHandler::on_batch_written, this_, true,
+                    std::placeholders::_1, std::placeholders::_2)));
+                return;
+            }
+            std::swap(batch_output, batch_chunk);
+            batch_output.clear();
+            writing = true;
+            boost::asio::async_write(socket, boost::beast::http::make_chunk(
+                boost::asio::buffer(batch_chunk)), bind_arena(memory,
+                std::bind(&ServiceHandler::on_batch_written, this_, false,
+                std::placeholders::_1, std::placeholders::_2)));
+        }
+
+        void write_batch_result(std::size_t index,
+            const ProtocolResult& result)
+        {
+            append_batch_line(batch_output, index, result);
         }
 
         void respond_with_error(const Error& e) {
-            response = make_error_response(e);
+            make_error_response(e);
+            respond();
+        }
+
+        void respond_with_result(const ProtocolResult& result) {
+            if (auto e = std::get_if<Error>(&result)) {
+                respond_with_error(*e);
+                return;
+            }
+            make_success_response(std::get<Coordinates>(result));
+            respond();
+        }
+
+        void respond_with_place(const Place& place) {
+            response.body().clear();
+            append_result_json(response.body(), place,
+                config->response_format);
+            finalize_response(boost::beast::http::status::ok);
             respond();
         }
 
     private:
-        ServiceConfiguration config;
+        std::shared_ptr<ConfigStore> store;
+        ConfigStore::Snapshot config;
+        std::shared_ptr<ClientContext> client_context;
+        std::shared_ptr<ResultCache> cache;
+        std::shared_ptr<DiskCache> disk_cache;
+        std::shared_ptr<const ReverseIndex> reverse_index;
+        std::shared_ptr<InFlightLookups> in_flight;
+        std::shared_ptr<Admission> admission;
+        std::shared_ptr<Metrics> metrics;
         boost::asio::ip::tcp::socket socket;
+        boost::asio::steady_timer deadline_timer;
+        boost::asio::steady_timer idle_timer;
         boost::beast::flat_buffer buffer;
         Request request;
         Response response;
         unsigned int http_version;
-        unsigned int attempts;
+        // Number of requests read on the connection. Identifies the current
+        // request.
+        unsigned int requests;
+        std::chrono::steady_clock::time_point request_start;
+        // Whether the handler counts as an active connection.
+        bool connected;
+        // Whether the connection is within the connection limit.
+        bool admitted;
+        bool reading;
+        bool responded;
+        // Whether the connection stays open after the current response.
+        bool keep_alive;
         std::string location;
+        // Normalized location.
+        std::string key;
+        // Batch requests.
+        boost::beast::http::response<boost::beast::http::empty_body>
+            batch_response;
+        std::optional<boost::beast::http::response_serializer<
+            boost::beast::http::empty_body>> batch_serializer;
+        // Normalized locations looked up, and the indices of the locations
+        // of the request that each one stands for.
+        std::vector<std::string> batch_keys;
+        std::vector<std::vector<std::size_t>> batch_indices;
+        // Number of locations of the request without a result.
+        std::size_t batch_remaining;
+        // Results waiting to be written, and results being written.
+        std::string batch_output;
+        std::string batch_chunk;
+        bool writing;
+        bool batch_failed;
+        HandlerMemory memory;
     };
 
     class Service: public std::enable_shared_from_this<Service> {
@@ -165,17 +839,138 @@ namespace {
         struct Priv {};
 
     public:
+        // The endpoint, threading and client settings are taken from config;
+        // handlers use the configuration current in store.
         explicit Service(boost::asio::io_context& ioc,
-            const ServiceConfiguration& config, Priv
+            const ServiceConfiguration& config,
+            std::shared_ptr<ConfigStore> store,
+            std::shared_ptr<TlsContexts> tls,
+            std::shared_ptr<ResultCache> cache,
+            std::shared_ptr<DiskCache> disk_cache,
+            std::shared_ptr<const ReverseIndex> reverse_index,
+            std::shared_ptr<Admission> admission,
+            std::shared_ptr<Metrics> metrics, Priv
         ):
-            config(config),
-            acceptor(ioc, config.endpoint)
-        {}
+            store(std::move(store)),
+            ioc(ioc),
+            shared(config.threading == Threading::Shared),
+            acceptor(ioc),
+            cache(std::move(cache)),
+            disk_cache(std::move(disk_cache)),
+            reverse_index(std::move(reverse_index)),
+            admission(std::move(admission)),
+            metrics(std::move(metrics)),
+            client_context(std::make_shared<ClientContext>(ioc, config.client,
+                std::move(tls), config.threading == Threading::Shared)),
+            in_flight(InFlightLookups::make(
+                config.threading == Threading::Shared)),
+            handlers(ObjectPool<ServiceHandler>::make(MAX_IDLE_HANDLERS,
+                config.threading == Threading::Shared))
+        {
+            acceptor.open(config.endpoint.protocol());
+            acceptor.set_option(
+                boost::asio::ip::tcp::acceptor::reuse_address(true));
+            if (config.threading == Threading::PerThread) {
+#ifdef SO_REUSEPORT
+                using ReusePort = boost::asio::detail::socket_option::boolean<
+                    SOL_SOCKET, SO_REUSEPORT>;
+                acceptor.set_option(ReusePort(true));
+#else
+                if (config.threads > 1) {
+                    throw std::runtime_error("Per-thread acceptors require "
+                        "SO_REUSEPORT");
+                }
+#endif
+            }
+            acceptor.bind(config.endpoint);
+            acceptor.listen();
+        }
 
         static std::shared_ptr<Service> make(boost::asio::io_context& ioc,
-            const ServiceConfiguration& config)
+            const ServiceConfiguration& config,
+            std::shared_ptr<ConfigStore> store,
+            std::shared_ptr<TlsContexts> tls,
+            std::shared_ptr<ResultCache> cache,
+            std::shared_ptr<DiskCache> disk_cache,
+            std::shared_ptr<const ReverseIndex> reverse_index,
+            std::shared_ptr<Admission> admission,
+            std::shared_ptr<Metrics> metrics)
         {
-            return std::make_shared<Service>(ioc, config, Priv {});
+            return std::make_shared<Service>(ioc, config, std::move(store),
+                std::move(tls), std::move(cache), std::move(disk_cache),
+                std::move(reverse_index), std::move(admission),
+                std::move(metrics), Priv {});
+        }
+
+        // Adds the samples of the objects owned by the service. Samples of
+        // the services of each event loop add up.
+        void collect(MetricSet& set) const {
+            set.family("geocode_pooled_objects_total", MetricType::Counter,
+                "Objects made by a pool, and objects handed out again.");
+            auto add_pool = [&set] (const char* pool, auto& objects) {
+                auto labels = std::string("{pool=\"") + pool + "\",";
+                set.add("geocode_pooled_objects_total",
+                    labels + "outcome=\"created\"}",
+                    static_cast<double>(objects.created()));
+                set.add("geocode_pooled_objects_total",
+                    labels + "outcome=\"reused\"}",
+                    static_cast<double>(objects.reused()));
+            };
+            add_pool("handlers", *handlers);
+            add_pool("client_buffers", *client_context->buffers);
+            auto flights = in_flight->statistics();
+            set.family("geocode_lookups_started_total", MetricType::Counter,
+                "Lookups sent to the backend services.");
+            set.add("geocode_lookups_started_total", "",
+                static_cast<double>(flights.started));
+            set.family("geocode_lookups_coalesced_total", MetricType::Counter,
+                "Lookups that joined an identical one in flight.");
+            set.add("geocode_lookups_coalesced_total", "",
+                static_cast<double>(flights.coalesced));
+            set.family("geocode_backend_lookups_total", MetricType::Counter,
+                "Lookups to each backend service by outcome.");
+            set.family("geocode_backend_breaker_state", MetricType::Gauge,
+                "Event loops on which the circuit breaker of each backend "
+                "service is in each state.");
+            set.family("geocode_backend_breaker_trips_total",
+                MetricType::Counter,
+                "Times the circuit breaker of each backend service opened.");
+            set.family("geocode_backend_lookup_duration_seconds",
+                MetricType::Histogram,
+                "Time for each backend service to answer a single lookup.");
+            for (auto& backend: client_context->stats->health()) {
+                auto label = "backend=\"" + backend.host + "\"";
+                auto outcome = "{" + label + ",outcome=";
+                set.add("geocode_backend_lookups_total",
+                    outcome + "\"found\"}",
+                    static_cast<double>(backend.found));
+                set.add("geocode_backend_lookups_total",
+                    outcome + "\"not_found\"}",
+                    static_cast<double>(backend.not_found));
+                set.add("geocode_backend_lookups_total",
+                    outcome + "\"failed\"}",
+                    static_cast<double>(backend.failed));
+                for (auto state: {BreakerState::Closed, BreakerState::Open,
+                    BreakerState::HalfOpen})
+                {
+                    set.add("geocode_backend_breaker_state", "{" + label
+                        + ",state=\"" + to_string(state) + "\"}",
+                        backend.state == state ? 1 : 0);
+                }
+                set.add("geocode_backend_breaker_trips_total",
+                    "{" + label + "}", static_cast<double>(backend.trips));
+                std::vector<double> bounds;
+                for (auto ms: LATENCY_BUCKETS_MS) {bounds.push_back(ms / 1e3);}
+                set.add_histogram("geocode_backend_lookup_duration_seconds",
+                    label, bounds, {backend.latency_buckets.begin(),
+                    backend.latency_buckets.end()},
+                    std::chrono::duration<double>(backend.latency_sum)
+                    .count());
+            }
+        }
+
+        boost::asio::ip::tcp::endpoint local_endpoint() const {
+            return acceptor.local_endpoint();
         }
 
         void run() {accept();}
@@ -183,28 +978,181 @@ namespace {
     private:
         void accept() {
             auto this_ = shared_from_this();
-            auto cfg = config;
-            acceptor.async_accept([cfg, this_] (boost::system::error_code ec,
-                boost::asio::ip::tcp::socket socket)
+            auto handler = handlers->acquire([this] {
+                // Connections accepted on a shared io_context get their own
+                // strand, which a recycled handler keeps.
+                boost::asio::any_io_executor executor = ioc.get_executor();
+                if (shared) {executor = boost::asio::make_strand(ioc);}
+                return ServiceHandler::make(std::move(executor), store,
+                    client_context, cache, disk_cache, reverse_index,
+                    in_flight, admission, metrics);
+            });
+            acceptor.async_accept(handler->connection(), [this_, handler] (
+                boost::system::error_code ec)
             {
-                if (!ec) {
-                    auto handler = ServiceHandler::make(std::move(socket), cfg);
-                    handler->process();
-                }
+                if (!ec) {handler->process();}
                 this_->accept();
             });
         }
 
     private:
-        ServiceConfiguration config;
+        std::shared_ptr<ConfigStore> store;
+        boost::asio::io_context& ioc;
+        // Whether the io_context is run by several threads.
+        bool shared;
         boost::asio::ip::tcp::acceptor acceptor;
+        std::shared_ptr<ResultCache> cache;
+        std::shared_ptr<DiskCache> disk_cache;
+        std::shared_ptr<const ReverseIndex> reverse_index;
+        std::shared_ptr<Admission> admission;
+        std::shared_ptr<Metrics> metrics;
+        std::shared_ptr<ClientContext> client_context;
+        std::shared_ptr<InFlightLookups> in_flight;
+        std::shared_ptr<ObjectPool<ServiceHandler>> handlers;
     };
 }
 
+namespace {
+    // Adds the samples of the objects shared by the services.
+    void collect_shared(MetricSet& set, const TlsContexts& tls,
+        const ResultCache* cache, const DiskCache* disk_cache,
+        const ReverseIndex& reverse_index, const Admission& admission)
+    {
+        auto handshakes = tls.statistics();
+        set.family("geocode_tls_handshakes_total", MetricType::Counter,
+            "TLS handshakes with backend services, by whether they resumed "
+            "a session.");
+        set.add("geocode_tls_handshakes_total", "{session=\"resumed\"}",
+            static_cast<double>(handshakes.resumed));
+        set.add("geocode_tls_handshakes_total", "{session=\"full\"}",
+            static_cast<double>(handshakes.full));
+        if (cache || disk_cache) {
+            set.family("geocode_cache_lookups_total", MetricType::Counter,
+                "Lookups in the result caches.");
+        }
+        if (cache) {
+            auto stats = cache->statistics();
+            set.family("geocode_cache_removals_total", MetricType::Counter,
+                "Entries removed from the memory cache.");
+            set.add("geocode_cache_lookups_total",
+                "{cache=\"memory\",result=\"hit\"}",
+                static_cast<double>(stats.hits));
+            set.add("geocode_cache_lookups_total",
+                "{cache=\"memory\",result=\"miss\"}",
+                static_cast<double>(stats.misses));
+            set.add("geocode_cache_removals_total", "{reason=\"evicted\"}",
+                static_cast<double>(stats.evictions));
+            set.add("geocode_cache_removals_total", "{reason=\"expired\"}",
+                static_cast<double>(stats.expirations));
+        }
+        if (disk_cache) {
+            auto stats = disk_cache->statistics();
+            set.family("geocode_cache_compactions_total", MetricType::Counter,
+                "Compactions of the disk cache.");
+            set.add("geocode_cache_lookups_total",
+                "{cache=\"disk\",result=\"hit\"}",
+                static_cast<double>(stats.hits));
+            set.add("geocode_cache_lookups_total",
+                "{cache=\"disk\",result=\"miss\"}",
+                static_cast<double>(stats.misses));
+            set.add("geocode_cache_compactions_total", "",
+                static_cast<double>(stats.compactions));
+        }
+        set.family("geocode_reverse_index_addresses", MetricType::Gauge,
+            "Addresses in the reverse geocoding index.");
+        set.add("geocode_reverse_index_addresses", "",
+            static_cast<double>(reverse_index.size()));
+        auto admitted = admission.statistics();
+        set.family("geocode_admission_in_use", MetricType::Gauge,
+            "Connections served and lookups running, against their limits.");
+        set.add("geocode_admission_in_use", "{resource=\"connections\"}",
+            static_cast<double>(admitted.connections));
+        set.add("geocode_admission_in_use", "{resource=\"lookups\"}",
+            static_cast<double>(admitted.lookups));
+        set.family("geocode_admission_queue_depth", MetricType::Gauge,
+            "Lookups waiting for admission.");
+        set.add("geocode_admission_queue_depth", "",
+            static_cast<double>(admitted.queued));
+        set.family("geocode_admission_queued_total", MetricType::Counter,
+            "Lookups that waited for admission.");
+        set.add("geocode_admission_queued_total", "",
+            static_cast<double>(admitted.waited));
+        set.family("geocode_shed_total", MetricType::Counter,
+            "Work refused with status 503, by reason.");
+        set.add("geocode_shed_total", "{reason=\"connections\"}",
+            static_cast<double>(admitted.shed_connections));
+        set.add("geocode_shed_total", "{reason=\"queue_full\"}",
+            static_cast<double>(admitted.shed_queue_full));
+        set.add("geocode_shed_total", "{reason=\"queue_timeout\"}",
+            static_cast<double>(admitted.shed_queue_timeout));
+        set.family("geocode_handler_heap_allocations_total",
+            MetricType::Counter,
+            "Handler allocations that did not fit in their arena.");
+        set.add("geocode_handler_heap_allocations_total", "",
+            static_cast<double>(handler_heap_allocations()));
+    }
+
+    void read_seconds(const json& j, const char* name,
+        std::chrono::steady_clock::duration& value)
+    {
+        if (auto it = j.find(name); it != j.end()) {
+            value = std::chrono::seconds(it->get<unsigned int>());
+        }
+    }
+
+    void read_milliseconds(const json& j, const char* name,
+        std::chrono::steady_clock::duration& value)
+    {
+        if (auto it = j.find(name); it != j.end()) {
+            value = std::chrono::milliseconds(it->get<unsigned int>());
+        }
+    }
+
+    // Reads the settings of a backend. Numbers and booleans are kept as they
+    // are written, so that "port": 8443 means "port": "8443".
+    ProtocolSettings read_protocol_settings(const json& j) {
+        ProtocolSettings settings;
+        for (auto& [key, value]: j.items()) {
+            if (value.is_string()) {
+                settings.emplace(key, value.get<std::string>());
+            } else if (value.is_number() || value.is_boolean()) {
+                settings.emplace(key, value.dump());
+            } else {
+                throw std::invalid_argument("Invalid backend configuration. "
+                    "Setting " + key + " must be a string or a number.");
+            }
+        }
+        return settings;
+    }
+}
+
+KeepAliveConfiguration default_keep_alive_config() {
+    return KeepAliveConfiguration {100, std::chrono::seconds(5)};
+}
+
+Threading default_threading() {
+#ifdef SO_REUSEPORT
+    return Threading::PerThread;
+#else
+    return Threading::Shared;
+#endif
+}
+
 ServiceConfiguration load_service_config(const boost::filesystem::path& path) {
     ServiceConfiguration conf {
         boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), 8080),
-        {}
+        default_keep_alive_config(),
+        default_admission_config(),
+        {},
+        default_finder_config(),
+        default_client_config(),
+        default_result_cache_config(),
+        default_disk_cache_config(),
+        default_batch_config(),
+        default_reverse_config(),
+        JsonFormat::Pretty,
+        std::max(std::thread::hardware_concurrency(), 1u),
+        default_threading()
     };
     boost::filesystem::ifstream is(path);
     json j;
@@ -223,32 +1171,235 @@ ServiceConfiguration load_service_config(const boost::filesystem::path& path) {
         conf.endpoint.address(addr);
         conf.endpoint.port(port);
     }
+    auto keep_alive = j.find("keep_alive");
+    if (keep_alive != j.end()) {
+        conf.keep_alive.max_requests = keep_alive->value("max_requests",
+            conf.keep_alive.max_requests);
+        read_seconds(*keep_alive, "idle_timeout_secs",
+            conf.keep_alive.idle_timeout);
+        if (conf.keep_alive.max_requests == 0) {
+            throw std::invalid_argument("Invalid keep-alive configuration. "
+                "max_requests must be positive.");
+        }
+    }
+    if (auto a = j.find("admission"); a != j.end()) {
+        auto& admission = conf.admission;
+        admission.max_connections = a->value("max_connections",
+            admission.max_connections);
+        admission.max_lookups = a->value("max_lookups", admission.max_lookups);
+        admission.max_queued = a->value("max_queued", admission.max_queued);
+        read_milliseconds(*a, "queue_timeout_ms", admission.queue_timeout);
+        if (auto it = a->find("retry_after_secs"); it != a->end()) {
+            admission.retry_after = std::chrono::seconds(
+                it->get<unsigned int>());
+        }
+        if (admission.max_connections == 0 || admission.max_lookups == 0) {
+            throw std::invalid_argument("Invalid admission configuration. "
+                "max_connections and max_lookups must be positive.");
+        }
+    }
     auto finder = j.find("finder");
     if (finder != j.end()) {
         auto protocols = finder->find("protocols");
         if (protocols != finder->end()) {
             for (auto&& protocol: *protocols) {
-                if (auto p = protocol.find("Here"); p != protocol.end()) {
-                    auto app_id = p->at("app_id").get<std::string>();
-                    auto app_code = p->at("app_code").get<std::string>();
-                    ProtocolHere proto(std::move(app_id), std::move(app_code));
-                    conf.protocols.push_back(std::move(proto));
-                } else if (auto p = protocol.find("MapQuest");
-                    p != protocol.end())
-                {
-                    auto key = p->at("key").get<std::string>();
-                    ProtocolMapQuest proto(std::move(key));
-                    conf.protocols.push_back(std::move(proto));
+                for (auto& [name, settings]: protocol.items()) {
+                    auto proto = make_protocol(name,
+                        read_protocol_settings(settings));
+                    if (proto) {conf.protocols.push_back(std::move(*proto));}
                 }
             }
         }
+        if (auto d = finder->find("dispatch"); d != finder->end()) {
+            auto dispatch = d->get<std::string>();
+            if (dispatch == "sequential") {
+                conf.finder.dispatch = Dispatch::Sequential;
+            } else if (dispatch == "hedged") {
+                conf.finder.dispatch = Dispatch::Hedged;
+            } else if (dispatch == "race") {
+                conf.finder.dispatch = Dispatch::Race;
+            } else {
+                throw std::invalid_argument("Invalid dispatch strategy");
+            }
+        }
+        conf.finder.hedge_percentile = finder->value("hedge_percentile",
+            conf.finder.hedge_percentile);
+        read_milliseconds(*finder, "hedge_delay_ms", conf.finder.hedge_delay);
+        if (auto o = finder->find("ordering"); o != finder->end()) {
+            auto ordering = o->get<std::string>();
+            if (ordering == "configured") {
+                conf.finder.ordering = Ordering::Configured;
+            } else if (ordering == "adaptive") {
+                conf.finder.ordering = Ordering::Adaptive;
+            } else {
+                throw std::invalid_argument("Invalid ordering");
+            }
+        }
+        if (auto b = finder->find("breaker"); b != finder->end()) {
+            auto& breaker = conf.finder.breaker;
+            breaker.failure_threshold = b->value("failure_threshold",
+                breaker.failure_threshold);
+            breaker.failure_rate = b->value("failure_rate",
+                breaker.failure_rate);
+            read_seconds(*b, "open_secs", breaker.open_duration);
+        }
+        if (auto t = finder->find("timeouts"); t != finder->end()) {
+            auto& timeouts = conf.client.timeouts;
+            read_milliseconds(*t, "acquire_ms", timeouts.acquire);
+            read_milliseconds(*t, "resolve_ms", timeouts.resolve);
+            read_milliseconds(*t, "connect_ms", timeouts.connect);
+            read_milliseconds(*t, "handshake_ms", timeouts.handshake);
+            read_milliseconds(*t, "write_ms", timeouts.write);
+            read_milliseconds(*t, "read_ms", timeouts.read);
+            read_milliseconds(*t, "shutdown_ms", timeouts.shutdown);
+            read_milliseconds(*t, "total_ms", timeouts.total);
+        }
+        auto pool = finder->find("pool");
+        if (pool != finder->end()) {
+            auto& pool_conf = conf.client.pool;
+            pool_conf.max_idle_per_host = pool->value("max_idle_per_host",
+                pool_conf.max_idle_per_host);
+            pool_conf.max_per_host = pool->value("max_per_host",
+                pool_conf.max_per_host);
+            read_seconds(*pool, "idle_timeout_secs", pool_conf.idle_timeout);
+            if (pool_conf.max_per_host == 0) {
+                throw std::invalid_argument("Invalid pool configuration. "
+                    "max_per_host must be positive.");
+            }
+        }
+        auto dns = finder->find("dns");
+        if (dns != finder->end()) {
+            auto& dns_conf = conf.client.dns;
+            read_seconds(*dns, "ttl_secs", dns_conf.ttl);
+            read_seconds(*dns, "refresh_ahead_secs", dns_conf.refresh_ahead);
+            read_seconds(*dns, "max_stale_secs", dns_conf.max_stale);
+        }
+        if (auto tls = finder->find("tls"); tls != finder->end()) {
+            conf.client.tls.ca_file = tls->value("ca_file",
+                conf.client.tls.ca_file.string());
+        }
+    }
+    auto cache = j.find("cache");
+    if (cache != j.end()) {
+        conf.cache.max_entries = cache->value("max_entries",
+            conf.cache.max_entries);
+        conf.cache.max_bytes = cache->value("max_bytes", conf.cache.max_bytes);
+        conf.cache.shards = cache->value("shards", conf.cache.shards);
+        read_seconds(*cache, "ttl_secs", conf.cache.ttl);
+        read_seconds(*cache, "not_found_ttl_secs", conf.cache.not_found_ttl);
+        if (conf.cache.shards == 0) {
+            throw std::invalid_argument("Invalid cache configuration. "
+                "shards must be positive.");
+        }
+    }
+    auto disk_cache = j.find("disk_cache");
+    if (disk_cache != j.end()) {
+        conf.disk_cache.path = disk_cache->value("path",
+            conf.disk_cache.path.string());
+        if (auto it = disk_cache->find("ttl_secs"); it != disk_cache->end()) {
+            conf.disk_cache.ttl = std::chrono::seconds(
+                it->get<unsigned int>());
+        }
+        read_seconds(*disk_cache, "compaction_interval_secs",
+            conf.disk_cache.compaction_interval);
+    }
+    if (auto f = j.find("response_format"); f != j.end()) {
+        auto format = f->get<std::string>();
+        if (format == "pretty") {
+            conf.response_format = JsonFormat::Pretty;
+        } else if (format == "compact") {
+            conf.response_format = JsonFormat::Compact;
+        } else {
+            throw std::invalid_argument("Invalid response format");
+        }
+    }
+    auto batch = j.find("batch");
+    if (batch != j.end()) {
+        conf.batch.max_locations = batch->value("max_locations",
+            conf.batch.max_locations);
+        conf.batch.concurrency = batch->value("concurrency",
+            conf.batch.concurrency);
+        if (conf.batch.concurrency == 0) {
+            throw std::invalid_argument("Invalid batch configuration. "
+                "concurrency must be positive.");
+        }
+    }
+    if (auto r = j.find("reverse"); r != j.end()) {
+        auto& reverse = conf.reverse;
+        reverse.radius = r->value("radius_m", reverse.radius);
+        reverse.gazetteer = r->value("gazetteer", reverse.gazetteer.string());
+        reverse.disk_cache = r->value("disk_cache", reverse.disk_cache);
+        if (!(reverse.radius >= 0)) {
+            throw std::invalid_argument("Invalid reverse configuration. "
+                "radius_m must not be negative.");
+        }
     }
     return conf;
 }
 
-void run_service(boost::asio::io_context& io_ctx,
-    const ServiceConfiguration& config)
+void run_service(const ServiceConfiguration& config,
+    const boost::filesystem::path& config_path)
 {
-    auto service = Service::make(io_ctx, config);
-    service->run();
+    auto store = std::make_shared<ConfigStore>(config_path, config);
+    auto tls = std::make_shared<TlsContexts>(config.client.tls);
+    std::shared_ptr<ResultCache> cache;
+    if (config.cache.max_entries > 0) {
+        cache = std::make_shared<ResultCache>(config.cache);
+    }
+    std::shared_ptr<DiskCache> disk_cache;
+    if (!config.disk_cache.path.empty()) {
+        disk_cache = std::make_shared<DiskCache>(config.disk_cache);
+    }
+    auto reverse_index = make_reverse_index(config.reverse,
+        disk_cache.get());
+    auto admission = Admission::make(config.admission);
+    auto metrics = std::make_shared<Metrics>();
+    metrics->add_collector([tls, cache, disk_cache, reverse_index,
+        admission] (MetricSet& set)
+    {
+        collect_shared(set, *tls, cache.get(), disk_cache.get(),
+            *reverse_index, *admission);
+    });
+    auto threads = std::max(config.threads, 1u);
+    auto loops = config.threading == Threading::Shared ? 1 : threads;
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    auto conf = config;
+    for (unsigned int i = 0; i < loops; ++i) {
+        auto hint = loops == 1 ? static_cast<int>(threads) : 1;
+        contexts.push_back(std::make_unique<boost::asio::io_context>(hint));
+        auto service = Service::make(*contexts.back(), conf, store, tls,
+            cache, disk_cache, reverse_index, admission, metrics);
+        // The services hold the metrics through their handlers.
+        metrics->add_collector([weak = std::weak_ptr<Service>(service)] (
+            MetricSet& set)
+        {
+            if (auto service = weak.lock()) {service->collect(set);}
+        });
+        // Later acceptors bind to the port picked by the first one.
+        conf.endpoint = service->local_endpoint();
+        service->run();
+    }
+#ifdef SIGHUP
+    boost::asio::signal_set signals(*contexts.front(), SIGHUP);
+    std::function<void(boost::system::error_code, int)> on_signal;
+    on_signal = [&] (boost::system::error_code ec, int) {
+        if (ec) {return;}
+        try {
+            store->reload();
+            std::cout << "Configuration reloaded" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to reload configuration: " << e.what()
+                << std::endl;
+        }
+        signals.async_wait(on_signal);
+    };
+    signals.async_wait(on_signal);
+#endif
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        auto& ioc = *contexts[i % loops];
+        pool.emplace_back([&ioc] {ioc.run();});
+    }
+    contexts.front()->run();
+    for (auto& thread: pool) {thread.join();}
 }
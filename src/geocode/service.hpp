@@ -2,21 +2,56 @@
 
 #pragma once
 
-#include "protocol_here.hpp"
-#include "protocol_mapquest.hpp"
-#include <boost/asio/io_context.hpp>
+#include "admission.hpp"
+#include "batch.hpp"
+#include "client_context.hpp"
+#include "disk_cache.hpp"
+#include "finder.hpp"
+#include "result_cache.hpp"
+#include "result_json.hpp"
+#include "reverse.hpp"
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/filesystem/path.hpp>
-#include <variant>
+#include <chrono>
 #include <vector>
 
-using AnyProtocol = std::variant<ProtocolHere, ProtocolMapQuest>;
+enum class Threading {
+    // Each thread runs its own io_context with its own acceptor, connections
+    // and caches. Requires SO_REUSEPORT.
+    PerThread,
+    // All threads run one io_context with one acceptor. Connections are
+    // handled on strands and caches are synchronized.
+    Shared
+};
+
+struct KeepAliveConfiguration {
+    // Maximum number of requests served on one connection.
+    unsigned int max_requests;
+    // Connections waiting this long for a request are closed.
+    std::chrono::steady_clock::duration idle_timeout;
+};
 
 struct ServiceConfiguration {
     boost::asio::ip::tcp::endpoint endpoint;
+    KeepAliveConfiguration keep_alive;
+    AdmissionConfiguration admission;
     std::vector<AnyProtocol> protocols;
+    FinderConfiguration finder;
+    ClientConfiguration client;
+    ResultCacheConfiguration cache;
+    DiskCacheConfiguration disk_cache;
+    BatchConfiguration batch;
+    ReverseConfiguration reverse;
+    JsonFormat response_format;
+    unsigned int threads;
+    Threading threading;
 };
 
+KeepAliveConfiguration default_keep_alive_config();
+Threading default_threading();
 ServiceConfiguration load_service_config(const boost::filesystem::path& path);
-void run_service(boost::asio::io_context& ioc,
-    const ServiceConfiguration& config);
+// Runs the service on config.threads threads until it stops. The
+// configuration is reloaded from config_path on SIGHUP or on a request to
+// /admin/reload.
+void run_service(const ServiceConfiguration& config,
+    const boost::filesystem::path& config_path);
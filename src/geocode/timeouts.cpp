@@ -0,0 +1,38 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "timeouts.hpp"
+#include <stdexcept>
+
+std::string to_string(ClientStage stage) {
+    switch (stage) {
+    case ClientStage::Acquire: return "Acquire";
+    case ClientStage::Resolve: return "Resolve";
+    case ClientStage::Connect: return "Connect";
+    case ClientStage::Handshake: return "Handshake";
+    case ClientStage::Write: return "Write";
+    case ClientStage::Read: return "Read";
+    case ClientStage::Shutdown: return "Shutdown";
+    }
+    throw std::logic_error("Unreachable");
+}
+
+std::chrono::steady_clock::duration TimeoutConfiguration::stage(
+    ClientStage stage) const
+{
+    switch (stage) {
+    case ClientStage::Acquire: return acquire;
+    case ClientStage::Resolve: return resolve;
+    case ClientStage::Connect: return connect;
+    case ClientStage::Handshake: return handshake;
+    case ClientStage::Write: return write;
+    case ClientStage::Read: return read;
+    case ClientStage::Shutdown: return shutdown;
+    }
+    throw std::logic_error("Unreachable");
+}
+
+TimeoutConfiguration default_timeout_config() {
+    using std::chrono::seconds;
+    return TimeoutConfiguration {seconds(2), seconds(2), seconds(2),
+        seconds(2), seconds(2), seconds(5), seconds(1), seconds(10)};
+}
@@ -0,0 +1,36 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// Stages of a lookup to a backend.
+enum class ClientStage {
+    Acquire,
+    Resolve,
+    Connect,
+    Handshake,
+    Write,
+    Read,
+    Shutdown
+};
+
+std::string to_string(ClientStage stage);
+
+struct TimeoutConfiguration {
+    // Waiting for a connection slot.
+    std::chrono::steady_clock::duration acquire;
+    std::chrono::steady_clock::duration resolve;
+    std::chrono::steady_clock::duration connect;
+    std::chrono::steady_clock::duration handshake;
+    std::chrono::steady_clock::duration write;
+    std::chrono::steady_clock::duration read;
+    std::chrono::steady_clock::duration shutdown;
+    // Whole lookup to one backend, excluding shutdown.
+    std::chrono::steady_clock::duration total;
+
+    std::chrono::steady_clock::duration stage(ClientStage stage) const;
+};
+
+TimeoutConfiguration default_timeout_config();
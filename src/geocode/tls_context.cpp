@@ -0,0 +1,118 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "tls_context.hpp"
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <iterator>
+#include <openssl/ssl.h>
+#include <openssl/x509_vfy.h>
+#include <stdexcept>
+
+struct TlsContexts::Host {
+    Host():
+        context(boost::asio::ssl::context::tlsv12_client),
+        session(nullptr)
+    {}
+
+    ~Host() {
+        // The context would otherwise delete its application data as a
+        // verify callback.
+        SSL_CTX_set_app_data(context.native_handle(), nullptr);
+        if (session) {SSL_SESSION_free(session);}
+    }
+
+    boost::asio::ssl::context context;
+    std::mutex mutex;
+    // Guarded by mutex.
+    SSL_SESSION* session;
+};
+
+TlsConfiguration default_tls_config() {
+    return TlsConfiguration {};
+}
+
+TlsContexts::TlsContexts(const TlsConfiguration& config):
+    resumed(0),
+    full(0)
+{
+    if (config.ca_file.empty()) {return;}
+    boost::filesystem::ifstream is(config.ca_file, std::ios::binary);
+    if (!is) {
+        throw std::runtime_error("Failed to open " + config.ca_file.string());
+    }
+    ca_certificates.assign(std::istreambuf_iterator<char>(is),
+        std::istreambuf_iterator<char>());
+    // Reports invalid certificates now rather than on the first lookup.
+    boost::asio::ssl::context check(boost::asio::ssl::context::tlsv12_client);
+    check.add_certificate_authority(boost::asio::buffer(ca_certificates));
+}
+
+TlsContexts::~TlsContexts() = default;
+
+boost::asio::ssl::context& TlsContexts::context(const std::string& host) {
+    return get_host(host).context;
+}
+
+void TlsContexts::on_handshake(TlsStream& stream) {
+    if (SSL_session_reused(stream.native_handle())) {
+        ++resumed;
+    } else {
+        ++full;
+    }
+}
+
+void TlsContexts::prepare(TlsStream& stream, const std::string& host) {
+    auto ssl = stream.native_handle();
+    boost::system::error_code ec;
+    boost::asio::ip::make_address(host, ec);
+    // Server names are not sent for IP addresses.
+    if (ec && !SSL_set_tlsext_host_name(ssl, host.c_str())) {
+        throw std::runtime_error("Failed to set TLS server name");
+    }
+    if (!ca_certificates.empty()) {
+        auto param = SSL_get0_param(ssl);
+        auto ok = ec ? X509_VERIFY_PARAM_set1_host(param, host.c_str(), 0)
+            : X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+        if (!ok) {
+            throw std::runtime_error("Failed to set expected TLS host");
+        }
+    }
+    auto& h = get_host(host);
+    std::lock_guard<std::mutex> lock(h.mutex);
+    if (h.session) {SSL_set_session(ssl, h.session);}
+}
+
+TlsStatistics TlsContexts::statistics() const {
+    return TlsStatistics {resumed.load(), full.load()};
+}
+
+TlsContexts::Host& TlsContexts::get_host(const std::string& host) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& h = hosts[host];
+    if (!h) {
+        h = std::make_unique<Host>();
+        auto ctx = h->context.native_handle();
+        SSL_CTX_set_app_data(ctx, h.get());
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+            | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+        if (!ca_certificates.empty()) {
+            h->context.add_certificate_authority(
+                boost::asio::buffer(ca_certificates));
+            h->context.set_verify_mode(boost::asio::ssl::verify_peer);
+        }
+    }
+    return *h;
+}
+
+// Called by OpenSSL when a session is established. Takes ownership of the
+// session.
+int TlsContexts::on_new_session(SSL* ssl, SSL_SESSION* session) {
+    auto ctx = SSL_get_SSL_CTX(ssl);
+    auto host = static_cast<Host*>(SSL_CTX_get_app_data(ctx));
+    std::lock_guard<std::mutex> lock(host->mutex);
+    if (host->session) {SSL_SESSION_free(host->session);}
+    host->session = session;
+    return 1;
+}
@@ -0,0 +1,66 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#pragma once
+
+#include <atomic>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/filesystem/path.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <openssl/ssl.h>
+#include <string>
+
+using TlsStream = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
+
+struct TlsConfiguration {
+    // PEM file of the certificate authorities trusted to sign the
+    // certificates of backend services. Certificates are not verified if
+    // empty.
+    boost::filesystem::path ca_file;
+};
+
+TlsConfiguration default_tls_config();
+
+struct TlsStatistics {
+    // Handshakes that resumed a cached session.
+    unsigned long long resumed;
+    // Handshakes that negotiated a new session.
+    unsigned long long full;
+};
+
+// TLS contexts for backend hosts, one per host. The last session negotiated
+// with each host is cached and offered by the next connection to that host
+// so that its handshake can be abbreviated. Safe to share between threads.
+class TlsContexts {
+public:
+    // Throws if the certificate authorities cannot be loaded.
+    explicit TlsContexts(const TlsConfiguration& config);
+    TlsContexts(const TlsContexts&) = delete;
+    TlsContexts& operator=(const TlsContexts&) = delete;
+    ~TlsContexts();
+
+    boost::asio::ssl::context& context(const std::string& host);
+    // Records whether the handshake on stream resumed a session.
+    void on_handshake(TlsStream& stream);
+    // Sets the server name, the name expected in the server certificate and
+    // the cached session, if any, on a new stream.
+    void prepare(TlsStream& stream, const std::string& host);
+    TlsStatistics statistics() const;
+
+private:
+    struct Host;
+
+    Host& get_host(const std::string& host);
+    static int on_new_session(SSL* ssl, SSL_SESSION* session);
+
+private:
+    // PEM certificates of the trusted authorities.
+    std::string ca_certificates;
+    mutable std::mutex mutex;
+    std::map<std::string, std::unique_ptr<Host>> hosts;
+    std::atomic<unsigned long long> resumed;
+    std::atomic<unsigned long long> full;
+};
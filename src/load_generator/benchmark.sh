@@ -0,0 +1,81 @@
+#!/bin/sh
+# Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+#
+# Runs the micro-benchmarks against a mock backend answering at once, then
+# the service against the mock backend and measures it with the load
+# generator, in closed loop and then in open loop.
+#
+# Usage: benchmark.sh <mock backend> <service> <load generator>
+#     <micro-benchmarks> <work dir> [workload]
+#
+# Without a workload, one is generated with a few thousand locations. The
+# environment variables MOCK_ARGS, SERVICE_ARGS, CLOSED_ARGS, OPEN_ARGS and
+# MICRO_ARGS add options to the mock backend, the service, each load
+# generator run and the micro-benchmarks.
+
+set -eu
+
+mock=$1
+service=$2
+load=$3
+micro=$4
+dir=$5
+workload=${6:-}
+
+mkdir -p "$dir"
+if [ -z "$workload" ]; then
+    workload=$dir/workload.txt
+    i=0
+    : > "$workload"
+    while [ $i -lt 5000 ]; do
+        echo "$i Main Street, Springfield" >> "$workload"
+        i=$((i + 1))
+    done
+fi
+
+cat > "$dir/config.json" <<CONFIG
+{
+    "sock_addr": "127.0.0.1:18080",
+    "cache": {"max_entries": 0},
+    "finder": {
+        "tls": {"ca_file": "$dir/mock.pem"},
+        "protocols": [
+            {"MapQuest": {"key": "mock", "host": "localhost",
+                "port": 19443}},
+            {"Here": {"app_id": "mock", "app_code": "mock",
+                "host": "localhost", "port": 19443}}
+        ]
+    }
+}
+CONFIG
+
+service_pid=
+mock_pid=
+cleanup() {
+    kill $service_pid $mock_pid 2> /dev/null || true
+}
+trap cleanup EXIT
+
+"$mock" --address 127.0.0.1:19444 --cert-out "$dir/mock.pem" \
+    --latency-ms 0 &
+mock_pid=$!
+sleep 1
+echo "Micro-benchmarks"
+"$micro" --mock localhost:19444 --ca-file "$dir/mock.pem" ${MICRO_ARGS:-}
+kill $mock_pid
+wait $mock_pid 2> /dev/null || true
+
+"$mock" --address 127.0.0.1:19443 --cert-out "$dir/mock.pem" \
+    --latency-ms 20 --distribution lognormal ${MOCK_ARGS:-} &
+mock_pid=$!
+sleep 1
+"$service" --config "$dir/config.json" ${SERVICE_ARGS:-} &
+service_pid=$!
+sleep 1
+
+echo "Closed loop"
+"$load" --target 127.0.0.1:18080 --workload "$workload" --loop closed \
+    --connections 64 ${CLOSED_ARGS:-}
+echo "Open loop"
+"$load" --target 127.0.0.1:18080 --workload "$workload" --loop open \
+    --connections 256 --rate 2000 ${OPEN_ARGS:-}
@@ -0,0 +1,500 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "geocode/location.hpp"
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    using Request = boost::beast::http::request<
+        boost::beast::http::empty_body>;
+    using Response = boost::beast::http::response<
+        boost::beast::http::string_body>;
+    using Clock = std::chrono::steady_clock;
+
+    // Delay before reconnecting after a failed connection attempt.
+    const std::chrono::milliseconds RECONNECT_DELAY(100);
+
+    enum class Loop {
+        // Each connection sends its next request once the previous one is
+        // answered.
+        Closed,
+        // Requests are sent at random times at a fixed average rate,
+        // whether or not previous requests were answered. Latencies are
+        // measured from the time each request was due, so that a slow
+        // proxy does not hide its queueing delay.
+        Open
+    };
+
+    struct LoadConfiguration {
+        boost::asio::ip::tcp::endpoint target;
+        Loop loop;
+        unsigned int connections;
+        // Requests per second over all connections, in open loop.
+        double rate;
+        // Requests completed during the warmup are not measured.
+        Clock::time_point measure_start;
+        Clock::time_point end;
+    };
+
+    // Request targets, replayed in order and then over again.
+    class Workload {
+    public:
+        explicit Workload(std::vector<std::string> targets):
+            targets(std::move(targets)),
+            next_index(0)
+        {
+            if (this->targets.empty()) {
+                throw std::runtime_error("Empty workload");
+            }
+        }
+
+        const std::string& next() {
+            auto i = next_index.fetch_add(1, std::memory_order_relaxed);
+            return targets[i % targets.size()];
+        }
+
+    private:
+        std::vector<std::string> targets;
+        std::atomic<std::size_t> next_index;
+    };
+
+    struct ConnectionStats {
+        std::vector<std::uint32_t> latencies_us;
+        std::uint64_t errors = 0;
+    };
+
+    class Connection: public std::enable_shared_from_this<Connection> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit Connection(boost::asio::io_context& ioc,
+            const LoadConfiguration& config, Workload& workload,
+            ConnectionStats& stats, Priv
+        ):
+            socket(ioc),
+            timer(ioc),
+            config(config),
+            workload(workload),
+            stats(stats),
+            random(std::random_device {}()),
+            connected(false)
+        {}
+
+        static std::shared_ptr<Connection> make(boost::asio::io_context& ioc,
+            const LoadConfiguration& config, Workload& workload,
+            ConnectionStats& stats)
+        {
+            return std::make_shared<Connection>(ioc, config, workload, stats,
+                Priv {});
+        }
+
+        void run() {
+            due = Clock::now();
+            schedule();
+        }
+
+    private:
+        void connect(Clock::time_point scheduled) {
+            auto this_ = shared_from_this();
+            boost::system::error_code ec;
+            socket.close(ec);
+            socket.async_connect(config.target, [this_, scheduled] (
+                boost::system::error_code ec)
+            {
+                if (ec) {
+                    this_->record_error();
+                    this_->timer.expires_after(RECONNECT_DELAY);
+                    this_->timer.async_wait([this_] (
+                        boost::system::error_code)
+                    {
+                        this_->schedule();
+                    });
+                    return;
+                }
+                this_->connected = true;
+                boost::asio::ip::tcp::no_delay no_delay(true);
+                this_->socket.set_option(no_delay, ec);
+                this_->send(scheduled);
+            });
+        }
+
+        void on_response(Clock::time_point scheduled,
+            boost::system::error_code ec)
+        {
+            auto now = Clock::now();
+            if (ec) {
+                connected = false;
+                record_error();
+                schedule();
+                return;
+            }
+            if (now >= config.measure_start && now < config.end) {
+                // Lookups that failed are answered with an Err object.
+                if (response.result() != boost::beast::http::status::ok
+                    || response.body().find("\"Err\"") != std::string::npos)
+                {
+                    ++stats.errors;
+                } else {
+                    auto us = std::chrono::duration_cast<
+                        std::chrono::microseconds>(now - scheduled).count();
+                    stats.latencies_us.push_back(static_cast<std::uint32_t>(
+                        std::min<long long>(us, UINT32_MAX)));
+                }
+            }
+            if (!response.keep_alive()) {connected = false;}
+            schedule();
+        }
+
+        void record_error() {
+            auto now = Clock::now();
+            if (now >= config.measure_start && now < config.end) {
+                ++stats.errors;
+            }
+        }
+
+        // Sends the next request when it is due, until the end of the run.
+        void schedule() {
+            auto this_ = shared_from_this();
+            auto now = Clock::now();
+            if (config.loop == Loop::Closed) {
+                due = now;
+            } else {
+                auto mean = config.connections / config.rate;
+                due += std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(
+                    std::exponential_distribution<double>(1 / mean)(random)));
+            }
+            if (due >= config.end || now >= config.end) {
+                boost::system::error_code ec;
+                socket.close(ec);
+                return;
+            }
+            if (due <= now) {
+                start(due);
+                return;
+            }
+            timer.expires_at(due);
+            timer.async_wait([this_, due = due] (boost::system::error_code) {
+                this_->start(due);
+            });
+        }
+
+        void send(Clock::time_point scheduled) {
+            auto this_ = shared_from_this();
+            request = {};
+            request.method(boost::beast::http::verb::get);
+            request.target(workload.next());
+            request.version(11);
+            request.set(boost::beast::http::field::host, "localhost");
+            request.keep_alive(true);
+            boost::beast::http::async_write(socket, request, [this_,
+                scheduled] (boost::system::error_code ec, std::size_t)
+            {
+                if (ec) {
+                    this_->on_response(scheduled, ec);
+                    return;
+                }
+                this_->response = {};
+                boost::beast::http::async_read(this_->socket, this_->buffer,
+                    this_->response, [this_, scheduled] (
+                        boost::system::error_code ec, std::size_t)
+                    {
+                        this_->on_response(scheduled, ec);
+                    });
+            });
+        }
+
+        void start(Clock::time_point scheduled) {
+            if (!connected) {
+                buffer.consume(buffer.size());
+                connect(scheduled);
+                return;
+            }
+            send(scheduled);
+        }
+
+    private:
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::steady_timer timer;
+        const LoadConfiguration& config;
+        Workload& workload;
+        ConnectionStats& stats;
+        std::mt19937_64 random;
+        // When the next request is due.
+        Clock::time_point due;
+        bool connected;
+        boost::beast::flat_buffer buffer;
+        Request request;
+        Response response;
+    };
+
+    // Reads one location per line: a JSON string, a JSON object with a
+    // location or address member, or plain text.
+    std::vector<std::string> read_workload(
+        const boost::filesystem::path& path)
+    {
+        boost::filesystem::ifstream is(path);
+        if (!is) {throw std::runtime_error("Failed to open " + path.string());}
+        std::vector<std::string> targets;
+        std::string line;
+        while (std::getline(is, line)) {
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == line.npos) {continue;}
+            std::string location;
+            if (line[first] == '"' || line[first] == '{') {
+                auto j = json::parse(line);
+                if (j.is_string()) {
+                    location = j.get<std::string>();
+                } else if (j.count("location")) {
+                    location = j.at("location").get<std::string>();
+                } else {
+                    location = j.at("address").get<std::string>();
+                }
+            } else {
+                location = line.substr(first, line.find_last_not_of(" \t\r")
+                    - first + 1);
+            }
+            targets.push_back("/geocode?location="
+                + encode_location(location));
+        }
+        return targets;
+    }
+
+    // Counters of the proxy that are reported per request, if it exports
+    // them.
+    struct ProxyCounters {
+        std::optional<double> cpu_seconds;
+        std::optional<double> allocations;
+    };
+
+    std::optional<double> read_sample(std::string_view metrics,
+        std::string_view name)
+    {
+        std::size_t pos = 0;
+        while (pos < metrics.size()) {
+            auto end = metrics.find('\n', pos);
+            if (end == metrics.npos) {end = metrics.size();}
+            auto line = metrics.substr(pos, end - pos);
+            pos = end + 1;
+            if (line.size() <= name.size() || line.substr(0, name.size())
+                != name || line[name.size()] != ' ')
+            {
+                continue;
+            }
+            auto value = line.substr(name.size() + 1);
+            double v = 0;
+            auto [ptr, err] = std::from_chars(value.data(),
+                value.data() + value.size(), v);
+            if (err != std::errc()) {return std::nullopt;}
+            return v;
+        }
+        return std::nullopt;
+    }
+
+    ProxyCounters scrape(const boost::asio::ip::tcp::endpoint& target) {
+        try {
+            boost::asio::io_context ioc;
+            boost::asio::ip::tcp::socket socket(ioc);
+            socket.connect(target);
+            Request request(boost::beast::http::verb::get, "/metrics", 11);
+            request.set(boost::beast::http::field::host, "localhost");
+            request.keep_alive(false);
+            boost::beast::http::write(socket, request);
+            boost::beast::flat_buffer buffer;
+            Response response;
+            boost::beast::http::read(socket, buffer, response);
+            if (response.result() != boost::beast::http::status::ok) {
+                return {};
+            }
+            return ProxyCounters {
+                read_sample(response.body(), "process_cpu_seconds_total"),
+                read_sample(response.body(), "geocode_heap_allocations_total")
+            };
+        } catch (const std::exception&) {
+            return {};
+        }
+    }
+
+    boost::asio::ip::tcp::endpoint parse_endpoint(const std::string& s) {
+        auto sep = s.find_last_of(':');
+        if (sep == std::string::npos) {
+            throw std::invalid_argument("Invalid address. Missing colon "
+                "and port.");
+        }
+        return boost::asio::ip::tcp::endpoint(
+            boost::asio::ip::make_address(s.substr(0, sep)),
+            static_cast<unsigned short>(std::stoul(s.substr(sep + 1))));
+    }
+
+    void report(std::vector<ConnectionStats>& stats, double seconds,
+        const ProxyCounters& before, const ProxyCounters& after)
+    {
+        std::vector<std::uint32_t> latencies;
+        std::uint64_t errors = 0;
+        for (auto& s: stats) {
+            latencies.insert(latencies.end(), s.latencies_us.begin(),
+                s.latencies_us.end());
+            errors += s.errors;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto count = latencies.size();
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "Requests: " << count << " ok, " << errors
+            << " failed in " << seconds << " s\n";
+        std::cout << "Throughput: " << count / seconds << " requests/s\n";
+        auto percentile = [&] (double p) {
+            if (latencies.empty()) {return 0.0;}
+            auto rank = static_cast<std::size_t>(p / 100
+                * static_cast<double>(count - 1) + 0.5);
+            return latencies[rank] / 1e3;
+        };
+        std::cout << "Latency (ms): p50 " << percentile(50) << ", p99 "
+            << percentile(99) << ", p99.9 " << percentile(99.9) << ", max "
+            << percentile(100) << "\n";
+        auto per_request = [&] (const std::optional<double>& b,
+            const std::optional<double>& a, double scale)
+        {
+            if (!a || !b || count + errors == 0) {return std::string("n/a");}
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(3)
+                << (*a - *b) * scale / static_cast<double>(count + errors);
+            return os.str();
+        };
+        std::cout << "Proxy CPU per request (us): " << per_request(
+            before.cpu_seconds, after.cpu_seconds, 1e6) << "\n";
+        std::cout << "Proxy allocations per request: " << per_request(
+            before.allocations, after.allocations, 1) << std::endl;
+    }
+
+    void print_help_header() {
+        auto help = "Load generator for the geocoding service\n\n"
+            "Usage: geocode_load_generator [OPTIONS] --workload=<FILE>\n\n"
+            "Sends geocode requests for the locations of the workload and "
+            "reports the\nthroughput and latencies. CPU time and allocations "
+            "per request are read from\nthe metrics of the service when it "
+            "exports them.\n";
+        std::cout << help << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        boost::program_options::options_description options("Options");
+        options.add_options()
+            ("connections,c", boost::program_options::value<unsigned int>()
+                ->default_value(16),
+                "Number of connections")
+            ("duration,d", boost::program_options::value<double>()
+                ->default_value(10),
+                "Measured duration in seconds")
+            ("help,h", "Display help message")
+            ("loop", boost::program_options::value<std::string>()
+                ->default_value("closed"),
+                "\"closed\" sends a request once the previous one on the "
+                "connection is answered, \"open\" sends requests at --rate")
+            ("rate,r", boost::program_options::value<double>()
+                ->default_value(1000),
+                "Requests per second in open loop")
+            ("target,a", boost::program_options::value<std::string>()
+                ->default_value("127.0.0.1:8080"),
+                "Address and port of the service")
+            ("threads,t", boost::program_options::value<unsigned int>()
+                ->default_value(1),
+                "Number of threads")
+            ("warmup", boost::program_options::value<double>()
+                ->default_value(1),
+                "Unmeasured duration in seconds before the measures")
+            ("workload,w", boost::program_options::value<std::string>(),
+                "File of locations, one per line");
+        boost::program_options::variables_map vm;
+        boost::program_options::store(
+            boost::program_options::parse_command_line(argc, argv, options),
+            vm);
+        boost::program_options::notify(vm);
+        if (vm.count("help")) {
+            print_help_header();
+            std::cout << options << std::endl;
+            return 0;
+        }
+        if (!vm.count("workload")) {
+            std::cerr << "Missing \"workload\" parameter" << std::endl;
+            return 1;
+        }
+        Workload workload(read_workload(vm["workload"].as<std::string>()));
+        LoadConfiguration config {
+            parse_endpoint(vm["target"].as<std::string>()),
+            Loop::Closed,
+            std::max(vm["connections"].as<unsigned int>(), 1u),
+            vm["rate"].as<double>(),
+            {},
+            {}
+        };
+        auto loop = vm["loop"].as<std::string>();
+        if (loop == "open") {
+            config.loop = Loop::Open;
+        } else if (loop != "closed") {
+            std::cerr << "Invalid \"loop\" parameter" << std::endl;
+            return 1;
+        }
+        if (config.rate <= 0) {
+            std::cerr << "Invalid \"rate\" parameter" << std::endl;
+            return 1;
+        }
+        auto seconds = [] (double s) {
+            return std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(s));
+        };
+        auto duration = vm["duration"].as<double>();
+        config.measure_start = Clock::now()
+            + seconds(vm["warmup"].as<double>());
+        config.end = config.measure_start + seconds(duration);
+        auto threads = std::max(vm["threads"].as<unsigned int>(), 1u);
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+        for (unsigned int i = 0; i < threads; ++i) {
+            contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        }
+        std::vector<ConnectionStats> stats(config.connections);
+        for (unsigned int i = 0; i < config.connections; ++i) {
+            Connection::make(*contexts[i % threads], config, workload,
+                stats[i])->run();
+        }
+        std::vector<std::thread> pool;
+        for (auto& ioc: contexts) {
+            pool.emplace_back([&ioc] {ioc->run();});
+        }
+        std::this_thread::sleep_until(config.measure_start);
+        auto before = scrape(config.target);
+        std::this_thread::sleep_until(config.end);
+        auto after = scrape(config.target);
+        for (auto& thread: pool) {thread.join();}
+        report(stats, duration, before, after);
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Exiting with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
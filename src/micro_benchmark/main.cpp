@@ -0,0 +1,276 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "geocode/client.hpp"
+#include "geocode/metrics.hpp"
+#include "geocode/protocol_mapquest.hpp"
+#include "geocode/result_json.hpp"
+#include <boost/asio/io_context.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // Cost of an operation.
+    struct Measure {
+        double ns;
+        // Nothing unless allocations are counted.
+        std::optional<double> allocations;
+    };
+
+    void print_help_header() {
+        auto help = "Micro-benchmarks of the geocoding service\n\n"
+            "Usage: geocode_micro_benchmark [OPTIONS]\n\n"
+            "Measures the time and allocations per serialized response, "
+            "with the JSON\ndocuments used before and with the result "
+            "writer. When built with\nGEOCODE_COROUTINES and given a mock "
+            "backend, also measures backend lookups\nrun as coroutines and "
+            "as chained callbacks. Allocations are counted when\nbuilt with "
+            "GEOCODE_COUNT_ALLOCATIONS.\n";
+        std::cout << help << std::endl;
+    }
+
+    // Runs op iterations times and divides its cost among them.
+    template <typename Op>
+    Measure measure(std::size_t iterations, Op op) {
+        auto allocations = heap_allocations();
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {op(i);}
+        auto elapsed = Clock::now() - start;
+        Measure m {std::chrono::duration<double, std::nano>(elapsed).count()
+            / static_cast<double>(iterations), std::nullopt};
+        if (auto after = heap_allocations()) {
+            m.allocations = static_cast<double>(*after - *allocations)
+                / static_cast<double>(iterations);
+        }
+        return m;
+    }
+
+    void print_row(const std::string& name, const Measure& m) {
+        std::cout << "  " << std::left << std::setw(28) << name << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << m.ns
+            << " ns";
+        if (m.allocations) {
+            std::cout << std::setw(10) << *m.allocations << " allocations";
+        }
+        std::cout << std::endl;
+    }
+
+    // Responses as they were serialized before the result writer.
+    json dom_json(const ProtocolResult& result) {
+        if (auto e = std::get_if<Error>(&result)) {
+            return {
+                {"Err", {
+                    {"kind", to_string(e->kind)},
+                    {"cause", {e->cause}}
+                }}
+            };
+        }
+        const auto& coords = std::get<Coordinates>(result);
+        return {
+            {"Ok", {
+                {"latitude", coords.latitude},
+                {"longitude", coords.longitude}
+            }}
+        };
+    }
+
+    // Measures the serialization of the body of a response, reusing the
+    // body as a connection does.
+    void bench_serialization(std::size_t iterations) {
+        std::cout << "Serialization, per response:" << std::endl;
+        const ProtocolResult results[] = {
+            Coordinates {49.2801599, -123.1147572},
+            Error {ErrorKind::LocationNotFound, "No match"}
+        };
+        const char* names[] = {"success", "error"};
+        std::string body;
+        for (std::size_t r = 0; r < 2; ++r) {
+            const auto& result = results[r];
+            std::string name = names[r];
+            print_row("dom dump(2), " + name, measure(iterations,
+                [&] (std::size_t) {
+                    body.assign(dom_json(result).dump(2));
+                }));
+            print_row("writer pretty, " + name, measure(iterations,
+                [&] (std::size_t) {
+                    body.clear();
+                    append_result_json(body, result, JsonFormat::Pretty);
+                }));
+            print_row("writer compact, " + name, measure(iterations,
+                [&] (std::size_t) {
+                    body.clear();
+                    append_result_json(body, result, JsonFormat::Compact);
+                }));
+        }
+    }
+
+#ifdef GEOCODE_COROUTINES
+    // Runs lookups one after the other and records their latencies.
+    template <typename Start>
+    class LookupDriver {
+    public:
+        explicit LookupDriver(Start start, std::size_t count):
+            start(std::move(start)),
+            count(count),
+            started(0),
+            failures(0)
+        {
+            latencies.reserve(count);
+        }
+
+        void next() {
+            if (started == count) {return;}
+            // Short enough to need no allocation.
+            auto location = std::to_string(started++);
+            begin = Clock::now();
+            start(std::move(location), [this] (ProtocolResult result) {
+                latencies.push_back(std::chrono::duration<double, std::micro>(
+                    Clock::now() - begin).count());
+                if (std::holds_alternative<Error>(result)) {++failures;}
+                next();
+            });
+        }
+
+        std::vector<double>& results() {return latencies;}
+        std::size_t failed() const {return failures;}
+
+    private:
+        Start start;
+        std::size_t count;
+        std::size_t started;
+        std::size_t failures;
+        Clock::time_point begin;
+        std::vector<double> latencies;
+    };
+
+    template <typename Start>
+    void measure_lookups(const std::string& name, boost::asio::io_context& ioc,
+        Start start, std::size_t warmup, std::size_t count)
+    {
+        LookupDriver<Start> warm(start, warmup);
+        warm.next();
+        ioc.restart();
+        ioc.run();
+        LookupDriver<Start> driver(start, count);
+        auto allocations = heap_allocations();
+        driver.next();
+        ioc.restart();
+        ioc.run();
+        auto after = heap_allocations();
+        auto& latencies = driver.results();
+        std::sort(latencies.begin(), latencies.end());
+        double total = 0;
+        for (auto l: latencies) {total += l;}
+        auto at = [&] (double q) {
+            return latencies[std::min(latencies.size() - 1,
+                static_cast<std::size_t>(q * latencies.size()))];
+        };
+        std::cout << "  " << std::left << std::setw(12) << name << std::right
+            << std::fixed << std::setprecision(1) << " mean "
+            << total / latencies.size() << " us, p50 " << at(0.5)
+            << " us, p99 " << at(0.99) << " us";
+        if (after) {
+            std::cout << ", " << static_cast<double>(*after - *allocations)
+                / static_cast<double>(count) << " allocations";
+        }
+        std::cout << ", " << driver.failed() << " failed" << std::endl;
+    }
+
+    // Looks up locations with MapQuest on the mock backend, one at a time.
+    // The idle connection is reused, so that the lookups measure the client
+    // rather than handshakes.
+    void bench_lookups(const std::string& mock, const std::string& ca_file,
+        std::size_t count)
+    {
+        auto colon = mock.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("Invalid mock address");
+        }
+        boost::asio::io_context ioc(1);
+        auto config = default_client_config();
+        config.tls.ca_file = ca_file;
+        auto context = std::make_shared<ClientContext>(ioc, config,
+            std::make_shared<TlsContexts>(config.tls), false);
+        auto protocol = std::make_shared<const Protocol<MapQuest>>(
+            ProtocolSettings {{"key", "mock"},
+            {"host", mock.substr(0, colon)},
+            {"port", mock.substr(colon + 1)}});
+        std::cout << "Lookups on " << mock << ", per lookup:" << std::endl;
+        auto warmup = std::max<std::size_t>(count / 10, 1);
+        measure_lookups("callbacks", ioc, [&] (std::string location,
+            auto cont)
+        {
+            make_client(context, protocol, std::move(location),
+                std::move(cont))->run();
+        }, warmup, count);
+        measure_lookups("coroutines", ioc, [&] (std::string location,
+            auto cont)
+        {
+            CoroClient<Protocol<MapQuest>, decltype(cont)>::make(context,
+                protocol, std::move(location), std::move(cont))->run();
+        }, warmup, count);
+    }
+#endif
+}
+
+int main(int argc, char** argv) {
+    try {
+        boost::program_options::options_description options("Options");
+        options.add_options()
+            ("ca-file", boost::program_options::value<std::string>(),
+                "Certificate of the mock backend")
+            ("help,h", "Display help message")
+            ("iterations,n", boost::program_options::value<std::size_t>()
+                ->default_value(1000000),
+                "Serializations per measure")
+            ("lookups,l", boost::program_options::value<std::size_t>()
+                ->default_value(10000),
+                "Lookups per measure")
+            ("mock,m", boost::program_options::value<std::string>(),
+                "Host and port of the mock backend");
+        boost::program_options::variables_map vm;
+        boost::program_options::store(
+            boost::program_options::parse_command_line(argc, argv, options),
+            vm);
+        boost::program_options::notify(vm);
+        if (vm.count("help")) {
+            print_help_header();
+            std::cout << options << std::endl;
+            return 0;
+        }
+        if (!heap_allocations()) {
+            std::cout << "Allocations are not counted" << std::endl;
+        }
+        bench_serialization(std::max<std::size_t>(
+            vm["iterations"].as<std::size_t>(), 1));
+        if (!vm.count("mock")) {return 0;}
+#ifdef GEOCODE_COROUTINES
+        auto ca_file = vm.count("ca-file")
+            ? vm["ca-file"].as<std::string>() : std::string();
+        bench_lookups(vm["mock"].as<std::string>(), ca_file,
+            std::max<std::size_t>(vm["lookups"].as<std::size_t>(), 1));
+#else
+        std::cout << "Lookups are compared when built with "
+            "GEOCODE_COROUTINES" << std::endl;
+#endif
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Exiting with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
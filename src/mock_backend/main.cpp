@@ -0,0 +1,648 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+#include "geocode/location.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    using Request = boost::beast::http::request<
+        boost::beast::http::string_body>;
+    using Response = boost::beast::http::response<
+        boost::beast::http::string_body>;
+    using TlsStream = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
+
+    enum class Distribution {
+        Fixed,
+        Exponential,
+        LogNormal
+    };
+
+    // Shape of the response bodies. Auto picks the shape matching the
+    // request target.
+    enum class Shape {
+        Auto,
+        Here,
+        MapQuest
+    };
+
+    struct MockConfiguration {
+        std::chrono::duration<double, std::milli> latency;
+        Distribution distribution;
+        // Standard deviation of the logarithm of log-normal latencies.
+        double sigma;
+        // Fractions of the requests answered with an error status, of those
+        // answered with status 429, and of the locations not found.
+        double error_rate;
+        double throttle_rate;
+        double not_found_rate;
+        // Minimum size of the response bodies, reached by padding them.
+        std::size_t response_bytes;
+        Shape shape;
+    };
+
+    // Frees an OpenSSL object.
+    template <typename T, void (*Free)(T*)>
+    struct OpenSslDeleter {
+        void operator()(T* p) const {Free(p);}
+    };
+
+    using PkeyPtr = std::unique_ptr<EVP_PKEY,
+        OpenSslDeleter<EVP_PKEY, EVP_PKEY_free>>;
+    using PkeyCtxPtr = std::unique_ptr<EVP_PKEY_CTX,
+        OpenSslDeleter<EVP_PKEY_CTX, EVP_PKEY_CTX_free>>;
+    using X509Ptr = std::unique_ptr<X509, OpenSslDeleter<X509, X509_free>>;
+    using X509ExtPtr = std::unique_ptr<X509_EXTENSION,
+        OpenSslDeleter<X509_EXTENSION, X509_EXTENSION_free>>;
+    using BioPtr = std::unique_ptr<BIO, OpenSslDeleter<BIO, BIO_free_all>>;
+
+    struct Certificate {
+        // PEM encoded.
+        std::string certificate;
+        std::string private_key;
+    };
+
+    void check(int ok, const char* what) {
+        if (ok <= 0) {throw std::runtime_error(what);}
+    }
+
+    template <typename Write>
+    std::string to_pem(Write write) {
+        BioPtr bio(BIO_new(BIO_s_mem()));
+        if (!bio) {throw std::runtime_error("Failed to allocate BIO");}
+        check(write(bio.get()), "Failed to write PEM");
+        char* data = nullptr;
+        auto size = BIO_get_mem_data(bio.get(), &data);
+        return std::string(data, static_cast<std::size_t>(size));
+    }
+
+    // Makes a self-signed certificate for the given subject alternative
+    // names, such as "DNS:localhost,IP:127.0.0.1".
+    Certificate make_certificate(const std::string& names) {
+        PkeyCtxPtr ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr));
+        if (!ctx) {throw std::runtime_error("Failed to allocate key");}
+        check(EVP_PKEY_keygen_init(ctx.get()), "Failed to generate key");
+        check(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(),
+            NID_X9_62_prime256v1), "Failed to generate key");
+        EVP_PKEY* raw_key = nullptr;
+        check(EVP_PKEY_keygen(ctx.get(), &raw_key), "Failed to generate key");
+        PkeyPtr key(raw_key);
+        X509Ptr cert(X509_new());
+        if (!cert) {throw std::runtime_error("Failed to allocate X509");}
+        check(X509_set_version(cert.get(), 2), "Failed to set version");
+        check(ASN1_INTEGER_set(X509_get_serialNumber(cert.get()),
+            static_cast<long>(std::random_device()() & 0x7fffffff)),
+            "Failed to set serial number");
+        X509_gmtime_adj(X509_getm_notBefore(cert.get()), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(cert.get()), 30L * 24 * 3600);
+        check(X509_set_pubkey(cert.get(), key.get()), "Failed to set key");
+        auto name = X509_get_subject_name(cert.get());
+        const unsigned char common_name[] = "geocode mock backend";
+        check(X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+            common_name, -1, -1, 0), "Failed to set subject");
+        check(X509_set_issuer_name(cert.get(), name), "Failed to set issuer");
+        X509V3_CTX ext_ctx;
+        X509V3_set_ctx_nodb(&ext_ctx);
+        X509V3_set_ctx(&ext_ctx, cert.get(), cert.get(), nullptr, nullptr, 0);
+        for (auto [nid, value]: {
+            std::make_pair(NID_subject_alt_name, names),
+            std::make_pair(NID_basic_constraints, std::string("CA:FALSE"))})
+        {
+            X509ExtPtr ext(X509V3_EXT_conf_nid(nullptr, &ext_ctx, nid,
+                value.c_str()));
+            if (!ext) {throw std::runtime_error("Invalid certificate names");}
+            check(X509_add_ext(cert.get(), ext.get(), -1),
+                "Failed to add extension");
+        }
+        check(X509_sign(cert.get(), key.get(), EVP_sha256()),
+            "Failed to sign certificate");
+        return Certificate {
+            to_pem([&] (BIO* bio) {return PEM_write_bio_X509(bio,
+                cert.get());}),
+            to_pem([&] (BIO* bio) {return PEM_write_bio_PrivateKey(bio,
+                key.get(), nullptr, nullptr, 0, nullptr, nullptr);})
+        };
+    }
+
+    std::uint64_t hash_location(std::string_view location) {
+        // FNV-1a.
+        std::uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c: location) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Coordinates derived from the location, so that they are stable
+    // across requests. Returns nothing for the fraction of locations that
+    // are not found.
+    std::optional<std::pair<double, double>> locate(std::string_view location,
+        double not_found_rate)
+    {
+        auto hash = hash_location(normalize_location(location));
+        auto unit = [] (std::uint64_t bits) {
+            return static_cast<double>(bits & 0xfffff) / 0x100000;
+        };
+        if (unit(hash) < not_found_rate) {return std::nullopt;}
+        return std::make_pair(unit(hash >> 20) * 160 - 80,
+            unit(hash >> 40) * 360 - 180);
+    }
+
+    // Value of a query string parameter, still URL-encoded.
+    std::string_view query_parameter(std::string_view target,
+        std::string_view name)
+    {
+        auto query = target.find('?');
+        if (query == target.npos) {return {};}
+        auto rest = target.substr(query + 1);
+        while (!rest.empty()) {
+            auto param = rest.substr(0, rest.find('&'));
+            rest.remove_prefix(std::min(param.size() + 1, rest.size()));
+            if (param.size() > name.size() && param[name.size()] == '='
+                && param.substr(0, name.size()) == name)
+            {
+                return param.substr(name.size() + 1);
+            }
+        }
+        return {};
+    }
+
+    // Point of a reverse geocoding request, given as "lat,lon".
+    std::optional<std::pair<double, double>> read_point(std::string_view point)
+    {
+        auto comma = point.find(',');
+        if (comma == point.npos) {return std::nullopt;}
+        std::pair<double, double> at;
+        auto first = point.data();
+        auto last = point.data() + point.size();
+        if (std::from_chars(first, first + comma, at.first).ec != std::errc()
+            || std::from_chars(first + comma + 1, last, at.second).ec
+            != std::errc())
+        {
+            return std::nullopt;
+        }
+        return at;
+    }
+
+    // Place near a point, a little to its north, with a made up address.
+    // Returns nothing for the fraction of points that are not found.
+    std::optional<std::pair<double, double>> place_near(
+        std::string_view point, double not_found_rate)
+    {
+        auto at = read_point(point);
+        if (!at || locate(point, not_found_rate) == std::nullopt) {
+            return std::nullopt;
+        }
+        at->first = std::min(at->first + 0.0001, 90.0);
+        return at;
+    }
+
+    std::string mock_street(std::string_view point) {
+        return std::to_string(hash_location(point) % 1000 + 1)
+            + " Mock Street";
+    }
+
+    json mapquest_result(const std::optional<std::pair<double, double>>& at) {
+        auto locations = json::array();
+        if (at) {
+            locations.push_back({{"latLng", {{"lat", at->first},
+                {"lng", at->second}}}});
+        }
+        return {{"locations", std::move(locations)}};
+    }
+
+    json mapquest_reverse(std::string_view point,
+        const std::optional<std::pair<double, double>>& at)
+    {
+        auto locations = json::array();
+        if (at) {
+            locations.push_back({{"street", mock_street(point)},
+                {"adminArea5", "Mockville"}, {"adminArea1", "MK"},
+                {"latLng", {{"lat", at->first}, {"lng", at->second}}}});
+        }
+        return {{"results", {{{"locations", std::move(locations)}}}}};
+    }
+
+    json here_reverse(std::string_view point,
+        const std::optional<std::pair<double, double>>& at)
+    {
+        auto view = json::array();
+        if (at) {
+            json location = {
+                {"Address", {{"Label", mock_street(point) + ", Mockville"}}},
+                {"DisplayPosition", {{"Latitude", at->first},
+                    {"Longitude", at->second}}}};
+            view.push_back({{"Result", {{{"Location", location}}}}});
+        }
+        return {{"Response", {{"View", std::move(view)}}}};
+    }
+
+    json here_body(const std::optional<std::pair<double, double>>& at) {
+        auto view = json::array();
+        if (at) {
+            view.push_back({{"Result", {{{"Location", {{"DisplayPosition", {
+                {"Latitude", at->first}, {"Longitude", at->second}}}}}}}}});
+        }
+        return {{"Response", {{"View", std::move(view)}}}};
+    }
+
+    // Pads the body with a member ignored by the proxy, placed first so
+    // that it is skipped before the results are read.
+    std::string pad(const json& body, std::size_t size) {
+        auto text = body.dump();
+        if (text.size() >= size) {return text;}
+        const std::string member = "\"padding\":\"\",";
+        auto padding = size - text.size() < member.size() ? 0
+            : size - text.size() - member.size();
+        return "{\"padding\":\"" + std::string(padding, 'x') + "\","
+            + text.substr(1);
+    }
+
+    class Session: public std::enable_shared_from_this<Session> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit Session(boost::asio::ip::tcp::socket socket,
+            boost::asio::ssl::context& tls, const MockConfiguration& config,
+            Priv
+        ):
+            stream(std::move(socket), tls),
+            timer(stream.get_executor()),
+            config(config)
+        {}
+
+        static std::shared_ptr<Session> make(
+            boost::asio::ip::tcp::socket socket,
+            boost::asio::ssl::context& tls, const MockConfiguration& config)
+        {
+            return std::make_shared<Session>(std::move(socket), tls, config,
+                Priv {});
+        }
+
+        void run() {
+            auto this_ = shared_from_this();
+            stream.async_handshake(boost::asio::ssl::stream_base::server,
+                [this_] (boost::system::error_code ec) {
+                    if (!ec) {this_->read_request();}
+                });
+        }
+
+    private:
+        std::chrono::steady_clock::duration delay() {
+            thread_local std::mt19937_64 random(std::random_device {}());
+            auto mean = config.latency.count();
+            double ms = mean;
+            switch (config.distribution) {
+            case Distribution::Fixed:
+                break;
+            case Distribution::Exponential:
+                ms = mean <= 0 ? 0
+                    : std::exponential_distribution<double>(1 / mean)(random);
+                break;
+            case Distribution::LogNormal:
+                // The median is the configured latency.
+                ms = mean <= 0 ? 0 : std::lognormal_distribution<double>(
+                    std::log(mean), config.sigma)(random);
+                break;
+            }
+            return std::chrono::duration_cast<
+                std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::milli>(ms));
+        }
+
+        // Status of a response failing on purpose, if this one does.
+        std::optional<boost::beast::http::status> fail() {
+            thread_local std::mt19937_64 random(std::random_device {}());
+            auto draw = std::uniform_real_distribution<double>()(random);
+            if (draw < config.error_rate) {
+                return boost::beast::http::status::internal_server_error;
+            }
+            if (draw < config.error_rate + config.throttle_rate) {
+                return boost::beast::http::status::too_many_requests;
+            }
+            return std::nullopt;
+        }
+
+        void make_response() {
+            response = {};
+            response.version(request.version());
+            response.keep_alive(request.keep_alive());
+            response.set(boost::beast::http::field::content_type,
+                "application/json");
+            if (auto status = fail()) {
+                response.result(*status);
+                if (*status == boost::beast::http::status::too_many_requests) {
+                    response.set(boost::beast::http::field::retry_after, "1");
+                }
+                response.body() = "{\"error\":\"Mock failure\"}";
+                response.prepare_payload();
+                return;
+            }
+            auto target = std::string_view(request.target().data(),
+                request.target().size());
+            auto shape = config.shape;
+            if (shape == Shape::Auto) {
+                shape = target.rfind("/geocoding/", 0) == 0 ? Shape::MapQuest
+                    : Shape::Here;
+            }
+            json body;
+            try {
+                if (target.rfind("/6.2/reversegeocode.json", 0) == 0) {
+                    auto point = query_parameter(target, "prox");
+                    body = here_reverse(point, place_near(point,
+                        config.not_found_rate));
+                } else if (target.rfind("/geocoding/v1/reverse", 0) == 0) {
+                    auto point = query_parameter(target, "location");
+                    body = mapquest_reverse(point, place_near(point,
+                        config.not_found_rate));
+                } else if (shape == Shape::Here) {
+                    body = here_body(locate(query_parameter(target,
+                        "searchtext"), config.not_found_rate));
+                } else if (request.method()
+                    == boost::beast::http::verb::post)
+                {
+                    // Batch request.
+                    auto results = json::array();
+                    auto batch = json::parse(request.body());
+                    for (auto& location: batch.at("locations")) {
+                        results.push_back(mapquest_result(locate(
+                            encode_location(location.get<std::string>()),
+                            config.not_found_rate)));
+                    }
+                    body = {{"results", std::move(results)}};
+                } else {
+                    body = {{"results", {mapquest_result(locate(
+                        query_parameter(target, "location"),
+                        config.not_found_rate))}}};
+                }
+            } catch (const json::exception&) {
+                response.result(boost::beast::http::status::bad_request);
+                response.prepare_payload();
+                return;
+            }
+            response.result(boost::beast::http::status::ok);
+            response.body() = pad(body, config.response_bytes);
+            response.prepare_payload();
+        }
+
+        void on_request(boost::system::error_code ec) {
+            if (ec) {return;}
+            make_response();
+            auto this_ = shared_from_this();
+            timer.expires_after(delay());
+            timer.async_wait([this_] (boost::system::error_code) {
+                this_->write_response();
+            });
+        }
+
+        void read_request() {
+            auto this_ = shared_from_this();
+            request = {};
+            boost::beast::http::async_read(stream, buffer, request,
+                [this_] (boost::system::error_code ec, std::size_t) {
+                    this_->on_request(ec);
+                });
+        }
+
+        void write_response() {
+            auto this_ = shared_from_this();
+            boost::beast::http::async_write(stream, response,
+                [this_] (boost::system::error_code ec, std::size_t) {
+                    if (ec) {return;}
+                    if (!this_->response.keep_alive()) {
+                        this_->stream.async_shutdown(
+                            [this_] (boost::system::error_code) {});
+                        return;
+                    }
+                    this_->read_request();
+                });
+        }
+
+    private:
+        TlsStream stream;
+        boost::asio::steady_timer timer;
+        const MockConfiguration& config;
+        boost::beast::flat_buffer buffer;
+        Request request;
+        Response response;
+    };
+
+    class Server: public std::enable_shared_from_this<Server> {
+    private:
+        struct Priv {};
+
+    public:
+        explicit Server(boost::asio::io_context& ioc,
+            boost::asio::ip::tcp::endpoint endpoint,
+            boost::asio::ssl::context& tls, const MockConfiguration& config,
+            Priv
+        ):
+            ioc(ioc),
+            acceptor(ioc, endpoint),
+            tls(tls),
+            config(config)
+        {}
+
+        static std::shared_ptr<Server> make(boost::asio::io_context& ioc,
+            boost::asio::ip::tcp::endpoint endpoint,
+            boost::asio::ssl::context& tls, const MockConfiguration& config)
+        {
+            return std::make_shared<Server>(ioc, endpoint, tls, config,
+                Priv {});
+        }
+
+        boost::asio::ip::tcp::endpoint local_endpoint() const {
+            return acceptor.local_endpoint();
+        }
+
+        void run() {accept();}
+
+    private:
+        void accept() {
+            auto this_ = shared_from_this();
+            acceptor.async_accept(boost::asio::make_strand(ioc),
+                [this_] (boost::system::error_code ec,
+                    boost::asio::ip::tcp::socket socket)
+                {
+                    if (!ec) {
+                        Session::make(std::move(socket), this_->tls,
+                            this_->config)->run();
+                    }
+                    this_->accept();
+                });
+        }
+
+    private:
+        boost::asio::io_context& ioc;
+        boost::asio::ip::tcp::acceptor acceptor;
+        boost::asio::ssl::context& tls;
+        const MockConfiguration& config;
+    };
+
+    boost::asio::ip::tcp::endpoint parse_endpoint(const std::string& s) {
+        auto sep = s.find_last_of(':');
+        if (sep == std::string::npos) {
+            throw std::invalid_argument("Invalid address. Missing colon "
+                "and port.");
+        }
+        return boost::asio::ip::tcp::endpoint(
+            boost::asio::ip::make_address(s.substr(0, sep)),
+            static_cast<unsigned short>(std::stoul(s.substr(sep + 1))));
+    }
+
+    void print_help_header() {
+        auto help = "Mock Here and MapQuest backend for benchmarks\n\n"
+            "Usage: geocode_mock_backend [OPTIONS] --cert-out=<PEM>\n\n"
+            "Serves HTTPS with a self-signed certificate, written to the "
+            "given file for\nthe proxy to trust. Responses are shaped like "
+            "those of the service the\nrequest target belongs to, with "
+            "coordinates derived from the location.\n";
+        std::cout << help << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        boost::program_options::options_description options("Options");
+        options.add_options()
+            ("address,a", boost::program_options::value<std::string>()
+                ->default_value("127.0.0.1:9443"),
+                "Address and port to listen on")
+            ("cert-out", boost::program_options::value<std::string>(),
+                "File to write the certificate to")
+            ("distribution", boost::program_options::value<std::string>()
+                ->default_value("fixed"),
+                "Latency distribution: \"fixed\", \"exponential\" (of the "
+                "given mean) or \"lognormal\" (of the given median)")
+            ("error-rate", boost::program_options::value<double>()
+                ->default_value(0),
+                "Fraction of requests answered with status 500")
+            ("help,h", "Display help message")
+            ("latency-ms", boost::program_options::value<double>()
+                ->default_value(0),
+                "Response latency in milliseconds")
+            ("names", boost::program_options::value<std::string>(),
+                "Subject alternative names of the certificate [default: "
+                "DNS:localhost and the listening IP address]")
+            ("not-found-rate", boost::program_options::value<double>()
+                ->default_value(0),
+                "Fraction of locations not found")
+            ("response-bytes", boost::program_options::value<std::size_t>()
+                ->default_value(0),
+                "Minimum size of response bodies")
+            ("shape", boost::program_options::value<std::string>()
+                ->default_value("auto"),
+                "Response shape: \"here\", \"mapquest\", or \"auto\" to "
+                "follow the request target")
+            ("sigma", boost::program_options::value<double>()
+                ->default_value(0.5),
+                "Standard deviation of the logarithm of log-normal latencies")
+            ("threads,t", boost::program_options::value<unsigned int>()
+                ->default_value(1),
+                "Number of threads")
+            ("throttle-rate", boost::program_options::value<double>()
+                ->default_value(0),
+                "Fraction of requests answered with status 429 and a "
+                "Retry-After of one second");
+        boost::program_options::variables_map vm;
+        boost::program_options::store(
+            boost::program_options::parse_command_line(argc, argv, options),
+            vm);
+        boost::program_options::notify(vm);
+        if (vm.count("help")) {
+            print_help_header();
+            std::cout << options << std::endl;
+            return 0;
+        }
+        if (!vm.count("cert-out")) {
+            std::cerr << "Missing \"cert-out\" parameter" << std::endl;
+            return 1;
+        }
+        MockConfiguration config {
+            std::chrono::duration<double, std::milli>(
+                vm["latency-ms"].as<double>()),
+            Distribution::Fixed,
+            vm["sigma"].as<double>(),
+            vm["error-rate"].as<double>(),
+            vm["throttle-rate"].as<double>(),
+            vm["not-found-rate"].as<double>(),
+            vm["response-bytes"].as<std::size_t>(),
+            Shape::Auto
+        };
+        auto distribution = vm["distribution"].as<std::string>();
+        if (distribution == "exponential") {
+            config.distribution = Distribution::Exponential;
+        } else if (distribution == "lognormal") {
+            config.distribution = Distribution::LogNormal;
+        } else if (distribution != "fixed") {
+            std::cerr << "Invalid \"distribution\" parameter" << std::endl;
+            return 1;
+        }
+        auto shape = vm["shape"].as<std::string>();
+        if (shape == "here") {
+            config.shape = Shape::Here;
+        } else if (shape == "mapquest") {
+            config.shape = Shape::MapQuest;
+        } else if (shape != "auto") {
+            std::cerr << "Invalid \"shape\" parameter" << std::endl;
+            return 1;
+        }
+        auto endpoint = parse_endpoint(vm["address"].as<std::string>());
+        auto names = vm.count("names") ? vm["names"].as<std::string>()
+            : "DNS:localhost,IP:" + endpoint.address().to_string();
+        auto certificate = make_certificate(names);
+        boost::filesystem::ofstream os(vm["cert-out"].as<std::string>(),
+            std::ios::binary);
+        os << certificate.certificate;
+        os.close();
+        if (!os) {throw std::runtime_error("Failed to write certificate");}
+        boost::asio::ssl::context tls(boost::asio::ssl::context::tls_server);
+        tls.use_certificate(boost::asio::buffer(certificate.certificate),
+            boost::asio::ssl::context::pem);
+        tls.use_private_key(boost::asio::buffer(certificate.private_key),
+            boost::asio::ssl::context::pem);
+        auto threads = std::max(vm["threads"].as<unsigned int>(), 1u);
+        boost::asio::io_context ioc(static_cast<int>(threads));
+        auto server = Server::make(ioc, endpoint, tls, config);
+        server->run();
+        std::cout << "Mock backend listening on " << server->local_endpoint()
+            << std::endl;
+        std::vector<std::thread> pool;
+        for (unsigned int i = 1; i < threads; ++i) {
+            pool.emplace_back([&ioc] {ioc.run();});
+        }
+        ioc.run();
+        for (auto& thread: pool) {thread.join();}
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Exiting with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,287 @@
+// Copyright (C) 2018 Stephane Raux. Distributed under the MIT license.
+
+// Checks that scanning backend responses gives the results that parsing them
+// into a JSON document did, on recorded responses and on mutations of them.
+//
+// Usage: geocode_protocol_test <directory of recorded responses>
+
+#include "geocode/protocol_here.hpp"
+#include "geocode/protocol_mapquest.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/path.hpp>
+#include <charconv>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace {
+    // Mutations tried per recorded response.
+    const std::size_t MUTATIONS = 20000;
+
+    // Characters inserted by mutations, chosen to alter the structure of the
+    // documents and their numbers.
+    const char MUTATION_CHARS[] = "{}[],:\" \\-+.0123456789eEinfatrul";
+
+    // Outcome of parsing a response, written as text to compare outcomes and
+    // report them: the coordinates found, or the kind of error. A batch has
+    // the outcomes of its locations separated by semicolons. Invalid means
+    // the response is not a JSON document, or has a number too large to
+    // read.
+    using Parser = std::function<std::string(const Response&)>;
+
+    const char INVALID[] = "Invalid";
+
+    // Identifier of the exception thrown while parsing a number out of the
+    // range of double.
+    const int NUMBER_OVERFLOW = 406;
+
+    void append_number(std::string& out, double value) {
+        char buf[32];
+        auto end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        out.append(buf, static_cast<std::size_t>(end - buf));
+    }
+
+    std::string describe(const Coordinates& coords) {
+        std::string out;
+        append_number(out, coords.latitude);
+        out.push_back(',');
+        append_number(out, coords.longitude);
+        return out;
+    }
+
+    std::string describe(const ProtocolResult& result) {
+        if (auto coords = std::get_if<Coordinates>(&result)) {
+            return describe(*coords);
+        }
+        return to_string(std::get<Error>(result).kind);
+    }
+
+    std::string describe(const std::vector<ProtocolResult>& results) {
+        std::string out;
+        for (auto& result: results) {
+            if (!out.empty()) {out.push_back(';');}
+            out.append(describe(result));
+        }
+        return out;
+    }
+
+    // Runs a parser, turning its exceptions into outcomes.
+    std::string outcome(const Parser& parser, const Response& resp) {
+        try {
+            return parser(resp);
+        } catch (const LocationNotFoundError&) {
+            return to_string(ErrorKind::LocationNotFound);
+        } catch (const json::parse_error&) {
+            return INVALID;
+        } catch (const json::out_of_range& e) {
+            return e.id == NUMBER_OVERFLOW ? INVALID
+                : to_string(ErrorKind::BackendFailure);
+        } catch (const std::exception&) {
+            return to_string(ErrorKind::BackendFailure);
+        }
+    }
+
+    // Parsing as it was done before the scanner.
+    Coordinates here_dom(const Response& resp) {
+        auto j = json::parse(resp.body());
+        const auto& views = j.at("/Response/View"_json_pointer);
+        if (views.empty()) {throw LocationNotFoundError("No match");}
+        const auto& coords = views.at("/0/Result/0/Location/"
+            "DisplayPosition"_json_pointer);
+        auto latitude = coords.at("Latitude").get<double>();
+        auto longitude = coords.at("Longitude").get<double>();
+        return Coordinates {latitude, longitude};
+    }
+
+    Coordinates mapquest_dom_result(const json& result) {
+        const auto& locations = result.at("locations");
+        if (locations.empty()) {throw LocationNotFoundError("No match");}
+        const auto& coords = locations.at("/0/latLng"_json_pointer);
+        auto latitude = coords.at("lat").get<double>();
+        auto longitude = coords.at("lng").get<double>();
+        return Coordinates {latitude, longitude};
+    }
+
+    Coordinates mapquest_dom(const Response& resp) {
+        auto j = json::parse(resp.body());
+        return mapquest_dom_result(j.at("/results/0"_json_pointer));
+    }
+
+    std::vector<ProtocolResult> mapquest_batch_dom(const Response& resp,
+        std::size_t count)
+    {
+        auto j = json::parse(resp.body());
+        const auto& results = j.at("results");
+        if (results.size() != count) {
+            throw std::runtime_error("Unexpected number of batch results");
+        }
+        std::vector<ProtocolResult> parsed;
+        for (const auto& result: results) {
+            ProtocolResult item;
+            try {
+                item = mapquest_dom_result(result);
+            } catch (const LocationNotFoundError& e) {
+                item = Error {ErrorKind::LocationNotFound, e.what()};
+            } catch (const std::exception& e) {
+                item = Error {ErrorKind::BackendFailure, e.what()};
+            }
+            parsed.push_back(std::move(item));
+        }
+        return parsed;
+    }
+
+    struct Case {
+        const char* file;
+        Parser scan;
+        Parser dom;
+    };
+
+    std::vector<Case> cases() {
+        auto here_scan = [] (const Response& resp) {
+            return describe(ProtocolTraits<Here>::parse(resp));
+        };
+        auto here = [] (const Response& resp) {
+            return describe(here_dom(resp));
+        };
+        auto mapquest_scan = [] (const Response& resp) {
+            return describe(ProtocolTraits<MapQuest>::parse(resp));
+        };
+        auto mapquest = [] (const Response& resp) {
+            return describe(mapquest_dom(resp));
+        };
+        auto batch_scan = [] (const Response& resp) {
+            return describe(ProtocolTraits<MapQuest>::parse_batch(resp, 3));
+        };
+        auto batch = [] (const Response& resp) {
+            return describe(mapquest_batch_dom(resp, 3));
+        };
+        return {
+            {"here_found.json", here_scan, here},
+            {"here_not_found.json", here_scan, here},
+            {"mapquest_found.json", mapquest_scan, mapquest},
+            {"mapquest_not_found.json", mapquest_scan, mapquest},
+            {"mapquest_batch.json", batch_scan, batch},
+        };
+    }
+
+    std::string read_file(const boost::filesystem::path& path) {
+        boost::filesystem::ifstream is(path, std::ios::binary);
+        if (!is) {throw std::runtime_error("Failed to open " + path.string());}
+        return std::string(std::istreambuf_iterator<char>(is),
+            std::istreambuf_iterator<char>());
+    }
+
+    Response make_response(std::string body) {
+        Response resp;
+        resp.result(boost::beast::http::status::ok);
+        resp.body() = std::move(body);
+        return resp;
+    }
+
+    // A scanned outcome is consistent with the DOM if the scanner failed, or
+    // found what the DOM found. The scanner does not validate the parts of
+    // a document it skips, so for a document that is not JSON it may also
+    // find what it found before the mutation.
+    bool consistent(const std::string& scanned, const std::string& dom,
+        const std::string& original)
+    {
+        return scanned == to_string(ErrorKind::BackendFailure)
+            || scanned == dom || (dom == INVALID && scanned == original);
+    }
+
+    std::string mutate(std::string text, std::mt19937& random) {
+        auto position = std::uniform_int_distribution<std::size_t>(0,
+            text.size() - 1)(random);
+        auto c = MUTATION_CHARS[std::uniform_int_distribution<std::size_t>(0,
+            sizeof(MUTATION_CHARS) - 2)(random)];
+        switch (std::uniform_int_distribution<int>(0, 3)(random)) {
+        case 0:
+            text[position] = c;
+            break;
+        case 1:
+            text.erase(position, 1);
+            break;
+        case 2:
+            text.insert(position, 1, c);
+            break;
+        default:
+            text.resize(position);
+            break;
+        }
+        return text;
+    }
+
+    // Numbers that std::from_chars reads but JSON does not allow, put in
+    // place of the latitude of a response.
+    bool check_invalid_numbers(const std::string& text) {
+        const char* tokens[] = {"inf", "-inf", "infinity", "nan", "NAN",
+            "+1", "01", "1.", ".5", "1e", "1e+", "-", "0x10", "1.5.2"};
+        const std::string target = "49.2801599";
+        auto position = text.find(target);
+        bool ok = true;
+        for (auto token: tokens) {
+            auto mutated = text;
+            mutated.replace(position, target.size(), token);
+            auto scanned = outcome([] (const Response& resp) {
+                return describe(ProtocolTraits<Here>::parse(resp));
+            }, make_response(mutated));
+            if (scanned != to_string(ErrorKind::BackendFailure)) {
+                std::cerr << "Accepted latitude " << token << ": " << scanned
+                    << std::endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: geocode_protocol_test <responses>" << std::endl;
+        return 2;
+    }
+    boost::filesystem::path dir = argv[1];
+    bool ok = true;
+    std::mt19937 random(42);
+    for (auto& test: cases()) {
+        auto text = read_file(dir / test.file);
+        auto resp = make_response(text);
+        auto original = outcome(test.scan, resp);
+        auto dom = outcome(test.dom, resp);
+        if (original != dom) {
+            std::cerr << test.file << ": scanned " << original << ", DOM "
+                << dom << std::endl;
+            ok = false;
+            continue;
+        }
+        std::size_t failures = 0;
+        for (std::size_t i = 0; i < MUTATIONS; ++i) {
+            auto mutated = make_response(mutate(text, random));
+            auto scanned = outcome(test.scan, mutated);
+            auto expected = outcome(test.dom, mutated);
+            if (consistent(scanned, expected, original)) {continue;}
+            if (failures++ == 0) {
+                std::cerr << test.file << ": scanned " << scanned << ", DOM "
+                    << expected << " for:\n" << mutated.body() << std::endl;
+            }
+        }
+        if (failures > 0) {
+            std::cerr << test.file << ": " << failures << " of " << MUTATIONS
+                << " mutations inconsistent" << std::endl;
+            ok = false;
+        }
+    }
+    ok = check_invalid_numbers(read_file(dir / "here_found.json")) && ok;
+    if (!ok) {return 1;}
+    std::cout << "Scanned responses match their DOM" << std::endl;
+    return 0;
+}